@@ -12,6 +12,9 @@
 #include <getopt.h>
 #include "date2mjd_ld.c"
 #include "ascii_header.c"
+#include "blkread.h"
+#include "vdifchan.h"
+#include "dadawriter.h"
 
 #define DADAHDR_SIZE 4096
 
@@ -31,6 +34,8 @@ void usage(char *prg_name)
 	   " -R    RA (by default 00:00:00.00)\n"
 	   " -D    Dec (by default -00:00:00.00)\n"
            " -O    Route for output\n"
+	   " -M    MB read from each file at a time (by default 8)\n"
+	   " -d    Write output with O_DIRECT\n"
 	   " -h    Available options\n",
 	  prg_name);
   exit(0);
@@ -38,9 +43,12 @@ void usage(char *prg_name)
 
 main(int argc, char *argv[])
 {
-  FILE *bb[4],*dadahdr,*odada;
-  int arg,len,ibg,i,j,f,ied,ndim,fct,nblk,k,npol,ctblk,bs,ct;
-  char hdrbuff[DADAHDR_SIZE],oroute[1024],bbbase[2][1024],bbname[2][1024],dadaname[1024],hdrname[1024],ut[32],srcname[1024],dat,mjd[64],*dblk,*blkp0,*blkp1,ra[64],dec[64];
+  FILE *dadahdr;
+  struct blkread *bb[2];
+  struct blkread_buf *rb[2];
+  struct dadawriter *odada;
+  int arg,len,ibg,i,j,f,ied,ndim,fct,nblk,k,npol,ctblk,bs,ct,nrd,nunit,wflags;
+  char hdrbuff[DADAHDR_SIZE],oroute[1024],bbbase[2][1024],bbname[2][1024],stem[1024],hdrname[1024],ut[32],srcname[1024],dat,mjd[64],ra[64],dec[64];
   float freq,bw;
   double ts;
   long fsize,sampct,nblkout,UDPsize;
@@ -66,14 +74,14 @@ main(int argc, char *argv[])
   nblk=4096;
   npol=2;
   ctblk=0;
+  wflags=0;
   //Size of one UDP file
   UDPsize=2147483648;
   // Number of unloaded blks from each UDP file to each dada file (close to 10s)
   //nblkout=2197266;
   nblkout=524288;
-  blkp0=(char *)malloc(sizeof(char)*nblk);
-  blkp1=(char *)malloc(sizeof(char)*nblk);
-  dblk=(char *)malloc(sizeof(char)*nblk*npol);
+  // Bytes read from each UDP file at a time
+  nrd=BLKREAD_BLOCK;
   strcpy(ra,"00:00:00.00");
   strcpy(dec,"-00:00:00.00");
   memset(hdrbuff,0,DADAHDR_SIZE);
@@ -86,7 +94,7 @@ main(int argc, char *argv[])
       exit(0);
     }
 
-  while((arg=getopt_long(argc,argv,"hX:Y:S:f:b:O:T:N:i:R:D:s:",longopts,NULL)) != -1)
+  while((arg=getopt_long(argc,argv,"hX:Y:S:f:b:O:T:N:i:R:D:s:M:d",longopts,NULL)) != -1)
     {
       switch(arg)
 	{
@@ -110,6 +118,14 @@ main(int argc, char *argv[])
 	  bw=atof(optarg);
 	  break;
 
+	case 'M':
+	  nrd=atoi(optarg)*1048576;
+	  break;
+
+	case 'd':
+	  wflags|=DADAWRITER_ODIRECT;
+	  break;
+
 	case 'O':
 	  strcpy(oroute,optarg);
 	  break;
@@ -186,6 +202,14 @@ main(int argc, char *argv[])
       exit(0);
     }
 
+  if(nrd<nblk)
+    {
+      fprintf(stderr,"Error: Wrong reading block size.\n");
+      exit(0);
+    }
+  // Whole blocks of the UDP files only
+  nrd=nrd/nblk*nblk;
+
   // Sampling interval
   ts=1.0/(double)bw/2*ndim;
 
@@ -218,12 +242,6 @@ main(int argc, char *argv[])
   ascii_header_set(hdrbuff,"TSAMP","%.10lf",ts);
   ascii_header_set(hdrbuff,"MJD_START","%s",mjd);
 
-  // Specified header values for the first file
-  sprintf(dadaname,"%s/%s_%.0f_%016ld.000000.dada",oroute,ut,freq,fsize*fct+UDPsize*(ibg-1)*2);
-  ascii_header_set(hdrbuff,"FILE_SIZE","%ld",fsize);
-  ascii_header_set(hdrbuff,"FILE_NAME","%s",dadaname);
-  ascii_header_set(hdrbuff,"OBS_OFFSET","%ld",fsize*fct+UDPsize*(ibg-1)*2);
-
   // Check file existence
   printf("Checking available files...\n");
   for(j=0;;j++)
@@ -244,19 +262,20 @@ main(int argc, char *argv[])
     }
   printf("Index starts: %i; Index ends: %i\n",ibg,ied);
   
-  odada=fopen(dadaname,"wb");
-  fwrite(hdrbuff,1,DADAHDR_SIZE,odada);
+  // Output in large aligned writes, a new file every fsize bytes
+  sprintf(stem,"%s_%.0f",ut,freq);
+  odada=dadawriter_open(hdrbuff,DADAHDR_SIZE,oroute,stem,UDPsize*(ibg-1)*2,fsize,wflags,1);
 
   printf("Start data conversion...\n");
   // Main loop
   for(j=ibg;j<=ied;j++)
     {
       printf("Working on index %i...\n",j);
-      // Open UDP files
+      // Open UDP files, each read ahead from a thread of its own
       for(i=0;i<2;i++)
         {
           sprintf(bbname[i],"%s_%04i.dat",bbbase[i],j);
-	  bb[i]=fopen(bbname[i],"rb");
+	  bb[i]=blkread_open(bbname[i],nrd,4);
 	  if(bb[i]==NULL)
 	    {
 	      fprintf(stderr,"Error: Cannot open %s.\n",bbname[i]);
@@ -264,49 +283,46 @@ main(int argc, char *argv[])
 	    }
 	}
       do{
-	// Copy samples
-	fread(blkp0,sizeof(char)*nblk,1,bb[0]);
-	fread(blkp1,sizeof(char)*nblk,1,bb[1]);
-	if(feof(bb[0])==1 || feof(bb[1])==1) break;
-	for(k=0;k<nblk;k++)
+	// Next block of each file, complete UDP blocks of both only
+	nunit=nrd/nblk;
+	for(i=0;i<2;i++)
 	  {
-	    dblk[k*npol]=blkp0[k];
-	    dblk[k*npol+1]=blkp1[k];
+	    rb[i]=blkread_get(bb[i]);
+	    if(rb[i]==NULL)
+	      nunit=0;
+	    else if(rb[i]->len/nblk<nunit)
+	      nunit=rb[i]->len/nblk;
 	  }
-	fwrite(dblk,sizeof(char)*nblk*npol,1,odada);
-	sampct+=nblk;
+	if(nunit==0) break;
 
-	ctblk++;		  
-	ct++;
-	// If end dada, close and open
-	if(ctblk==nblkout)
+	for(k=0;k<nunit;k++)
 	  {
-	    // Close written file
-	    fclose(odada);
-	    fct++;
-	    printf("%s unloaded.\n",dadaname);
-
-	    // Prepare for the next file
-	    //sprintf(dadaname,"%s/%s_%.0f_%016ld.000000.dada",oroute,ut,freq,fsize*fct);
-	    sprintf(dadaname,"%s/%s_%.0f_%016ld.000000.dada",oroute,ut,freq,fsize*fct+UDPsize*(ibg-1)*2);
-	    ascii_header_set(hdrbuff,"FILE_SIZE","%ld",fsize);
-	    ascii_header_set(hdrbuff,"FILE_NAME","%s",dadaname);
-	    ascii_header_set(hdrbuff,"OBS_OFFSET","%ld",fsize*fct+UDPsize*(ibg-1)*2);
-	    odada=fopen(dadaname,"wb");
-	    fwrite(hdrbuff,1,DADAHDR_SIZE,odada);
-
-	    // Reset sample count
-	    sampct=0;
-	    ctblk=0;
+	    // Copy samples
+	    vdifchan_interleave(dadawriter_reserve(odada,nblk*npol),rb[0]->data+k*nblk,rb[1]->data+k*nblk,nblk);
+	    sampct+=nblk;
+
+	    ctblk++;
+	    ct++;
+	    // Next dada file
+	    if(ctblk==nblkout)
+	      {
+		fct++;
+		sampct=0;
+		ctblk=0;
+	      }
 	  }
+
+	for(i=0;i<2;i++)
+	  blkread_release(bb[i]);
+	// A short block is the end of the files
+	if(nunit<nrd/nblk) break;
       }while(1);
 
       printf("Read %i\n",ct);
       // Close up
       for(i=0;i<2;i++)
-	fclose(bb[i]);
+	blkread_close(bb[i]);
       printf("Index %i finished.\n",j);
     }
-  fclose(odada);
-  printf("%s unloaded.\n",dadaname);
+  dadawriter_close(odada);
 }
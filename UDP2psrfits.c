@@ -1,6 +1,7 @@
-//Convert UDP to psrfits search mode format in 32-bit float
+//Convert UDP to psrfits search mode format in 32-bit float, or requantised to 8 or 4 bits
 //Each UDP file corresponds to one offload fits file
 //FFT length in unit of nblk=4096 in UDP file
+//With -U the four streams are captured live from their UDP ports instead
 
 #include <stdio.h>
 #include <unistd.h>
@@ -15,7 +16,12 @@
 #include <getopt.h>
 #include <malloc.h>
 #include <stdbool.h>
+#include <limits.h>
 #include "psrfits.h"
+#include "vdifdet.h"
+#include "psrwriter.h"
+#include "vdifstat.h"
+#include "udpcap.h"
 
 int usage(char *prg_name)
 {
@@ -25,6 +31,11 @@ int usage(char *prg_name)
            " --xe Second pol0 file base\n"
            " --yo First pol1 file base\n"
            " --ye Second pol1 file base\n"
+	   " -U   Capture live from UDP, --xo, --xe, --yo and --ye then give [address:]port of each stream\n"
+	   " -P   Bytes of samples per packet (by default 4096)\n"
+	   " -H   Bytes of packet header, a 64-bit big-endian packet counter first (by default 8)\n"
+	   " -r   Socket receive buffer per stream (MB, by default 256)\n"
+	   " -w   Seconds without packets that end the capture (by default 5)\n"
            " -T   Starting UT in Yr-Mon-Dat-hr:min:sec (e.g., 2017-01-01-01:03:05)\n"
            " -f   Central frequency (MHz)\n"
            " -b   Bandwidth (MHz)\n"
@@ -34,12 +45,18 @@ int usage(char *prg_name)
            " -i   Start index (by default 1)\n"
 	   " -j   End index (by default the last available)\n"
 	   " -n   FFT length factor, need to be power of 2 (by default 1) up to 128\n"
+	   " -e   Plan FFT with FFTW_PATIENT, slow but the wisdom is cached for later runs\n"
 	   " -t   Time sample scrunch factor, need to be power of 2 (by default 1)\n"
 	   " -S   Source name\n"
 	   " -l   Low-end frequency for unload (MHz)\n"
 	   " -u   Up-end frequency for unload (MHz)\n"
 	   " -s   Band sense (1 for upper, -1 for lower, by default 1)\n"
 	   " -D   Ouput data status (I for Stokes I, C for coherence product, X for pol0 I, Y for pol1 I, by default I)\n"
+	   " -m   Average so many output time samples together (by default 1)\n"
+	   " -g   Average so many adjacent channels together (by default 1)\n"
+	   " -B   Bits per output sample, 32 (float), 8 or 4 (by default 32)\n"
+	   " -R   Scale 8 or 4-bit output with the running statistics over so many seconds instead of those of each subint\n"
+	   " -F   Seconds between flushes of the output file to disk, 0 for every subint (by default 10)\n"
            " -O   Route for output\n"
 	   " -h   Available options\n",
           prg_name);
@@ -51,18 +68,34 @@ bool IsPowerofTwo(uint x)
   return (x&(x-1))==0;
 }
 
+// Read nblk samples of stream i, from its file or its socket; 0 once the capture has ended
+int read_stream(FILE **bb, struct udpcap **cap, int i, char *dst, int nblk)
+{
+  if(cap[i]!=NULL)
+    return udpcap_read(cap[i],dst,nblk)==nblk;
+  fread(dst,sizeof(char)*nblk,1,bb[i]);
+  return 1;
+}
+
 int main(int argc, char *argv[])
 {
   FILE *bb[4];
   char oroute[1024],bbbase[4][1024],bbname[4][1024],ut[32],srcname[1024],dstat,ra[16],dec[16];
-  int arg,ibg,ied,i,j,k,t,s,npol,nchan,bs,nblk,nsub_ed,ncyc,lf_idx,uf_idx,fd,imjd;
-  float freq,bw,lf,uf;
+  int arg,ibg,ied,i,j,k,t,s,npol,nchan,bs,nblk,nsub_ed,ncyc,lf_idx,uf_idx,fd,imjd,nbits,dsf[2];
+  int live,hdrbytes,payload,rcvbuf,more;
+  float freq,bw,lf,uf,flush_sec,s_run,idle;
+  int64_t first,start;
+  unsigned char *dst;
   char *bufp0,*bufp1;
+  struct udpdet *udet;
+  struct udpcap *cap[4];
   double fmjd;
   long double ts;
   long UDPsize, UDPsize_ed;
   unsigned int tsf,len;
   struct psrfits pf;
+  struct psrwriter *pw;
+  struct ewstat *qes;
   struct stat filestat;
   struct option longopts[]={
     {"xo", required_argument, NULL, 'W'},
@@ -86,6 +119,16 @@ int main(int argc, char *argv[])
   UDPsize=2147483648; // 2 GB
   UDPsize_ed=UDPsize;
   nblk=4096;
+  flush_sec=10.0;
+  nbits=32;
+  dsf[0]=1;
+  dsf[1]=1;
+  s_run=0.0;
+  live=0;
+  hdrbytes=8;
+  payload=4096;
+  rcvbuf=256;
+  idle=5.0;
   strcpy(ra,"00:00:00");
   strcpy(dec,"+00:00:00");
   strcpy(srcname,"Not given");
@@ -99,7 +142,7 @@ int main(int argc, char *argv[])
     }
   
   // Read arguments
-  while((arg=getopt_long(argc,argv,"hf:b:O:T:N:t:i:j:l:u:s:D:A:C:n:",longopts,NULL)) != -1)
+  while((arg=getopt_long(argc,argv,"hf:b:O:T:N:t:i:j:l:u:s:D:A:C:n:eF:B:R:m:g:UP:H:r:w:",longopts,NULL)) != -1)
     {
       switch(arg)
         {
@@ -143,6 +186,50 @@ int main(int argc, char *argv[])
 	  len=atoi(optarg);
 	  break;
 
+	case 'e':
+	  fftwisdom_patient(1);
+	  break;
+
+	case 'F':
+	  flush_sec=atof(optarg);
+	  break;
+
+	case 'B':
+	  nbits=atoi(optarg);
+	  break;
+
+	case 'R':
+	  s_run=atof(optarg);
+	  break;
+
+	case 'm':
+	  dsf[0]=atoi(optarg);
+	  break;
+
+	case 'g':
+	  dsf[1]=atoi(optarg);
+	  break;
+
+	case 'U':
+	  live=1;
+	  break;
+
+	case 'P':
+	  payload=atoi(optarg);
+	  break;
+
+	case 'H':
+	  hdrbytes=atoi(optarg);
+	  break;
+
+	case 'r':
+	  rcvbuf=atoi(optarg);
+	  break;
+
+	case 'w':
+	  idle=atof(optarg);
+	  break;
+
 	case 't':
 	  tsf=atoi(optarg);
 	  break;
@@ -225,6 +312,11 @@ int main(int argc, char *argv[])
       fprintf(stderr,"Not recognized status for output data.\n");
       exit(0);
     }
+  if(nbits!=32 && nbits!=8 && nbits!=4)
+    {
+      fprintf(stderr,"Error: Invalid number of bits per output sample.\n");
+      exit(0);
+    }
   if(lf<0)
     {
       fprintf(stderr,"Error: Low-end frequency for unload not given.\n");
@@ -260,6 +352,11 @@ int main(int argc, char *argv[])
     fprintf(stderr,"Error: Invalid FFT length factor %i.\n",len);
     exit(0);
   }
+  if(live && (payload<1 || hdrbytes<8 || rcvbuf<1 || idle<=0.0))
+    {
+      fprintf(stderr,"Error: Invalid packet layout or capture settings.\n");
+      exit(0);
+    }
 
   // Detection blocks
   float det[nblk*len+1][4],sdet[nblk*len+1][4];
@@ -289,36 +386,45 @@ int main(int argc, char *argv[])
   printf("Channel indices to keep: %i to %i; Total: %i.\n",lf_idx,uf_idx,nchan);
 
   // Check UDP file existence
-  printf("Check through available UDP files to the end...\n");
-  if(ied == -1)
+  if(live)
+    {
+      // Capture goes on until stopped, file indexes only count 2 GB of each stream
+      ied=INT_MAX;
+      printf("Capture live from UDP, stop with Ctrl-C.\n");
+    }
+  else
     {
-      for(j=0;;j++)
-	{     
-	  // Get file status for odd & even, two pols
-	  for(i=0;i<4;i++)
+      printf("Check through available UDP files to the end...\n");
+      if(ied == -1)
+	{
+	  for(j=0;;j++)
 	    {
-	      sprintf(bbname[i],"%s_%04i.dat",bbbase[i],ibg+j);
-	      fd=open(bbname[i],O_RDONLY);
-	      if(fstat(fd,&filestat)<0)
+	      // Get file status for odd & even, two pols
+	      for(i=0;i<4;i++)
 		{
-		  ied=ibg+j-1;
-		  break;
+		  sprintf(bbname[i],"%s_%04i.dat",bbbase[i],ibg+j);
+		  fd=open(bbname[i],O_RDONLY);
+		  if(fstat(fd,&filestat)<0)
+		    {
+		      ied=ibg+j-1;
+		      break;
+		    }
+		  close(fd);
 		}
-	      close(fd);
+	      if(ied>0) break;
 	    }
-	  if(ied>0) break;
 	}
-    }
 
-  printf("UDP Begin: %04i; End: %04i.\n",ibg,ied);
+      printf("UDP Begin: %04i; End: %04i.\n",ibg,ied);
 
-  // Get minimum size for the last available file
-  for(i=0;i<4;i++)
-    {
-      sprintf(bbname[i],"%s_%04i.dat",bbbase[i],ied);
-      fd=open(bbname[i],O_RDONLY);
-      fstat(fd,&filestat);
-      if(filestat.st_size<UDPsize_ed) UDPsize_ed=filestat.st_size;
+      // Get minimum size for the last available file
+      for(i=0;i<4;i++)
+	{
+	  sprintf(bbname[i],"%s_%04i.dat",bbbase[i],ied);
+	  fd=open(bbname[i],O_RDONLY);
+	  fstat(fd,&filestat);
+	  if(filestat.st_size<UDPsize_ed) UDPsize_ed=filestat.st_size;
+	}
     }
 
   // Set psrfits main header
@@ -369,7 +475,7 @@ int main(int argc, char *argv[])
   pf.hdr.offset_subint = 0;
   pf.hdr.orig_nchan = pf.hdr.nchan;
   pf.hdr.orig_df = pf.hdr.df = pf.hdr.BW / pf.hdr.nchan;
-  pf.hdr.nbits = 32;
+  pf.hdr.nbits = nbits;
   pf.hdr.npol = npol;
   pf.hdr.chan_dm = 0.0;
   pf.hdr.fd_hand = 1;
@@ -378,10 +484,16 @@ int main(int argc, char *argv[])
   pf.hdr.be_phase = 1;
   pf.hdr.nsblk = 1024;
   pf.rows_per_file = ncyc/pf.hdr.nsblk;  // Need to set this based on PSRFITS_MAXFILELEN 
-  pf.hdr.ds_time_fact = 1;
-  pf.hdr.ds_freq_fact = 1;
+  pf.hdr.ds_time_fact = dsf[0];
+  pf.hdr.ds_freq_fact = dsf[1];
   nsub_ed=UDPsize_ed/(nblk*len*tsf)/pf.hdr.nsblk;
   sprintf(pf.basefilename, "%s/%s",oroute,ut);
+
+  if(pf.hdr.ds_time_fact<1 || pf.hdr.ds_freq_fact<1 || pf.hdr.nsblk%pf.hdr.ds_time_fact!=0 || pf.hdr.nchan%pf.hdr.ds_freq_fact!=0)
+    {
+      fprintf(stderr,"Error: Downsampling factors must divide %d samples per subint and %d channels.\n",pf.hdr.nsblk,pf.hdr.nchan);
+      exit(0);
+    }
   
   psrfits_create(&pf);
   
@@ -415,16 +527,59 @@ int main(int argc, char *argv[])
 	  pf.sub.dat_offsets[i] = 0.0;
 	  pf.sub.dat_scales[i] = 1.0;
 	}
+
+  // Channel frequencies and arrays of the downsampled output
+  guppi_update_ds_params(&pf);
   
-  pf.sub.rawdata = (unsigned char *)malloc(pf.sub.bytes_per_subint);
+  pf.sub.rawdata = (unsigned char *)malloc(psrwriter_bytes(&pf));
+
+  // Downsampled or 8 or 4-bit output, detections are reworked from floats
+  pf.sub.fdata = NULL;
+  qes = NULL;
+  if(nbits!=32 || pf.hdr.ds_time_fact>1 || pf.hdr.ds_freq_fact>1)
+    {
+      pf.sub.fdata = (float *)malloc(sizeof(float) * pf.hdr.nchan * pf.hdr.npol * pf.hdr.nsblk);
+      if(s_run>0.0)
+	qes=ewstat_create(pf.hdr.nchan / pf.hdr.ds_freq_fact * pf.hdr.npol, s_run / pf.sub.tsubint);
+    }
+
+  // Subints are written by their own thread, triple buffered
+  pw=psrwriter_start(&pf,3,0,flush_sec,0);
 
   printf("Header prepared.\n");
 
+  // Detection with FFT planned once for all blocks
+  fftwisdom_load("udp",nblk*len*2,1);
+  udet=udpdet_create(nblk*len*2, dstat);
+  fftwisdom_save("udp",nblk*len*2,1);
+
+  // Live streams start together at the first packet counter all of them have
+  for(i=0;i<4;i++)
+    cap[i]=NULL;
+  more=1;
+  if(live)
+    {
+      udpring_catch_sigint();
+      for(i=0;i<4;i++)
+	cap[i]=udpcap_open(bbbase[i],hdrbytes,payload,rcvbuf*1048576,idle);
+      printf("Waiting for packets...\n");
+      start=0;
+      for(i=0;i<4;i++)
+	{
+	  first=udpcap_first(cap[i]);
+	  if(first<0) more=0;
+	  if(first>start) start=first;
+	}
+      for(i=0;i<4;i++)
+	udpcap_seek(cap[i],start);
+      printf("Capture started at packet %ld.\n",(long)start);
+    }
+
   // main loop over UDP files
-  for(j=ibg;j<=ied;j++)
+  for(j=ibg;j<=ied && more;j++)
     {
       // Open UDP files
-      for(i=0;i<4;i++)
+      for(i=0;i<4 && !live;i++)
 	{
 	  sprintf(bbname[i],"%s_%04i.dat",bbbase[i],j);
 	  bb[i]=fopen(bbname[i],"rb");
@@ -454,16 +609,18 @@ int main(int argc, char *argv[])
 	      for(t=0;t<tsf;t++)
 		{
 		  // Read sample block(s)
-		  for(s=0;s<len;s++)
+		  for(s=0;s<len && more;s++)
 		    {
-		      fread(bufp0+sizeof(char)*nblk*2*s,sizeof(char)*nblk,1,bb[0]);
-		      fread(bufp1+sizeof(char)*nblk*2*s,sizeof(char)*nblk,1,bb[2]);
-		      fread(bufp0+sizeof(char)*nblk*2*s+sizeof(char)*nblk,sizeof(char)*nblk,1,bb[1]);
-		      fread(bufp1+sizeof(char)*nblk*2*s+sizeof(char)*nblk,sizeof(char)*nblk,1,bb[3]);
+		      more&=read_stream(bb,cap,0,bufp0+sizeof(char)*nblk*2*s,nblk);
+		      more&=read_stream(bb,cap,2,bufp1+sizeof(char)*nblk*2*s,nblk);
+		      more&=read_stream(bb,cap,1,bufp0+sizeof(char)*nblk*2*s+sizeof(char)*nblk,nblk);
+		      more&=read_stream(bb,cap,3,bufp1+sizeof(char)*nblk*2*s+sizeof(char)*nblk,nblk);
 		    }
+		  // Capture ended, the subint is left incomplete
+		  if(!more) break;
 
 		  // Make detection
-		  getUDPDetection(bufp0, bufp1, nblk*len*2, det, dstat);
+		  getUDPDetection(udet, bufp0, bufp1, det);
 
 		  // Time scrunch     
 		  for(s=0;s<nblk*len+1;s++)
@@ -474,48 +631,62 @@ int main(int argc, char *argv[])
 		      sdet[s][3]+=det[s][3];
 		    }
 		}
+	      if(!more) break;
+
 	      // Value sample blk
+	      dst=(pf.sub.fdata==NULL) ? pf.sub.rawdata : (unsigned char *)pf.sub.fdata;
 	      for(t=lf_idx;t<=uf_idx;t++)
 		{
 		  if(npol==4)
 		    {
-		      memcpy(pf.sub.rawdata+i*sizeof(float)*4*nchan+sizeof(float)*(t-lf_idx),&sdet[t][0],sizeof(float));
-		      memcpy(pf.sub.rawdata+i*sizeof(float)*4*nchan+sizeof(float)*nchan*1+sizeof(float)*(t-lf_idx),&sdet[t][1],sizeof(float));
-		      memcpy(pf.sub.rawdata+i*sizeof(float)*4*nchan+sizeof(float)*nchan*2+sizeof(float)*(t-lf_idx),&sdet[t][2],sizeof(float));
-		      memcpy(pf.sub.rawdata+i*sizeof(float)*4*nchan+sizeof(float)*nchan*3+sizeof(float)*(t-lf_idx),&sdet[t][3],sizeof(float));
+		      memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*(t-lf_idx),&sdet[t][0],sizeof(float));
+		      memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*1+sizeof(float)*(t-lf_idx),&sdet[t][1],sizeof(float));
+		      memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*2+sizeof(float)*(t-lf_idx),&sdet[t][2],sizeof(float));
+		      memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*3+sizeof(float)*(t-lf_idx),&sdet[t][3],sizeof(float));
 		    }
 		  else if(npol==1)
 		    {
-		      memcpy(pf.sub.rawdata+i*sizeof(float)*1*nchan+sizeof(float)*(t-lf_idx),&sdet[t][0],sizeof(float));
+		      memcpy(dst+i*sizeof(float)*1*nchan+sizeof(float)*(t-lf_idx),&sdet[t][0],sizeof(float));
 		    }
 		}
 	    }
 
+	  if(!more) break;
+
 	  // Update offset from Start of subint
 	  pf.sub.offs = (pf.tot_rows + 0.5) * pf.sub.tsubint;
 
-	  // Write subint
-	  psrfits_write_subint(&pf);
+	  // Downsample or requantise, and write subint
+	  if(pf.sub.fdata!=NULL)
+	    pf_fdata_to_rawdata(&pf,qes);
+	  psrwriter_put(pw);
 	  printf("Subint %i written.\n",pf.sub.tsubint);
 
           // Break if it is the last subint to write
           if(j==ied && k==nsub_ed-1) break;
 	}
       // Close UDP files 
-      for(i=0;i<4;i++)
+      for(i=0;i<4 && !live;i++)
 	fclose(bb[i]);
       printf("UDP index %i done.\n",j);
     }
 
   // Close the last file and cleanup
-  fits_close_file(pf.fptr, &(pf.status));
+  psrwriter_finish(pw);
+  for(i=0;i<4;i++)
+    if(cap[i]!=NULL)
+      udpcap_close(cap[i]);
   free(pf.sub.dat_freqs);
   free(pf.sub.dat_weights);
   free(pf.sub.dat_offsets);
   free(pf.sub.dat_scales);
   free(pf.sub.rawdata);
+  free(pf.sub.fdata);
+  if(qes!=NULL)
+    ewstat_destroy(qes);
   free(bufp0);
   free(bufp1);
+  udpdet_destroy(udet);
 
   printf("Wrote %d subints (%f sec) in %d files.\n",pf.tot_rows, pf.T, pf.filenum);
 
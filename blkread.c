@@ -0,0 +1,135 @@
+/* blkread.c */
+// Read-ahead of a file in large blocks from a thread of its own. The
+// thread fills a ring of nbuf blocks and waits only when all of them are
+// full or still in the hands of the caller.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "blkread.h"
+
+static size_t blkread_fill(int fd, char *data, size_t size)
+// Read up to size bytes, fewer only at the end of file or on error
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < size) {
+        n = read(fd, data + got, size - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                perror("blkread");
+            break;
+        }
+        got += n;
+    }
+
+    return got;
+}
+
+static void *blkread_thread(void *arg)
+{
+    struct blkread *r = (struct blkread *)arg;
+    struct blkread_buf *b;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->quit && r->nread - r->nused >= r->nbuf)
+            pthread_cond_wait(&r->cond_used, &r->lock);
+        if (r->quit)
+            break;
+        b = &r->buf[r->nread % r->nbuf];
+        pthread_mutex_unlock(&r->lock);
+
+        b->len = blkread_fill(r->fd, b->data, r->size);
+
+        pthread_mutex_lock(&r->lock);
+        if (b->len > 0)
+            r->nread++;
+        if (b->len < r->size)
+            r->eof = 1;
+        pthread_cond_signal(&r->cond_read);
+        if (r->eof)
+            break;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+struct blkread *blkread_open(const char *name, size_t size, int nbuf)
+{
+    struct blkread *r;
+    int ii;
+
+    if (nbuf < 2)
+        nbuf = 2;
+    r = (struct blkread *)calloc(1, sizeof(struct blkread));
+    r->fd = open(name, O_RDONLY);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    r->size = size;
+    r->nbuf = nbuf;
+    r->buf = (struct blkread_buf *)calloc(nbuf, sizeof(struct blkread_buf));
+    for (ii = 0 ; ii < nbuf ; ii++)
+        r->buf[ii].data = (char *)malloc(size);
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond_read, NULL);
+    pthread_cond_init(&r->cond_used, NULL);
+    if (pthread_create(&r->tid, NULL, blkread_thread, r) != 0) {
+        fprintf(stderr, "Error: Cannot start reading thread for %s.\n", name);
+        exit(1);
+    }
+
+    return r;
+}
+
+struct blkread_buf *blkread_get(struct blkread *r)
+{
+    struct blkread_buf *b = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    while (r->nget == r->nread && !r->eof)
+        pthread_cond_wait(&r->cond_read, &r->lock);
+    if (r->nget < r->nread)
+        b = &r->buf[r->nget++ % r->nbuf];
+    pthread_mutex_unlock(&r->lock);
+
+    return b;
+}
+
+void blkread_release(struct blkread *r)
+{
+    pthread_mutex_lock(&r->lock);
+    if (r->nused < r->nget)
+        r->nused++;
+    pthread_cond_signal(&r->cond_used);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void blkread_close(struct blkread *r)
+{
+    int ii;
+
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_signal(&r->cond_used);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->tid, NULL);
+
+    close(r->fd);
+    for (ii = 0 ; ii < r->nbuf ; ii++)
+        free(r->buf[ii].data);
+    free(r->buf);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond_read);
+    pthread_cond_destroy(&r->cond_used);
+    free(r);
+}
@@ -0,0 +1,45 @@
+/* blkread.h */
+#ifndef _BLKREAD_H
+#define _BLKREAD_H
+#include <stddef.h>
+#include <pthread.h>
+
+// Default size of the blocks read at a time
+#define BLKREAD_BLOCK 8388608
+
+// A block read from the file
+struct blkread_buf {
+    char *data;
+    size_t len;                 // Bytes read, less than the block size only at the end of file
+};
+
+// Sequential reader of a file, reading blocks ahead from a thread of its
+// own, so the reads of several files and the work on the blocks already
+// read all go on at the same time. Blocks are handed out in file order
+// and each stays valid until blkread_release().
+struct blkread {
+    int fd;
+    size_t size;                // Bytes of each block
+    int nbuf;                   // Blocks in the ring
+    struct blkread_buf *buf;
+    long nread;                 // Blocks read by the thread
+    long nget;                  // Blocks handed out
+    long nused;                 // Blocks released by the caller
+    int eof;                    // Thread done, end of file or read error
+    int quit;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_read;
+    pthread_cond_t cond_used;
+};
+
+// In blkread.c
+// NULL if the file cannot be opened
+struct blkread *blkread_open(const char *name, size_t size, int nbuf);
+// Next block, NULL once the file is used up
+struct blkread_buf *blkread_get(struct blkread *r);
+// Give back the oldest block handed out
+void blkread_release(struct blkread *r);
+void blkread_close(struct blkread *r);
+
+#endif
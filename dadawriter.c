@@ -0,0 +1,282 @@
+/* dadawriter.c */
+// DADA output shared by the converters. The caller fills aligned buffers
+// that a writer thread hands to the disk in large writes, optionally
+// with O_DIRECT. Each file is preallocated to its full size when it is
+// opened, and only cut back if the data end before it is full.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "ascii_header.h"
+#include "dadawriter.h"
+
+static void dadawriter_write_fd(struct dadawriter *w, const char *data, size_t bytes)
+{
+    ssize_t n;
+
+    while (bytes > 0) {
+        n = write(w->fd, data, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "Error: Cannot write %s.\n", w->name);
+            exit(1);
+        }
+        data += n;
+        bytes -= n;
+    }
+}
+
+static void dadawriter_close_file(struct dadawriter *w)
+{
+    if (w->fd < 0)
+        return;
+    // Give back the preallocated space not used
+    if (w->fdbytes < w->filesize)
+        ftruncate(w->fd, w->hdrsize + w->fdbytes);
+    close(w->fd);
+    w->fd = -1;
+    w->fdfile = -1;
+    printf("%s created.\n", w->name);
+}
+
+static void dadawriter_open_file(struct dadawriter *w, int64_t file)
+{
+    char base[1024];
+    long offset = w->offset0 + w->filesize * file;
+    int oflags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    snprintf(base, sizeof(base), "%s_%016ld.000000.dada", w->stem, offset);
+    snprintf(w->name, sizeof(w->name), "%s/%s", w->route, base);
+
+    // Header of the file, the template with its own name and offset
+    memcpy(w->fhdr, w->hdr, w->hdrsize);
+    ascii_header_set(w->fhdr, "FILE_SIZE", "%ld", (long)w->filesize);
+    ascii_header_set(w->fhdr, "FILE_NAME", "%s", base);
+    ascii_header_set(w->fhdr, "OBS_OFFSET", "%ld", offset);
+
+    w->fd = -1;
+    if (w->flags & DADAWRITER_ODIRECT) {
+        w->fd = open(w->name, oflags | O_DIRECT, 0644);
+        // Not all file systems take O_DIRECT
+        if (w->fd < 0 && errno == EINVAL)
+            w->flags &= ~DADAWRITER_ODIRECT;
+    }
+    if (w->fd < 0)
+        w->fd = open(w->name, oflags, 0644);
+    if (w->fd < 0) {
+        fprintf(stderr, "Error: Cannot create %s.\n", w->name);
+        exit(1);
+    }
+    fallocate(w->fd, 0, 0, w->hdrsize + w->filesize);
+    dadawriter_write_fd(w, w->fhdr, w->hdrsize);
+    w->fdfile = file;
+    w->fdbytes = 0;
+}
+
+static void dadawriter_flush(struct dadawriter *w, struct dadawriter_buf *b)
+{
+    if (b->file != w->fdfile) {
+        dadawriter_close_file(w);
+        dadawriter_open_file(w, b->file);
+    }
+    // Buffers are handed over in whole pages but for the last of a file
+    if ((w->flags & DADAWRITER_ODIRECT) && b->len % DADAWRITER_ALIGN != 0)
+        fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+    dadawriter_write_fd(w, b->data, b->len);
+    w->fdbytes += b->len;
+}
+
+static void *dadawriter_thread(void *arg)
+{
+    struct dadawriter *w = (struct dadawriter *)arg;
+    struct dadawriter_buf *b;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->quit && w->nwritten == w->nput)
+            pthread_cond_wait(&w->cond_put, &w->lock);
+        if (w->nwritten == w->nput)
+            break;
+        b = &w->buf[w->nwritten % w->nbuf];
+        pthread_mutex_unlock(&w->lock);
+
+        dadawriter_flush(w, b);
+
+        pthread_mutex_lock(&w->lock);
+        w->nwritten++;
+        pthread_cond_broadcast(&w->cond_done);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static void dadawriter_put(struct dadawriter *w)
+// Hand the current buffer over and take the next free one
+{
+    pthread_mutex_lock(&w->lock);
+    w->nput++;
+    pthread_cond_signal(&w->cond_put);
+    while (w->nput - w->nwritten >= w->nbuf)
+        pthread_cond_wait(&w->cond_done, &w->lock);
+    w->cur = &w->buf[w->nput % w->nbuf];
+    pthread_mutex_unlock(&w->lock);
+    w->cur->len = 0;
+    w->cur->file = w->file;
+}
+
+static size_t dadawriter_room(struct dadawriter *w)
+// Room left in the current buffer and file, moving on to the next if full
+{
+    size_t room;
+
+    if (w->infile == w->filesize) {
+        if (w->cur->len > 0)
+            dadawriter_put(w);
+        w->file++;
+        w->infile = 0;
+        w->cur->file = w->file;
+    }
+    if (w->cur->len == w->bufsize)
+        dadawriter_put(w);
+    room = w->bufsize - w->cur->len;
+    if ((int64_t)room > w->filesize - w->infile)
+        room = w->filesize - w->infile;
+
+    return room;
+}
+
+struct dadawriter *dadawriter_open(const char *hdr, int hdrsize, const char *route,
+                                   const char *stem, int64_t offset0, int64_t filesize,
+                                   int flags, int nstream)
+{
+    struct dadawriter *w;
+    size_t bufsize;
+    int ii;
+
+    if (filesize <= 0) {
+        fprintf(stderr, "Error: Wrong DADA file size %ld.\n", (long)filesize);
+        exit(1);
+    }
+    w = (struct dadawriter *)calloc(1, sizeof(struct dadawriter));
+    w->hdrsize = hdrsize;
+    w->hdr = (char *)malloc(hdrsize);
+    memcpy(w->hdr, hdr, hdrsize);
+    snprintf(w->route, sizeof(w->route), "%s", route);
+    snprintf(w->stem, sizeof(w->stem), "%s", stem);
+    w->offset0 = offset0;
+    w->filesize = filesize;
+    w->flags = flags;
+    // Samples start aligned only after a header of whole pages
+    if (hdrsize % DADAWRITER_ALIGN != 0)
+        w->flags &= ~DADAWRITER_ODIRECT;
+
+    // Buffers of many streams shrink so their sum stays in DADAWRITER_MEM
+    w->nbuf = DADAWRITER_NBUF;
+    bufsize = DADAWRITER_MEM / ((size_t)(nstream > 1 ? nstream : 1) * w->nbuf);
+    bufsize -= bufsize % DADAWRITER_ALIGN;
+    if (bufsize > DADAWRITER_BUF)
+        bufsize = DADAWRITER_BUF;
+    if (bufsize < DADAWRITER_MINBUF)
+        bufsize = DADAWRITER_MINBUF;
+    w->bufsize = bufsize;
+    w->buf = (struct dadawriter_buf *)calloc(w->nbuf, sizeof(struct dadawriter_buf));
+    for (ii = 0 ; ii < w->nbuf ; ii++)
+        if (posix_memalign((void **)&w->buf[ii].data, DADAWRITER_ALIGN, w->bufsize) != 0) {
+            fprintf(stderr, "Error: Cannot allocate DADA output buffers.\n");
+            exit(1);
+        }
+    if (posix_memalign((void **)&w->fhdr, DADAWRITER_ALIGN,
+                       (hdrsize + DADAWRITER_ALIGN - 1) / DADAWRITER_ALIGN * DADAWRITER_ALIGN) != 0) {
+        fprintf(stderr, "Error: Cannot allocate DADA output buffers.\n");
+        exit(1);
+    }
+    w->cur = &w->buf[0];
+    w->fd = -1;
+    w->fdfile = -1;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond_put, NULL);
+    pthread_cond_init(&w->cond_done, NULL);
+    if (pthread_create(&w->tid, NULL, dadawriter_thread, w) != 0) {
+        fprintf(stderr, "Error: Cannot start DADA writer thread.\n");
+        exit(1);
+    }
+
+    return w;
+}
+
+char *dadawriter_reserve(struct dadawriter *w, size_t bytes)
+{
+    struct dadawriter_buf *b;
+    size_t carry;
+    char *p;
+
+    if ((int64_t)bytes > w->filesize || bytes > w->bufsize - DADAWRITER_ALIGN) {
+        fprintf(stderr, "Error: %zu bytes of samples do not fit in a DADA buffer.\n", bytes);
+        exit(1);
+    }
+    if (dadawriter_room(w) < bytes) {
+        if ((int64_t)bytes > w->filesize - w->infile) {
+            fprintf(stderr, "Error: Samples straddle two DADA files.\n");
+            exit(1);
+        }
+        // Hand over whole pages only and start the next buffer with the rest,
+        // which the writer thread does not touch
+        b = w->cur;
+        carry = b->len % DADAWRITER_ALIGN;
+        b->len -= carry;
+        dadawriter_put(w);
+        memcpy(w->cur->data, b->data + b->len, carry);
+        w->cur->len = carry;
+    }
+    p = w->cur->data + w->cur->len;
+    w->cur->len += bytes;
+    w->infile += bytes;
+
+    return p;
+}
+
+void dadawriter_write(struct dadawriter *w, const char *data, size_t bytes)
+{
+    size_t n;
+
+    while (bytes > 0) {
+        n = dadawriter_room(w);
+        if (n > bytes)
+            n = bytes;
+        memcpy(w->cur->data + w->cur->len, data, n);
+        w->cur->len += n;
+        w->infile += n;
+        data += n;
+        bytes -= n;
+    }
+}
+
+void dadawriter_close(struct dadawriter *w)
+{
+    int ii;
+
+    if (w->cur->len > 0)
+        dadawriter_put(w);
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_signal(&w->cond_put);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->tid, NULL);
+    dadawriter_close_file(w);
+
+    for (ii = 0 ; ii < w->nbuf ; ii++)
+        free(w->buf[ii].data);
+    free(w->buf);
+    free(w->fhdr);
+    free(w->hdr);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond_put);
+    pthread_cond_destroy(&w->cond_done);
+    free(w);
+}
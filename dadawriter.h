@@ -0,0 +1,80 @@
+/* dadawriter.h */
+#ifndef _DADAWRITER_H
+#define _DADAWRITER_H
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Bytes of each output buffer of a lone stream, a multiple of DADAWRITER_ALIGN
+#define DADAWRITER_BUF 8388608
+#define DADAWRITER_ALIGN 4096
+// Bytes of buffers of all the streams written at once, shared out evenly
+#define DADAWRITER_MEM 268435456
+// Smallest buffer, however many streams
+#define DADAWRITER_MINBUF 1048576
+// Buffers in the ring, one filled by the caller, the others queued
+#define DADAWRITER_NBUF 4
+
+// Flags of dadawriter_open()
+#define DADAWRITER_ODIRECT 1        // Write past the page cache
+
+// A buffer of samples for one of the files
+struct dadawriter_buf {
+    char *data;                     // Aligned to DADAWRITER_ALIGN
+    size_t len;                     // Bytes filled
+    int64_t file;                   // Index of the file it belongs to
+};
+
+// A series of DADA files, STEM_OBSOFFSET.000000.dada in route, each with
+// filesize bytes of samples after its header. The header of each file
+// is the template with FILE_SIZE, FILE_NAME and OBS_OFFSET set. Samples
+// go into large aligned buffers that a thread of its own writes out; the
+// same thread closes each file when full, opens and preallocates the
+// next, so the caller never waits for a rollover.
+struct dadawriter {
+    char *hdr;                      // Header template
+    int hdrsize;
+    char route[1024];
+    char stem[1024];
+    int64_t offset0;                // OBS_OFFSET of the first file
+    int64_t filesize;               // Bytes of samples in a full file
+    int flags;
+    int nbuf;
+    size_t bufsize;                 // Bytes of each buffer, a multiple of DADAWRITER_ALIGN
+    struct dadawriter_buf *buf;
+    struct dadawriter_buf *cur;     // Buffer being filled by the caller
+    int64_t file;                   // File being filled by the caller
+    int64_t infile;                 // Bytes of it filled so far
+    int64_t nput;                   // Buffers handed over
+    int64_t nwritten;               // Buffers written
+    // Writer thread
+    int fd;
+    int64_t fdfile;                 // Index of the open file, -1 if none
+    int64_t fdbytes;                // Bytes of samples in it
+    char *fhdr;                     // Header of the open file, aligned
+    char name[2048];                // Path of the open file
+    int quit;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_put;
+    pthread_cond_t cond_done;
+};
+
+// In dadawriter.c
+// hdr is the template of hdrsize bytes, stem the file name up to the
+// offset, e.g. UT_FREQ. nstream is the number of writers the caller keeps
+// open at once, which share DADAWRITER_MEM of buffers. No file is created
+// before the first sample.
+struct dadawriter *dadawriter_open(const char *hdr, int hdrsize, const char *route,
+                                   const char *stem, int64_t offset0, int64_t filesize,
+                                   int flags, int nstream);
+// Room for bytes more samples, all in the current file and at most a
+// buffer less DADAWRITER_ALIGN. Records that divide filesize never
+// straddle two files.
+char *dadawriter_reserve(struct dadawriter *w, size_t bytes);
+// Copy bytes of samples, split over files as needed
+void dadawriter_write(struct dadawriter *w, const char *data, size_t bytes);
+// Write out all samples and close the last file
+void dadawriter_close(struct dadawriter *w);
+
+#endif
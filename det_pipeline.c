@@ -0,0 +1,195 @@
+/* det_pipeline.c */
+// Frame-parallel detection: the reading thread fills frame pair slots,
+// a pool of workers detects them, and the results are handed back to the
+// reading thread in frame order for assembling subints.
+#include <stdio.h>
+#include <stdlib.h>
+#include <complex.h>
+#include "det_pipeline.h"
+
+static void detpipe_run(struct detworker *w, struct detjob *job)
+{
+    if (job->kind == DETJOB_DETECT)
+        getVDIFFrameDetection(w->ctx, job->src[0], job->src[1], job->det);
+}
+
+static void *detpipe_worker(void *arg)
+{
+    struct detworker *w = (struct detworker *)arg;
+    struct detpipe *dp = w->dp;
+    struct detjob *job;
+
+    pthread_mutex_lock(&dp->lock);
+    for (;;) {
+        while (!dp->quit && dp->nnext == dp->nsub)
+            pthread_cond_wait(&dp->cond_job, &dp->lock);
+        if (dp->nnext == dp->nsub)
+            break;
+        job = &dp->job[dp->nnext % dp->nslot];
+        job->state = DETSLOT_BUSY;
+        dp->nnext++;
+        pthread_mutex_unlock(&dp->lock);
+
+        detpipe_run(w, job);
+
+        pthread_mutex_lock(&dp->lock);
+        job->state = DETSLOT_DONE;
+        pthread_cond_broadcast(&dp->cond_done);
+    }
+    pthread_mutex_unlock(&dp->lock);
+
+    return NULL;
+}
+
+// Assemble the oldest job, waiting for it if block is set.
+// Returns 0 if nothing was assembled. Called with dp->lock held.
+static int detpipe_assemble_one(struct detpipe *dp, int block)
+{
+    struct detjob *job;
+
+    if (dp->ndone == dp->nsub)
+        return 0;
+    job = &dp->job[dp->ndone % dp->nslot];
+    while (job->state != DETSLOT_DONE) {
+        if (!block)
+            return 0;
+        pthread_cond_wait(&dp->cond_done, &dp->lock);
+    }
+    pthread_mutex_unlock(&dp->lock);
+    if (dp->assemble)
+        dp->assemble(dp->arg, job);
+    pthread_mutex_lock(&dp->lock);
+    job->state = DETSLOT_FREE;
+    dp->ndone++;
+
+    return 1;
+}
+
+struct detpipe *detpipe_create(int nworker, int nslot, int fbytes, int vdif_nchan, int nchan,
+                               char dstat, detpipe_assemble_fn assemble, void *arg)
+{
+    struct detpipe *dp;
+    int i;
+
+    if (nworker < 1)
+        nworker = 1;
+    if (nslot < nworker)
+        nslot = nworker;
+
+    dp = (struct detpipe *)calloc(1, sizeof(struct detpipe));
+    dp->nworker = nworker;
+    dp->nslot = nslot;
+    dp->fbytes = fbytes;
+    dp->vdif_nchan = vdif_nchan;
+    dp->nchan = (vdif_nchan == 32) ? 32 : nchan;
+    dp->dstat = dstat;
+    dp->assemble = assemble;
+    dp->arg = arg;
+    pthread_mutex_init(&dp->lock, NULL);
+    pthread_cond_init(&dp->cond_job, NULL);
+    pthread_cond_init(&dp->cond_done, NULL);
+
+    // Slots own a buffer for the payload of both pols and the detection
+    dp->job = (struct detjob *)calloc(nslot, sizeof(struct detjob));
+    for (i = 0 ; i < nslot ; i++) {
+        dp->job[i].buf[0] = (unsigned char *)malloc(sizeof(unsigned char) * fbytes);
+        dp->job[i].buf[1] = (unsigned char *)malloc(sizeof(unsigned char) * fbytes);
+        dp->job[i].det = (float (*)[4])malloc(sizeof(float) * 4 * dp->nchan);
+        dp->job[i].state = DETSLOT_FREE;
+    }
+
+    // Each worker has its own detection context. They are created here,
+    // in one thread, since the FFTW planner is not thread safe.
+    dp->w = (struct detworker *)calloc(nworker, sizeof(struct detworker));
+    for (i = 0 ; i < nworker ; i++) {
+        dp->w[i].dp = dp;
+        dp->w[i].ctx = vdifdet_create(fbytes, vdif_nchan, nchan, dstat);
+    }
+    for (i = 0 ; i < nworker ; i++) {
+        if (pthread_create(&dp->w[i].tid, NULL, detpipe_worker, &dp->w[i])) {
+            fprintf(stderr, "Error in starting detection worker %d.\n", i);
+            exit(1);
+        }
+    }
+
+    return dp;
+}
+
+void detpipe_set_assembler(struct detpipe *dp, detpipe_assemble_fn assemble, void *arg)
+// Only to be called with nothing in flight, i.e. after detpipe_drain().
+// Sequence numbers of the jobs start again from 0.
+{
+    dp->assemble = assemble;
+    dp->arg = arg;
+    dp->seq0 = dp->nsub;
+}
+
+struct detjob *detpipe_slot(struct detpipe *dp)
+/* Return the next free slot to fill, assembling finished jobs on the way */
+{
+    struct detjob *job;
+
+    pthread_mutex_lock(&dp->lock);
+    // Hand back whatever is already done in order, without waiting
+    while (detpipe_assemble_one(dp, 0))
+        ;
+    // Ring full: wait for the oldest job
+    if (dp->nsub - dp->ndone == dp->nslot)
+        detpipe_assemble_one(dp, 1);
+    job = &dp->job[dp->nsub % dp->nslot];
+    pthread_mutex_unlock(&dp->lock);
+    job->src[0] = job->buf[0];
+    job->src[1] = job->buf[1];
+
+    return job;
+}
+
+void detpipe_submit(struct detpipe *dp, int kind)
+/* Queue the slot returned by the last detpipe_slot() */
+{
+    struct detjob *job;
+
+    pthread_mutex_lock(&dp->lock);
+    job = &dp->job[dp->nsub % dp->nslot];
+    job->seq = dp->nsub - dp->seq0;
+    job->kind = kind;
+    job->state = DETSLOT_READY;
+    dp->nsub++;
+    pthread_cond_signal(&dp->cond_job);
+    pthread_mutex_unlock(&dp->lock);
+}
+
+void detpipe_drain(struct detpipe *dp)
+/* Wait for and assemble all submitted jobs */
+{
+    pthread_mutex_lock(&dp->lock);
+    while (detpipe_assemble_one(dp, 1))
+        ;
+    pthread_mutex_unlock(&dp->lock);
+}
+
+void detpipe_destroy(struct detpipe *dp)
+{
+    int i;
+
+    detpipe_drain(dp);
+    pthread_mutex_lock(&dp->lock);
+    dp->quit = 1;
+    pthread_cond_broadcast(&dp->cond_job);
+    pthread_mutex_unlock(&dp->lock);
+    for (i = 0 ; i < dp->nworker ; i++) {
+        pthread_join(dp->w[i].tid, NULL);
+        vdifdet_destroy(dp->w[i].ctx);
+    }
+    for (i = 0 ; i < dp->nslot ; i++) {
+        free(dp->job[i].buf[0]);
+        free(dp->job[i].buf[1]);
+        free(dp->job[i].det);
+    }
+    free(dp->w);
+    free(dp->job);
+    pthread_mutex_destroy(&dp->lock);
+    pthread_cond_destroy(&dp->cond_job);
+    pthread_cond_destroy(&dp->cond_done);
+    free(dp);
+}
@@ -0,0 +1,69 @@
+/* det_pipeline.h */
+#ifndef _DET_PIPELINE_H
+#define _DET_PIPELINE_H
+#include <stdint.h>
+#include <pthread.h>
+#include "vdifdet.h"
+
+// What a worker has to do with a frame pair
+#define DETJOB_DETECT 0         // Valid frame pair, make detection
+#define DETJOB_SKIP   1         // Nothing to compute, the assembler fills it in
+
+// Slot states
+#define DETSLOT_FREE  0
+#define DETSLOT_READY 1
+#define DETSLOT_BUSY  2
+#define DETSLOT_DONE  3
+
+struct detjob {
+    int64_t seq;            // Frame pair sequence number since the assembler was set
+    int kind;               // DETJOB_*
+    int state;              // DETSLOT_*
+    const unsigned char *src[2]; // Payload of one frame for pol0 and pol1, in buf or in place
+    unsigned char *buf[2];  // Own copy of the payloads, for callers that need one
+    float (*det)[4];        // Detection of the frame pair, nchan x 4
+};
+
+struct detpipe;
+
+struct detworker {
+    struct detpipe *dp;
+    pthread_t tid;
+    struct vdifdet *ctx;    // Detection context of the worker
+};
+
+// Called in frame order from the thread driving the pipeline
+typedef void (*detpipe_assemble_fn)(void *arg, const struct detjob *job);
+
+struct detpipe {
+    int nworker;            // Number of detection threads
+    int nslot;              // Number of frame pairs in flight
+    int fbytes;             // Bytes of payload per frame
+    int vdif_nchan;         // Channels in the VDIF frame (1 or 32)
+    int nchan;              // Output channels of the detection
+    char dstat;             // Output data status
+    struct detjob *job;     // Ring of frame pair slots
+    struct detworker *w;
+    int64_t nsub;           // Jobs submitted
+    int64_t seq0;           // Job sequence numbers count from here
+    int64_t nnext;          // Next job to hand to a worker
+    int64_t ndone;          // Next job to assemble
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_job;
+    pthread_cond_t cond_done;
+    detpipe_assemble_fn assemble;
+    void *arg;
+};
+
+// In det_pipeline.c
+struct detpipe *detpipe_create(int nworker, int nslot, int fbytes, int vdif_nchan, int nchan, char dstat, detpipe_assemble_fn assemble, void *arg);
+void detpipe_set_assembler(struct detpipe *dp, detpipe_assemble_fn assemble, void *arg);
+// The payloads a slot points to must stay valid until the slot is
+// assembled, i.e. for nslot more frames or until detpipe_drain()
+struct detjob *detpipe_slot(struct detpipe *dp);
+void detpipe_submit(struct detpipe *dp, int kind);
+void detpipe_drain(struct detpipe *dp);
+void detpipe_destroy(struct detpipe *dp);
+
+#endif
@@ -0,0 +1,138 @@
+/* detkern.c */
+// Detection kernels, one per output data status (dstat). The kernel for
+// a stream is picked once at setup, and then works on whole runs of FFT
+// bins: detsum_* add up a run of bins into one output channel, detspec_*
+// write one output channel per bin.
+// The sums are split over DETK_LANES independent partial sums so that
+// the compiler can keep them in SIMD registers.
+#include <math.h>
+#include "vdifdet.h"
+
+#define DETK_LANES 8
+
+// Detection of one bin, p0 and p1 are the complex values of the two pols
+static inline void det_C(const float *p0, const float *p1, float *d)
+{
+    d[0] = p0[0] * p0[0] + p0[1] * p0[1];
+    d[1] = p1[0] * p1[0] + p1[1] * p1[1];
+    d[2] = p0[0] * p1[0] + p0[1] * p1[1];
+    d[3] = p0[0] * p1[1] - p0[1] * p1[0];
+}
+
+static inline void det_I(const float *p0, const float *p1, float *d)
+{
+    d[0] = p0[0] * p0[0] + p0[1] * p0[1] + p1[0] * p1[0] + p1[1] * p1[1];
+}
+
+static inline void det_X(const float *p0, const float *p1, float *d)
+{
+    d[0] = p0[0] * p0[0] + p0[1] * p0[1];
+}
+
+static inline void det_Y(const float *p0, const float *p1, float *d)
+{
+    d[0] = p1[0] * p1[0] + p1[1] * p1[1];
+}
+
+static inline void det_S(const float *p0, const float *p1, float *d)
+{
+    float xx = p0[0] * p0[0] + p0[1] * p0[1];
+    float yy = p1[0] * p1[0] + p1[1] * p1[1];
+
+    d[0] = xx + yy;
+    d[1] = xx - yy;
+    d[2] = 2.0f * (p0[0] * p1[0] + p0[1] * p1[1]);
+    d[3] = 2.0f * (p0[0] * p1[1] - p0[1] * p1[0]);
+}
+
+static inline void det_P(const float *p0, const float *p1, float *d)
+{
+    float q = (p0[0] * p0[0] + p0[1] * p0[1]) - (p1[0] * p1[0] + p1[1] * p1[1]);
+    float u = 2.0f * (p0[0] * p1[0] + p0[1] * p1[1]);
+
+    d[0] = sqrtf(q * q + u * u);
+    d[1] = 2.0f * (p0[0] * p1[1] - p0[1] * p1[0]);
+}
+
+// Sum and spectrum kernels of a mode with NPOL outputs
+#define DETKERN(MODE, NPOL)                                                   \
+static void detsum_##MODE(const fftwf_complex *out_p0,                        \
+                          const fftwf_complex *out_p1, int n, float *det)     \
+{                                                                             \
+    const float *p0 = (const float *)out_p0, *p1 = (const float *)out_p1;     \
+    float acc[NPOL][DETK_LANES], d[NPOL];                                     \
+    int ii, ll, jj;                                                           \
+                                                                              \
+    for (jj = 0 ; jj < NPOL ; jj++)                                           \
+        for (ll = 0 ; ll < DETK_LANES ; ll++)                                 \
+            acc[jj][ll] = 0.0f;                                               \
+    for (ii = 0 ; ii + DETK_LANES <= n ; ii += DETK_LANES) {                  \
+        for (ll = 0 ; ll < DETK_LANES ; ll++) {                               \
+            det_##MODE(p0 + 2 * (ii + ll), p1 + 2 * (ii + ll), d);            \
+            for (jj = 0 ; jj < NPOL ; jj++)                                   \
+                acc[jj][ll] += d[jj];                                         \
+        }                                                                     \
+    }                                                                         \
+    for ( ; ii < n ; ii++) {                                                  \
+        det_##MODE(p0 + 2 * ii, p1 + 2 * ii, d);                              \
+        for (jj = 0 ; jj < NPOL ; jj++)                                       \
+            acc[jj][0] += d[jj];                                              \
+    }                                                                         \
+    for (jj = 0 ; jj < NPOL ; jj++)                                           \
+        for (ll = 0 ; ll < DETK_LANES ; ll++)                                 \
+            det[jj] += acc[jj][ll];                                           \
+}                                                                             \
+                                                                              \
+static void detspec_##MODE(const fftwf_complex *out_p0,                       \
+                           const fftwf_complex *out_p1, int n, float det[][4])\
+{                                                                             \
+    const float *p0 = (const float *)out_p0, *p1 = (const float *)out_p1;     \
+    int ii;                                                                   \
+                                                                              \
+    for (ii = 0 ; ii < n ; ii++)                                              \
+        det_##MODE(p0 + 2 * ii, p1 + 2 * ii, det[ii]);                        \
+}
+
+DETKERN(C, 4)
+DETKERN(I, 1)
+DETKERN(X, 1)
+DETKERN(Y, 1)
+DETKERN(S, 4)
+DETKERN(P, 2)
+
+int detnpol(char dstat)
+// Number of pols in the output for dstat
+{
+    if (dstat == 'C' || dstat == 'S')
+        return 4;
+    else if (dstat == 'P')
+        return 2;
+    else
+        return 1;
+}
+
+detsum_fn detsum_select(char dstat)
+{
+    switch (dstat) {
+    case 'C': return detsum_C;
+    case 'I': return detsum_I;
+    case 'X': return detsum_X;
+    case 'Y': return detsum_Y;
+    case 'S': return detsum_S;
+    case 'P': return detsum_P;
+    }
+    return NULL;
+}
+
+detspec_fn detspec_select(char dstat)
+{
+    switch (dstat) {
+    case 'C': return detspec_C;
+    case 'I': return detspec_I;
+    case 'X': return detspec_X;
+    case 'Y': return detspec_Y;
+    case 'S': return detspec_S;
+    case 'P': return detspec_P;
+    }
+    return NULL;
+}
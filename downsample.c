@@ -1,6 +1,8 @@
 #include <math.h>
 #include <string.h>
+#include <stdlib.h>
 #include "psrfits.h"
+#include "vdifstat.h"
 
 // TODO:  for these to work with OpenMP, we probably need
 //        separate input and output arrays and then a copy.
@@ -56,6 +58,78 @@ void pf_8bit_to_4bit(struct psrfits *pf)
 }
 
 
+void pf_float_to_nbit(struct psrfits *pf, struct ewstat *es)
+// This requantises the float spectra of pf->sub.fdata (out nsblk x out npol
+// x out nchan, channels fastest, as left by any downsampling) to hdr.nbits
+// unsigned values in pf->sub.rawdata, one per byte (4-bit values are packed
+// by psrfits_write_row()). Each channel and pol gets its own DAT_OFFS and
+// DAT_SCL, from the statistics of this subint, or from the running
+// statistics es (out nchan x out npol values, updated with this subint) if
+// es is not NULL. Values beyond the range are clipped.
+{
+    int ii, jj;
+    struct hdrinfo *hdr = &(pf->hdr);
+    const int nsblk = hdr->nsblk / hdr->ds_time_fact;
+    const int nspec = (hdr->nchan / hdr->ds_freq_fact) * (hdr->onlyI ? 1 : hdr->npol);
+    const float maxval = (1 << hdr->nbits) - 1;
+    // Range covered to each side of the mean, in rms
+    const double range = (hdr->nbits == 4) ? 3.0 : 6.0;
+    const float *indata;
+    unsigned char *outdata;
+    double *m1, *m2, mean, rms;
+    float *norm, *offs, v;
+
+    m1 = (double *)calloc(nspec, sizeof(double));
+    m2 = (double *)calloc(nspec, sizeof(double));
+    norm = (float *)malloc(nspec * sizeof(float));
+    offs = pf->sub.dat_offsets;
+
+    indata = pf->sub.fdata;
+    for (ii = 0 ; ii < nsblk ; ii++)
+        for (jj = 0 ; jj < nspec ; jj++, indata++) {
+            m1[jj] += *indata;
+            m2[jj] += *indata * *indata;
+        }
+    for (jj = 0 ; jj < nspec ; jj++) {
+        m1[jj] /= nsblk;
+        m2[jj] /= nsblk;
+    }
+    if (es != NULL)
+        ewstat_update_moments(es, m1, m2);
+
+    // value = raw * DAT_SCL + DAT_OFFS, the mean in the middle of the range
+    for (jj = 0 ; jj < nspec ; jj++) {
+        if (es != NULL) {
+            mean = ewstat_mean(es, jj);
+            rms = ewstat_rms(es, jj);
+        } else {
+            mean = m1[jj];
+            rms = m2[jj] - m1[jj] * m1[jj];
+            rms = (rms > 0.0) ? sqrt(rms) : 0.0;
+        }
+        pf->sub.dat_scales[jj] = (rms > 0.0) ? 2.0 * range * rms / (maxval + 1.0) : 1.0;
+        offs[jj] = mean - 0.5 * maxval * pf->sub.dat_scales[jj];
+        norm[jj] = 1.0 / pf->sub.dat_scales[jj];
+    }
+
+    indata = pf->sub.fdata;
+    outdata = pf->sub.rawdata;
+    for (ii = 0 ; ii < nsblk ; ii++)
+        for (jj = 0 ; jj < nspec ; jj++, indata++, outdata++) {
+            v = (*indata - offs[jj]) * norm[jj] + 0.5f;
+            if (v < 0.0f)
+                v = 0.0f;
+            else if (v > maxval)
+                v = maxval;
+            *outdata = (unsigned char)v;
+        }
+
+    free(m1);
+    free(m2);
+    free(norm);
+}
+
+
 void get_stokes_I(struct psrfits *pf)
 /* Move the Stokes I in place so that it is consecutive in the array */
 {
@@ -85,14 +159,40 @@ void get_stokes_I(struct psrfits *pf)
 }
 
 
+void downsample_freq(struct psrfits *pf)
+/* Average adjacent channels together in place  */
+/* The spectra of the polns stay one after other */
+{
+    int ii, jj, kk;
+    struct hdrinfo *hdr = &(pf->hdr);
+    const int dsfact = hdr->ds_freq_fact;
+    const int in_nchan = hdr->nchan;
+    const int out_nchan = in_nchan / dsfact;
+    const int nspec = hdr->nsblk * hdr->npol;
+    const float norm = 1.0 / dsfact;
+    float *indata, *outdata, sum;
+
+    indata = outdata = pf->sub.fdata;
+    // Output channel jj never lies beyond input channel jj * dsfact
+    for (ii = 0 ; ii < nspec ; ii++, indata += in_nchan, outdata += out_nchan) {
+        for (jj = 0 ; jj < out_nchan ; jj++) {
+            sum = 0.0;
+            for (kk = 0 ; kk < dsfact ; kk++)
+                sum += indata[jj * dsfact + kk];
+            outdata[jj] = sum * norm;
+        }
+    }
+}
+
+
 void downsample_time(struct psrfits *pf)
 /* Average adjacent time samples together in place */
-/* This should be called _after_ make_subbands()   */
+/* This should be called _after_ downsample_freq() */
 {
     int ii, jj, kk;
     struct hdrinfo *hdr = &(pf->hdr);
     float *data = pf->sub.fdata;
-    float *indata, *outdata, *tmpspec;
+    float *indata, *outdata;
     const int dsfact = hdr->ds_time_fact;
     // Treat the polns as being parts of the same spectrum
     int out_npol = hdr->npol;
@@ -102,25 +202,47 @@ void downsample_time(struct psrfits *pf)
     const int out_nsblk = hdr->nsblk / dsfact;
     const float norm = 1.0 / dsfact;
 
-    tmpspec = (float *)malloc(out_nchan * sizeof(float));
-    indata = data;
-    // Iterate over the output times
+    // Iterate over the output times. Output spectrum ii only overlaps
+    // input spectrum ii, which has been used up already for ii > 0.
     for (ii = 0 ; ii < out_nsblk ; ii++) {
-        // Initiaize the summation
-        for (jj = 0 ; jj < out_nchan ; jj++) 
-            tmpspec[jj] = 0.0;
-        // Add up the samples in time in the tmp array
-        for (jj = 0 ; jj < dsfact ; jj++) {
-            outdata = tmpspec;
-            for (kk = 0 ; kk < out_nchan ; kk++, indata++, outdata++)
-                *outdata += *indata;
-        }
-        // Convert the sum to an average and put into the output array
         outdata = data + ii * out_nchan;
-        for (jj = 0 ; jj < out_nchan ; jj++)
-            outdata[jj] = tmpspec[jj] * norm;
+        indata = data + ii * dsfact * out_nchan;
+        if (ii > 0)
+            memcpy(outdata, indata, out_nchan * sizeof(float));
+        // Add up the samples in time
+        for (jj = 1 ; jj < dsfact ; jj++) {
+            indata += out_nchan;
+            for (kk = 0 ; kk < out_nchan ; kk++)
+                outdata[kk] += indata[kk];
+        }
+        // Convert the sum to an average
+        for (kk = 0 ; kk < out_nchan ; kk++)
+            outdata[kk] *= norm;
     }
-    free(tmpspec);
+}
+
+
+void pf_fdata_to_rawdata(struct psrfits *pf, struct ewstat *es)
+/* Downsample the float spectra in pf->sub.fdata (nsblk x npol x nchan, */
+/* channels fastest) as hdr asks and put them in pf->sub.rawdata, as    */
+/* floats or requantised to hdr.nbits with pf_float_to_nbit()           */
+{
+    struct hdrinfo *hdr = &(pf->hdr);
+    int out_npol = hdr->npol;
+    if (hdr->onlyI) out_npol = 1;
+
+    if (hdr->ds_freq_fact > 1)
+        downsample_freq(pf);
+    if (hdr->onlyI)
+        get_stokes_I(pf);
+    if (hdr->ds_time_fact > 1)
+        downsample_time(pf);
+
+    if (hdr->nbits == 32)
+        memcpy(pf->sub.rawdata, pf->sub.fdata, sizeof(float) * out_npol *
+               (hdr->nsblk / hdr->ds_time_fact) * (hdr->nchan / hdr->ds_freq_fact));
+    else
+        pf_float_to_nbit(pf, es);
 }
 
 
@@ -136,17 +258,20 @@ void guppi_update_ds_params(struct psrfits *pf)
     int out_nchan = hdr->nchan / hdr->ds_freq_fact;
  
     if (hdr->ds_freq_fact > 1) {
-        int ii;
+        int ii, jj;
         double dtmp;
 
         /* Note:  we don't need to malloc the subint arrays since */
         /*        their original values are longer by default.    */
 
-        // The following correctly accounts for the middle-of-bin FFT offset
-        dtmp = hdr->fctr - 0.5 * hdr->BW;
-        dtmp += 0.5 * (hdr->ds_freq_fact - 1.0) * hdr->df;
-        for (ii = 0 ; ii < out_nchan ; ii++)
-            sub->dat_freqs[ii] = dtmp + ii * (hdr->df * hdr->ds_freq_fact);
+        // Each output channel is at the mean frequency of the channels
+        // averaged into it, whatever convention filled dat_freqs
+        for (ii = 0 ; ii < out_nchan ; ii++) {
+            dtmp = 0.0;
+            for (jj = 0 ; jj < hdr->ds_freq_fact ; jj++)
+                dtmp += sub->dat_freqs[ii * hdr->ds_freq_fact + jj];
+            sub->dat_freqs[ii] = dtmp / hdr->ds_freq_fact;
+        }
 
         for (ii = 1 ; ii < out_npol ; ii++) {
             memcpy(sub->dat_offsets+ii*out_nchan,
@@ -0,0 +1,117 @@
+/* fftwisdom.c */
+// Cache of FFTW wisdom on disk, so that plans measured once are reused
+// by later runs. One file per CPU model, FFT kind and length, number of
+// FFTW threads and precision, in $PSRCOV_WISDOM or else $HOME/.psrcov.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fftw3.h>
+#include "vdifdet.h"
+
+static unsigned fftwisdom_planflags = FFTW_MEASURE;
+
+void fftwisdom_patient(int on)
+// Plan with FFTW_PATIENT instead of FFTW_MEASURE
+{
+    fftwisdom_planflags = on ? FFTW_PATIENT : FFTW_MEASURE;
+}
+
+unsigned fftwisdom_flags(void)
+// Planner flags for the detection plans
+{
+    return fftwisdom_planflags;
+}
+
+static void fftwisdom_cpu(char *cpu, int len)
+// CPU model name, reduced to characters fit for a file name
+{
+    FILE *fp;
+    char line[256], *p;
+    int n = 0;
+
+    strncpy(cpu, "unknown", len);
+    fp = fopen("/proc/cpuinfo", "r");
+    if (fp == NULL)
+        return;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "model name", 10) != 0)
+            continue;
+        p = strchr(line, ':');
+        if (p == NULL)
+            break;
+        for (p++ ; *p != '\0' && n < len - 1 ; p++) {
+            if (isalnum((unsigned char)*p))
+                cpu[n++] = *p;
+            else if (n > 0 && cpu[n - 1] != '-')
+                cpu[n++] = '-';
+        }
+        while (n > 0 && cpu[n - 1] == '-')
+            n--;
+        cpu[n] = '\0';
+        break;
+    }
+    fclose(fp);
+}
+
+static int fftwisdom_path(char *path, int len, const char *kind, int nfft, int nthreads)
+// File of the wisdom for the given key. Returns 0 if there is no place for it.
+{
+    char dir[1024], cpu[128];
+    const char *env;
+
+    env = getenv("PSRCOV_WISDOM");
+    if (env != NULL) {
+        // Empty setting turns the cache off
+        if (env[0] == '\0')
+            return 0;
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else {
+        env = getenv("HOME");
+        if (env == NULL)
+            return 0;
+        snprintf(dir, sizeof(dir), "%s/.psrcov", env);
+    }
+    mkdir(dir, 0755);
+
+    fftwisdom_cpu(cpu, sizeof(cpu));
+    snprintf(path, len, "%s/wisdom_%s_%s%d_t%d_f32.fftw", dir, cpu, kind, nfft, nthreads);
+
+    return 1;
+}
+
+int fftwisdom_load(const char *kind, int nfft, int nthreads)
+// Load the wisdom for the key before planning. Returns 1 if any was found.
+{
+    char path[2048];
+
+    if (!fftwisdom_path(path, sizeof(path), kind, nfft, nthreads))
+        return 0;
+    if (access(path, R_OK) != 0)
+        return 0;
+    if (!fftwf_import_wisdom_from_filename(path)) {
+        fprintf(stderr, "Warning: Cannot read FFTW wisdom from %s.\n", path);
+        return 0;
+    }
+
+    return 1;
+}
+
+void fftwisdom_save(const char *kind, int nfft, int nthreads)
+// Save the wisdom for the key after planning
+{
+    char path[2048], tmp[2100];
+
+    if (!fftwisdom_path(path, sizeof(path), kind, nfft, nthreads))
+        return;
+
+    // Write aside and rename, as other jobs may be reading it
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (!fftwf_export_wisdom_to_filename(tmp) || rename(tmp, path) != 0) {
+        fprintf(stderr, "Warning: Cannot save FFTW wisdom to %s.\n", path);
+        unlink(tmp);
+    }
+}
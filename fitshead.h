@@ -38,6 +38,16 @@
 extern "C" {
 #endif
 
+/* Index of the 80-character cards of a FITS header, by keyword */
+struct hindex {
+    const char *header;         /* Header indexed */
+    int lhead;                  /* Length up to and including the END card */
+    int ncard;                  /* Cards before END */
+    int nslot;                  /* Size of the hash table, a power of 2 */
+    int *slot;                  /* Card of each slot, -1 if empty */
+    char *keys;                 /* Keyword fields of the cards, 8 characters each */
+};
+
 
 #ifdef __STDC__   /* Full ANSI prototypes */
 
@@ -140,6 +150,37 @@ extern "C" {
     int gethlength(             /* Get length of current FITS header */
         char* header);          /* FITS header */
 
+    int hindex_build(           /* Index the cards of a FITS header */
+        struct hindex *hx,      /* Index, zeroed before its first use */
+        const char *header,     /* FITS header */
+        int maxlen);            /* Length of the header buffer */
+    int hindex_rebind(          /* Move an index to a header of same layout */
+        struct hindex *hx,      /* Index */
+        const char *header,     /* FITS header */
+        int maxlen);            /* Length of the header buffer */
+    void hindex_free(           /* Free an index */
+        struct hindex *hx);     /* Index */
+    const char *hindex_card(    /* Return pointer to the card of keyword */
+        const struct hindex *hx,/* Index */
+        const char *keyword);   /* FITS keyword */
+    int hindex_geti4(           /* Extract int value through an index */
+        const struct hindex *hx,/* Index */
+        const char *keyword,    /* FITS keyword */
+        int *val);              /* integer value (returned) */
+    int hindex_getr4(           /* Extract float value through an index */
+        const struct hindex *hx,/* Index */
+        const char *keyword,    /* FITS keyword */
+        float *val);            /* float value (returned) */
+    int hindex_getr8(           /* Extract double value through an index */
+        const struct hindex *hx,/* Index */
+        const char *keyword,    /* FITS keyword */
+        double *val);           /* double value (returned) */
+    int hindex_gets(            /* Extract string value through an index */
+        const struct hindex *hx,/* Index */
+        const char *keyword,    /* FITS keyword */
+        const int lstr,         /* maximum length of returned string */
+        char *string);          /* null-terminated string value (returned) */
+
     double str2ra(              /* Return RA in degrees from string */
         const char* in);        /* Character string (hh:mm:ss.sss or dd.dddd) */
     double str2dec(             /* Return Dec in degrees from string */
@@ -336,6 +377,16 @@ extern int hlength();
 /* Get length of current FITS header */
 extern int gethlength();
 
+/* Look keywords up through an index of the cards of a header */
+extern int hindex_build();
+extern int hindex_rebind();
+extern void hindex_free();
+extern const char *hindex_card();
+extern int hindex_geti4();
+extern int hindex_getr4();
+extern int hindex_getr8();
+extern int hindex_gets();
+
 /* Subroutines in iget.c */
 #if 0 
 extern int mgetstr();   /* Previously allocated string from multiline keyword */
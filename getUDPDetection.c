@@ -1,49 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <complex.h>
 #include <fftw3.h>
-void getDetection(float p0r, float p0i, float p1r, float p1i, float *det, char dstat);
+#include "vdifdet.h"
 
-void getUDPDetection(const char *src_p0, const char *src_p1, int bbytes, float det[][4], char dstat)
+// Set up detection of 8-bit UDP blocks of bbytes samples per pol
+struct udpdet *udpdet_create(int bbytes, char dstat)
 {
-  fftwf_complex *out_p0,*out_p1;
-  fftwf_plan pl0,pl1;
-  float dets[4],*in_p0,*in_p1;
-  int i,j,k,Nts;
-  unsigned char *buff8[2];
-
-  //Memo for FFT for two pols                                              
-  out_p0 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*bbytes/2+1);
-  out_p1 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*bbytes/2+1);
-  in_p0 = (float *) fftwf_malloc(sizeof(float)*bbytes);
-  in_p1 = (float *) fftwf_malloc(sizeof(float)*bbytes);
-
-  // Initialize
-  for(i=0;i<bbytes;i++)
+  struct udpdet *ctx;
+  fftwf_iodim dims[1], howmany[1];
+
+  ctx = (struct udpdet *)malloc(sizeof(struct udpdet));
+  ctx->bbytes = bbytes;
+  ctx->dstat = dstat;
+  ctx->detspec = detspec_select(dstat);
+  if(ctx->detspec == NULL)
     {
-      in_p0[i]=(float)((int)src_p0[i]);
-      in_p1[i]=(float)((int)src_p1[i]);
+      fprintf(stderr,"Unknown data status %c for detection.\n",dstat);
+      exit(1);
     }
 
-  // Perform FFT
-  pl0 = fftwf_plan_dft_r2c_1d(bbytes, in_p0, out_p0, FFTW_ESTIMATE);
-  pl1 = fftwf_plan_dft_r2c_1d(bbytes, in_p1, out_p1, FFTW_ESTIMATE);
-  fftwf_execute(pl0);
-  fftwf_execute(pl1);
+  //Memo for FFT for two pols, back to back
+  ctx->in_p0 = (float *) fftwf_malloc(sizeof(float)*bbytes*2);
+  ctx->in_p1 = ctx->in_p0 + bbytes;
+  ctx->out_p0 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(bbytes/2+1)*2);
+  ctx->out_p1 = ctx->out_p0 + bbytes/2+1;
+
+  // One plan for both pols, measured once and kept
+  dims[0].n = bbytes;
+  dims[0].is = 1;
+  dims[0].os = 1;
+  howmany[0].n = 2;
+  howmany[0].is = bbytes;
+  howmany[0].os = bbytes/2+1;
+  ctx->pl = fftwf_plan_guru_dft_r2c(1, dims, 1, howmany, ctx->in_p0, ctx->out_p0, fftwisdom_flags());
+  if(ctx->pl == NULL)
+    {
+      fprintf(stderr,"Error in creating FFT plan for detection.\n");
+      exit(1);
+    }
+
+  return ctx;
+}
 
-  // Make detection
-  for(i=0;i<bbytes/2+1;i++)
+void udpdet_destroy(struct udpdet *ctx)
+{
+  fftwf_destroy_plan(ctx->pl);
+  fftwf_free(ctx->in_p0);
+  fftwf_free(ctx->out_p0);
+  free(ctx);
+}
+
+// Spectrum detection of one block of two pols, bbytes/2+1 channels in det
+void getUDPDetection(struct udpdet *ctx, const char *src_p0, const char *src_p1, float det[][4])
+{
+  float *in_p0=ctx->in_p0, *in_p1=ctx->in_p1;
+  int i;
+
+  // Samples straight into the FFT input
+  for(i=0;i<ctx->bbytes;i++)
     {
-      // Detection each FFT spetrum
-      getDetection(creal(out_p0[i]),cimag(out_p0[i]),creal(out_p1[i]),cimag(out_p1[i]),dets,dstat);
-      for(j=0;j<4;j++)
-	det[i][j]=dets[j];
+      in_p0[i]=(float)src_p0[i];
+      in_p1[i]=(float)src_p1[i];
     }
 
-  //Free up memo
-  fftwf_free(in_p0);
-  fftwf_free(in_p1);
-  fftwf_free(out_p0);
-  fftwf_free(out_p1);
-  fftwf_destroy_plan(pl0);
-  fftwf_destroy_plan(pl1);
+  // Perform FFT
+  fftwf_execute(ctx->pl);
+
+  // Make detection of each FFT spectrum
+  ctx->detspec(ctx->out_p0,ctx->out_p1,ctx->bbytes/2+1,det);
 }
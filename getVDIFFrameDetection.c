@@ -1,325 +1,188 @@
 #include "cvrt2to8.c"
 #include "ran.c"
+#include <stdlib.h>
 #include <malloc.h>
 #include <complex.h>
 #include <fftw3.h>
 #include "vdifio.h"
+#include "vdifdet.h"
 
-// Mean of unsigned 2-bit samples
-static float mean2bspl = 1.5;
-
-void getDetection(float p0r, float p0i, float p1r, float p1i, float *det, char dstat)
+// Set up detection of one stream of frame pairs
+struct vdifdet *vdifdet_create(int fbytes, int vdif_nchan, int nchan, char dstat)
 {
-  if (dstat == 'C')
-	{
-	  det[0]=p0r*p0r+p0i*p0i;
-	  det[1]=p1r*p1r+p1i*p1i;
-	  det[2]=p0r*p1r+p0i*p1i;
-	  det[3]=p0r*p1i-p0i*p1r;
-	}
-  else if (dstat == 'I')
-	det[0]=p0r*p0r+p0i*p0i+p1r*p1r+p1i*p1i;
-  else if (dstat == 'X')
-	det[0]=p0r*p0r+p0i*p0i;
-  else if (dstat == 'Y')
-	det[0]=p1r*p1r+p1i*p1i;
-  else if (dstat == 'S')
+  struct vdifdet *ctx;
+  fftwf_iodim dims[1], howmany[2];
+  int i, j, nfft, nout;
+
+  ctx = (struct vdifdet *)malloc(sizeof(struct vdifdet));
+  ctx->fbytes = fbytes;
+  ctx->vdif_nchan = vdif_nchan;
+  ctx->nchan = (vdif_nchan == 32) ? 32 : nchan;
+  ctx->dstat = dstat;
+
+  // Decode dstat to get npol and the detection kernel
+  ctx->npol = detnpol(dstat);
+  ctx->detsum = detsum_select(dstat);
+  if(ctx->detsum == NULL)
 	{
-      det[0]=(p0r*p0r+p0i*p0i)+(p1r*p1r+p1i*p1i);
-	  det[1]=(p0r*p0r+p0i*p0i)-(p1r*p1r+p1i*p1i);
-	  det[2]=2.0*(p0r*p1r+p0i*p1i);
-	  det[3]=2.0*(p0r*p1i-p0i*p1r);
+	  fprintf(stderr,"Unknown data status %c for detection.\n",dstat);
+	  exit(1);
 	}
-  else if (dstat == 'P')
-	{
-	  det[0]=sqrt(pow((p0r*p0r+p0i*p0i)-(p1r*p1r+p1i*p1i),2.0)+pow(2.0*(p0r*p1r+p0i*p1i),2.0));
-	  det[1]=2.0*(p0r*p1i-p0i*p1r);
-	}
-}
 
-// Get coherence detection from real 2-bit, 32-channel frame of two pols
-void getVDIFFrameDetection_32chan(const unsigned char *src_p0, const unsigned char *src_p1, int fbytes, float det[][4],char dstat, float *in_p0, float *in_p1, fftwf_complex *out_p0, fftwf_complex *out_p1, fftwf_plan pl0, fftwf_plan pl1)
-{
-  float dets[4];
-  int i,j,k,Nts,Nchan,npol;
-  unsigned char *buff8[2];
-
-  // Decode dstat to get npol
-  if(dstat=='C' || dstat=='S')
-	npol=4;
-  else if(dstat=='P')
-	npol=2;
+  // Number of time samples per FFT
+  if(vdif_nchan == 32)
+	ctx->Nts = fbytes*4/32;
   else
-	npol=1;
-
-  Nchan=32;
-  for(i=0;i<2;i++)
-    buff8[i]=malloc(sizeof(unsigned char)*fbytes*4);
-
-  //Extend from 2-bit to 8-bit
-  convert2to8(buff8[0], src_p0, fbytes);
-  convert2to8(buff8[1], src_p1, fbytes);
+	ctx->Nts = fbytes*4;
 
-  //Number of time samples
-  Nts=fbytes*4/Nchan;
-  
-  //Initialize
-  for(k=0;k<Nchan;k++)
-	for(j=0;j<4;j++)
-	  det[k][j]=0.0;
-  for(j=0;j<4;j++)
-	dets[j]=0.0;
-  
-  //Detect each channel
-  for(k=0;k<Nchan;k++)
-    {
-      //Read time series
-      for(i=0;i<Nts;i++)
+  //Number of FFT spectral per channel
+  ctx->chw = ctx->Nts/2/ctx->nchan;
+
+  // First FFT bin of each output channel, bin i goes to channel (i-1)/chw
+  ctx->binlo = (int *)malloc(sizeof(int)*(ctx->nchan+1));
+  for(j=0;j<ctx->nchan;j++)
+	ctx->binlo[j] = ctx->Nts/2+1;
+  ctx->binlo[ctx->nchan] = ctx->Nts/2+1;
+  for(i=ctx->Nts/2;i>=1;i--)
 	{
-	  if(k<Nchan/2)
-	    {
-	      //in[j][i]=(float)((int)buff8[j][i*Nchan+15-k]);
-	      in_p0[i]=(float)((int)buff8[0][i*Nchan+15-k])-mean2bspl;
-	      in_p1[i]=(float)((int)buff8[1][i*Nchan+15-k])-mean2bspl;
-	    }
-	  else
-	    {
-	      //in[j][i]=(float)((int)buff8[j][i*Nchan+15+Nchan-k]);
-	      in_p0[i]=(float)((int)buff8[0][i*Nchan+15+Nchan-k])-mean2bspl;
-	      in_p1[i]=(float)((int)buff8[1][i*Nchan+15+Nchan-k])-mean2bspl;
-	    }
+	  j=(i-1)/ctx->chw;
+	  if(j>=ctx->nchan)
+		j=ctx->nchan-1;
+	  ctx->binlo[j]=i;
 	}
-      fftwf_execute(pl0);
-      fftwf_execute(pl1);
 
-      // Make detection for each FFT channel and sum up
-      for(i=1;i<Nts/2;i++)
+  // Unpacker chosen for the running CPU
+  ctx->unpack = unpack2bit_select();
+
+  // Number of FFTs per pol and length of one FFT output
+  nfft = (vdif_nchan == 32) ? 32 : 1;
+  nout = ctx->Nts/2+1;
+
+  // Memo for FFT, the two pols back to back. The input is the whole
+  // unpacked frame, so channels of a 32-channel frame are interleaved.
+  ctx->in_p0 = (float *) fftwf_malloc(sizeof(float)*nfft*ctx->Nts*2);
+  ctx->in_p1 = ctx->in_p0 + nfft*ctx->Nts;
+  ctx->out_p0 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*nfft*nout*2);
+  ctx->out_p1 = ctx->out_p0 + nfft*nout;
+
+  // One plan for all channels of both pols: each FFT strides over the
+  // interleaved channels, and output channels are stored one after another
+  dims[0].n = ctx->Nts;
+  dims[0].is = nfft;
+  dims[0].os = 1;
+  howmany[0].n = nfft;
+  howmany[0].is = 1;
+  howmany[0].os = nout;
+  howmany[1].n = 2;
+  howmany[1].is = nfft*ctx->Nts;
+  howmany[1].os = nfft*nout;
+  ctx->pl = fftwf_plan_guru_dft_r2c(1, dims, 2, howmany, ctx->in_p0, ctx->out_p0, fftwisdom_flags());
+  if(ctx->pl == NULL)
 	{
-	  getDetection(creal(out_p0[i]),cimag(out_p0[i]),creal(out_p1[i]),cimag(out_p1[i]),dets,dstat);
-	  for(j=0;j<npol;j++)
-	    det[k][j]+=dets[j];
+	  fprintf(stderr,"Error in creating FFT plan for detection.\n");
+	  exit(1);
 	}
-      // Add DC and Nyquist power
-      getDetection(creal(out_p0[0]),cimag(out_p0[0]),creal(out_p1[0]),cimag(out_p1[0]),dets,dstat);
-      for(j=0;j<npol;j++)
-	det[k][j]+=dets[j]/2;
-      getDetection(creal(out_p0[Nts/2]),cimag(out_p0[Nts/2]),creal(out_p1[Nts/2]),cimag(out_p1[Nts/2]),dets,dstat);
-      for(j=0;j<npol;j++)
-	det[k][j]+=dets[j]/2;
-    }
 
-  //Free up memo
-  for(i=0;i<2;i++)
-    free(buff8[i]);
+  return ctx;
 }
 
-
-// Generate fake detection with given mean and rms for a frame with 32 channels
-void getVDIFFrameFakeDetection_32chan(double mean_scan[][32], double rms_scan[][32], float det[][4], long int *seed, int fbytes, char dstat)
+void vdifdet_destroy(struct vdifdet *ctx)
 {
-  fftwf_complex *out_p0,*out_p1;
-  fftwf_plan pl0,pl1;
-  float **in,dets[4], rum;
-  int i,j,k,Nts,npol,idat,Nchan;
+  fftwf_destroy_plan(ctx->pl);
+  fftwf_free(ctx->in_p0);
+  fftwf_free(ctx->out_p0);
+  free(ctx->binlo);
+  free(ctx);
+}
 
-  Nchan=32;
-  
-  // Decode dstat to get npol
-  if(dstat=='C' || dstat=='S')
-	npol=4;
-  else if(dstat=='P')
-	npol=2;
-  else
-	npol=1;
+// Detect the FFT output of channel position s into det[4], summing up all bins
+static void detectChannel(struct vdifdet *ctx, int s, float *det)
+{
+  fftwf_complex *out_p0=ctx->out_p0+s*(ctx->Nts/2+1), *out_p1=ctx->out_p1+s*(ctx->Nts/2+1);
+  float edge[4];
+  int j,Nts=ctx->Nts;
 
-  //Number of time samples
-  Nts=fbytes*4/Nchan;
-  
-  //Memo for FFT for two pols
-  in = (float **)malloc(sizeof(float *)*2);
-  for(i=0;i<2;i++)
-	in[i]= (float *)malloc(sizeof(float)*Nts);
-  out_p0 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(Nts/2+1));
-  out_p1 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(Nts/2+1));
-
-  //Initialize
-  for(k=0;k<Nchan;k++)
-	for(j=0;j<4;j++)
-	  det[k][j]=0.0;
+  // Make detection for each FFT channel and sum up
+  ctx->detsum(out_p0+1,out_p1+1,Nts/2-1,det);
 
+  // Add DC and Nyquist power
   for(j=0;j<4;j++)
-	dets[j]=0.0;
+	edge[j]=0.0;
+  ctx->detsum(out_p0,out_p1,1,edge);
+  ctx->detsum(out_p0+Nts/2,out_p1+Nts/2,1,edge);
+  for(j=0;j<ctx->npol;j++)
+	det[j]+=edge[j]/2;
+}
 
-  //Detect each channel
-  for(k=0;k<Nchan;k++)
-	{
-	  //Operate each pol
-	  for(j=0;j<2;j++)
-		{
-		  //Generate time series with given mean & rms
-		  for(i=0;i<Nts;i++)
-			in[j][i]=mean_scan[j][k]-mean2bspl;
-		}
-
-      // Make FFT plan and execute
-	  if(k==0)
-		{
-		  pl0 = fftwf_plan_dft_r2c_1d(Nts, in[0], out_p0, FFTW_ESTIMATE);
-		  pl1 = fftwf_plan_dft_r2c_1d(Nts, in[1], out_p1, FFTW_ESTIMATE);
-		}
-	  fftwf_execute(pl0);
-	  fftwf_execute(pl1);
-
-      // Make detection for each FFT channel and sum up
-	  for(i=1;i<Nts/2;i++)
-		{
-		  getDetection(creal(out_p0[i]),cimag(out_p0[i]),creal(out_p1[i]),cimag(out_p1[i]),dets,dstat);
-		  for(j=0;j<npol;j++)
-			det[k][j]+=dets[j];
-		}
-	  // Add DC and Nyquist power
-	  getDetection(creal(out_p0[0]),cimag(out_p0[0]),creal(out_p1[0]),cimag(out_p1[0]),dets,dstat);
-	  for(j=0;j<npol;j++)
-		det[k][j]+=dets[j]/2;
-	  getDetection(creal(out_p0[Nts/2]),cimag(out_p0[Nts/2]),creal(out_p1[Nts/2]),cimag(out_p1[Nts/2]),dets,dstat);
-	  for(j=0;j<npol;j++)
-		det[k][j]+=dets[j]/2;
-	}
+// Detect the FFT output of the whole band into nchan channels
+static void detectBand(struct vdifdet *ctx, float det[][4])
+{
+  int j;
 
-  //Free up memo
-  for(i=0;i<2;i++)
-	free(in[i]);
-  fftwf_free(out_p0);
-  fftwf_free(out_p1);
-  fftwf_destroy_plan(pl0);
-  fftwf_destroy_plan(pl1);
+  //Make detection for each FFT channel and sum up to given nchan
+  for(j=0;j<ctx->nchan;j++)
+    ctx->detsum(ctx->out_p0+ctx->binlo[j],ctx->out_p1+ctx->binlo[j],ctx->binlo[j+1]-ctx->binlo[j],det[j]);
 }
 
-// Generate fake detection with given mean and rms for a frame with one channel
-void getVDIFFrameFakeDetection_1chan(double *mean, double *rms, int Nchan, float det[][4], long int *seed, int fbytes, char dstat)
+// Get detection of a frame pair with the frame layout of the context
+void getVDIFFrameDetection(struct vdifdet *ctx, const unsigned char *src_p0, const unsigned char *src_p1, float det[][4])
 {
-  fftwf_complex *out_p0,*out_p1;
-  fftwf_plan pl0,pl1;
-  float **in,dets[4];
-  int i,j,k,Nts,npol, chw;
-
-  // Decode dstat to get npol
-  if(dstat=='C' || dstat=='S')
-	npol=4;
-  else if(dstat=='P')
-	npol=2;
+  if(ctx->vdif_nchan == 32)
+    getVDIFFrameDetection_32chan(ctx, src_p0, src_p1, det);
   else
-	npol=1;
-  
-  // Number of time samples
-  Nts = fbytes*4;
-
-  //Number of FFT spectral per channel
-  chw = Nts/2/Nchan;
-  
-  // Memo for FFT for two pols
-  in = (float **)malloc(sizeof(float *)*2);
-  for(i=0;i<2;i++)
-    in[i]= (float *)malloc(sizeof(float)*Nts);
-  out_p0 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(Nts/2+1));
-  out_p1 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(Nts/2+1));
-
-  // Initialize
-  for(k=0;k<Nchan;k++)
-    for(j=0;j<4;j++)
-      det[k][j]=0.0;
+    getVDIFFrameDetection_1chan(ctx, src_p0, src_p1, det);
+}
 
-  for(j=0;j<4;j++)
-    dets[j]=0.0;
+// Position of output channel k in a 32-channel frame, which is in reversed order
+static int chanPos32(int k)
+{
+  if(k<16)
+    return 15-k;
+  else
+    return 15+32-k;
+}
 
-  // Operate each pol
-  for(j=0;j<2;j++)
-    {
-      // Generate time series with given mean & rms
-      for(i=0;i<Nts;i++)
-	//in[j][i]=mean[j]+gasdev(seed)*rms[j]-mean2bspl;
-	in[j][i]=mean[j]-mean2bspl;
-    }
+// Get coherence detection from real 2-bit, 32-channel frame of two pols
+void getVDIFFrameDetection_32chan(struct vdifdet *ctx, const unsigned char *src_p0, const unsigned char *src_p1, float det[][4])
+{
+  int j,k,Nchan;
 
-  // Perform FFT
-  pl0 = fftwf_plan_dft_r2c_1d(Nts, in[0], out_p0, FFTW_ESTIMATE);
-  pl1 = fftwf_plan_dft_r2c_1d(Nts, in[1], out_p1, FFTW_ESTIMATE);
-  fftwf_execute(pl0);
-  fftwf_execute(pl1);
+  Nchan=32;
 
-  // Make detection
-  for(i=1;i<=Nts/2;i++)
-    {
-      getDetection(creal(out_p0[i]),cimag(out_p0[i]),creal(out_p1[i]),cimag(out_p1[i]),dets,dstat);
+  //Initialize
+  for(k=0;k<Nchan;k++)
+	for(j=0;j<4;j++)
+	  det[k][j]=0.0;
 
-      // Channel index
-      j=(i-1)/chw;
+  //Extend the whole frame from 2-bit to float, channels stay interleaved
+  ctx->unpack(ctx->in_p0, src_p0, ctx->fbytes);
+  ctx->unpack(ctx->in_p1, src_p1, ctx->fbytes);
 
-      // Envalue
-      for(k=0;k<4;k++)
-	det[j][k]+=dets[k];
-    }
+  //FFT of all channels of both pols
+  fftwf_execute(ctx->pl);
 
-  //Free up memo
-  for(i=0;i<2;i++)
-    free(in[i]);
-  fftwf_free(out_p0);
-  fftwf_free(out_p1);
-  fftwf_destroy_plan(pl0);
-  fftwf_destroy_plan(pl1);
+  //Detect each channel
+  for(k=0;k<Nchan;k++)
+    detectChannel(ctx, chanPos32(k), det[k]);
 }
 
-void getVDIFFrameDetection_1chan(const unsigned char *src_p0, const unsigned char *src_p1, int fbytes, float det[][4], int nchan, char dstat, float *in_p0, float *in_p1, fftwf_complex *out_p0, fftwf_complex *out_p1, fftwf_plan pl0, fftwf_plan pl1)
+void getVDIFFrameDetection_1chan(struct vdifdet *ctx, const unsigned char *src_p0, const unsigned char *src_p1, float det[][4])
 {
-  float dets[4];
-  int i,j,k,Nts,chw;
-  unsigned char *buff8[2];
-  
-  for(i=0;i<2;i++)
-    buff8[i]=malloc(sizeof(unsigned char)*fbytes*4);
-
-  //Extend from 2-bit to 8-bit
-  convert2to8(buff8[0], src_p0, fbytes);
-  convert2to8(buff8[1], src_p1, fbytes);
-
-  //Number of time samples
-  Nts=fbytes*4;
-
-  //Number of FFT spectral per channel
-  chw=Nts/2/nchan;
+  int j,k;
   
   // Initialization
-  for(j=0;j<4;j++)
-    dets[j]=0.0;
-  for(j=0;j<nchan;j++)
+  for(j=0;j<ctx->nchan;j++)
     for(k=0;k<4;k++)
       det[j][k]=0.0;
 
-  for(i=0;i<Nts;i++)
-    {
-      in_p0[i] = (float)((int)buff8[0][i])-mean2bspl;
-      in_p1[i] = (float)((int)buff8[1][i])-mean2bspl;
-    }
+  //Extend from 2-bit to float straight into the FFT input
+  ctx->unpack(ctx->in_p0, src_p0, ctx->fbytes);
+  ctx->unpack(ctx->in_p1, src_p1, ctx->fbytes);
 
-  fftwf_execute(pl0);
-  fftwf_execute(pl1);
+  fftwf_execute(ctx->pl);
 
   //Make detection for each FFT channel and sum up to given nchan
-  for(i=1;i<=Nts/2;i++)
-    {
-      getDetection(creal(out_p0[i]),cimag(out_p0[i]),creal(out_p1[i]),cimag(out_p1[i]),dets,dstat);
-
-      // Channel index
-      j=(i-1)/chw;
-
-      // Envalue
-      for(k=0;k<4;k++)
-	det[j][k]+=dets[k];
-    }
-
-  //Free up memo
-  for(i=0;i<2;i++)
-    free(buff8[i]);
+  detectBand(ctx, det);
 }
 
 int getVDIFFrameInvalid_robust(const vdif_header *header, int framebytes)
@@ -338,3 +201,28 @@ int getVDIFFrameInvalid_robust(const vdif_header *header, int framebytes)
   else
     return 0;
 }
+
+// Offset in frames of header from headerst, fps frames per second.
+// Signed 64-bit throughout, so earlier frames come out negative and a
+// scan over midnight does not wrap.
+int64_t getVDIFFrameOffset(const vdif_header *headerst, const vdif_header *header, uint32_t fps)
+{
+  int64_t day[2],sec[2],num[2];
+  int64_t offset;
+
+  // Get epoch
+  day[0]=getVDIFFrameMJD(headerst);
+  day[1]=getVDIFFrameMJD(header);
+
+  // Get second after epoch
+  sec[0]=getVDIFFrameSecond(headerst);
+  sec[1]=getVDIFFrameSecond(header);
+
+  // Get number of frame after second
+  num[0]=getVDIFFrameNumber(headerst);
+  num[1]=getVDIFFrameNumber(header);
+
+  offset=(day[1]-day[0])*86400*fps+(sec[1]-sec[0])*fps+(num[1]-num[0]);
+
+  return offset;
+}
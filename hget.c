@@ -55,6 +55,14 @@
  * Subroutine:  notnum (string) returns 0 if number, else 1
  * Subroutine:  numdec (string) returns number of decimal places in numeric string
  * Subroutine:  strfix (string,blankfill,zerodrop) removes extraneous characters
+ * Subroutine:  hindex_build (hx,header,maxlen) indexes the cards of a header
+ * Subroutine:  hindex_rebind (hx,header,maxlen) moves an index to a header of the same layout
+ * Subroutine:  hindex_free (hx) frees an index
+ * Subroutine:  hindex_card (hx,keyword) returns pointer to the card of keyword
+ * Subroutine:  hindex_geti4 (hx,keyword,ival) returns long integer
+ * Subroutine:  hindex_getr4 (hx,keyword,rval) returns real
+ * Subroutine:  hindex_getr8 (hx,keyword,dval) returns double
+ * Subroutine:  hindex_gets (hx,keyword,lstr,str) returns character string
  */
 
 #include <string.h>             /* NULL, strlen, strstr, strcpy */
@@ -871,8 +879,10 @@ const char *keyword0;   /* character string containing the name of the keyword
                    the n'th token in the value is returned.
                    (the first 8 characters must be unique) */
 {
-    //static char cval[80];
-    char cval[80];
+    /* The value is returned to the caller, so it cannot live on the
+     * stack; one copy per thread keeps threaded callers apart.
+     */
+    static __thread char cval[80];
     char *value;
     char cwhite[2];
     char squot[2], dquot[2], lbracket[2], rbracket[2], slash[2], comma[2];
@@ -1819,6 +1829,196 @@ int     dropzero;       /* If nonzero, drop trailing zeroes */
 
 }
 
+
+/* Indexed keyword lookup. The hget routines above search the whole
+ * header for every keyword. For headers read again and again, such as
+ * those of every block of raw voltage data, the 80-character cards are
+ * indexed once by keyword in a hash table, and each lookup then only
+ * parses its own card. Blocks of one observation have the same cards in
+ * the same order and differ only in values (PKTIDX, DROPBLK, ...), so
+ * the index of one block header is reused for the next as long as its
+ * keyword columns are unchanged.
+ */
+
+static unsigned int
+hindex_hash (const char *key)
+/* Hash of an 8-character keyword field, case-insensitive */
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        h ^= (unsigned char) (key[i] >= 'a' && key[i] <= 'z' ? key[i] - 32 : key[i]);
+        h *= 16777619u;
+        }
+    return (h);
+}
+
+static void
+hindex_field (const char *keyword, char *field)
+/* Keyword as the 8-character field of a card, blank filled */
+{
+    int i;
+
+    for (i = 0; i < 8 && keyword[i] != (char) 0; i++)
+        field[i] = keyword[i];
+    for (; i < 8; i++)
+        field[i] = ' ';
+}
+
+int
+hindex_build (struct hindex *hx, const char *header, int maxlen)
+/* Index the cards of header, of at most maxlen bytes. Returns the length
+   of the header up to and including its END card, 0 if there is none. */
+{
+    int i, ncard, nslot;
+    unsigned int h;
+
+    if (hx->slot == NULL)
+        memset (hx, 0, sizeof (struct hindex));
+
+    /* Count cards up to END */
+    for (ncard = 0; (ncard + 1) * 80 <= maxlen; ncard++) {
+        if (!strncmp (header + ncard * 80, "END", 3) &&
+            (header[ncard * 80 + 3] == ' ' || header[ncard * 80 + 3] == (char) 0))
+            break;
+        }
+    if ((ncard + 1) * 80 > maxlen) {
+        hindex_free (hx);
+        return (0);
+        }
+
+    /* Hash table at most half full */
+    for (nslot = 16; nslot < 2 * ncard; nslot *= 2);
+    if (nslot != hx->nslot) {
+        free (hx->slot);
+        hx->slot = (int *) malloc (nslot * sizeof (int));
+        hx->nslot = nslot;
+        }
+    for (i = 0; i < nslot; i++)
+        hx->slot[i] = -1;
+    free (hx->keys);
+    hx->keys = (char *) malloc (ncard * 8 + 1);
+
+    /* First card of each keyword, as ksearch() would find */
+    for (i = 0; i < ncard; i++) {
+        memcpy (hx->keys + i * 8, header + i * 80, 8);
+        h = hindex_hash (header + i * 80) & (nslot - 1);
+        while (hx->slot[h] >= 0 &&
+               strncasecmp (header + hx->slot[h] * 80, header + i * 80, 8))
+            h = (h + 1) & (nslot - 1);
+        if (hx->slot[h] < 0)
+            hx->slot[h] = i;
+        }
+
+    hx->header = header;
+    hx->ncard = ncard;
+    hx->lhead = (ncard + 1) * 80;
+    return (hx->lhead);
+}
+
+int
+hindex_rebind (struct hindex *hx, const char *header, int maxlen)
+/* Point the index at another header, of at most maxlen bytes. The index
+   is kept if the header has the same keywords in the same places;
+   otherwise the header is indexed again. Returns the header length, 0 if
+   there is no END card. */
+{
+    int i;
+
+    if (hx->slot != NULL && hx->lhead <= maxlen &&
+        !strncmp (header + hx->ncard * 80, "END", 3)) {
+        for (i = 0; i < hx->ncard; i++)
+            if (memcmp (hx->keys + i * 8, header + i * 80, 8))
+                break;
+        if (i == hx->ncard) {
+            hx->header = header;
+            return (hx->lhead);
+            }
+        }
+    return (hindex_build (hx, header, maxlen));
+}
+
+void
+hindex_free (struct hindex *hx)
+{
+    free (hx->slot);
+    free (hx->keys);
+    memset (hx, 0, sizeof (struct hindex));
+}
+
+const char *
+hindex_card (const struct hindex *hx, const char *keyword)
+/* Card of keyword, NULL if not in the header */
+{
+    char field[8];
+    unsigned int h;
+
+    if (hx->slot == NULL)
+        return (NULL);
+    hindex_field (keyword, field);
+    h = hindex_hash (field) & (hx->nslot - 1);
+    while (hx->slot[h] >= 0) {
+        if (!strncasecmp (hx->header + hx->slot[h] * 80, field, 8))
+            return (hx->header + hx->slot[h] * 80);
+        h = (h + 1) & (hx->nslot - 1);
+        }
+    return (NULL);
+}
+
+static const char *
+hindex_line (const struct hindex *hx, const char *keyword, char *line)
+/* The card of keyword as a header of its own, for the hget routines.
+   Keywords the index does not cover are looked up the usual way. */
+{
+    const char *card;
+
+    if (strlen (keyword) > 8 || strchr (keyword, '[') || strchr (keyword, ','))
+        return (hx->header);
+    card = hindex_card (hx, keyword);
+    if (card == NULL)
+        return (NULL);
+    memcpy (line, card, 80);
+    line[80] = (char) 0;
+    return (line);
+}
+
+int
+hindex_geti4 (const struct hindex *hx, const char *keyword, int *ival)
+{
+    char line[81];
+    const char *h = hindex_line (hx, keyword, line);
+
+    return (h == NULL ? 0 : hgeti4 (h, keyword, ival));
+}
+
+int
+hindex_getr4 (const struct hindex *hx, const char *keyword, float *rval)
+{
+    char line[81];
+    const char *h = hindex_line (hx, keyword, line);
+
+    return (h == NULL ? 0 : hgetr4 (h, keyword, rval));
+}
+
+int
+hindex_getr8 (const struct hindex *hx, const char *keyword, double *dval)
+{
+    char line[81];
+    const char *h = hindex_line (hx, keyword, line);
+
+    return (h == NULL ? 0 : hgetr8 (h, keyword, dval));
+}
+
+int
+hindex_gets (const struct hindex *hx, const char *keyword, const int lstr, char *str)
+{
+    char line[81];
+    const char *h = hindex_line (hx, keyword, line);
+
+    return (h == NULL ? 0 : hgets (h, keyword, lstr, str));
+}
+
 /* Oct 28 1994  New program
  *
  * Mar  1 1995  Search for / after second quote, not first one
@@ -1921,4 +2121,7 @@ int     dropzero;       /* If nonzero, drop trailing zeroes */
  * Feb 28 2007  If header length is not set in hlength, set it to 0
  * May 31 2007  Add return value of 3 to isnum() if string has colon(s)
  * Aug 22 2007  If closing quote not found, make one up
+ *
+ * Keep the value of hgetc() in a per-thread static, not on the stack
+ * Add hindex_*() to look keywords up through an index of the cards
  */
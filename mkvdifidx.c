@@ -0,0 +1,108 @@
+//Build binary frame index of VDIF files, written as <file>.vidx
+//The index replaces header tables and lets converters find frames by time
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vdifidx.h"
+
+int usage(char *prg_name)
+{
+  fprintf(stdout,
+	  "%s [options] file1.vdif [file2.vdif ...]\n"
+	  " -l   Frame size in Byte, including header (by default from the first frame)\n"
+	  " -F   Frames per second per thread (by default the largest frame number plus one)\n"
+	  " -o   Output index file, only with one input file (by default <file>.vidx)\n"
+	  " -v   Print the gaps\n"
+	  " -h   Available options\n",
+	  prg_name);
+  exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+  char idxname[2048],oname[2048];
+  int arg,i,fbytes,fps,ifout,ifverbose;
+  int64_t nfr,ninval,nmiss;
+  uint64_t k;
+  struct vdifidx *ix;
+
+  // Default
+  fbytes=0;
+  fps=0;
+  ifout=0;
+  ifverbose=0;
+
+  //Read arguments
+  while ((arg=getopt(argc,argv,"hl:F:o:v")) != -1)
+    {
+      switch(arg)
+	{
+	case 'l':
+	  fbytes=atoi(optarg);
+	  break;
+
+	case 'F':
+	  fps=atoi(optarg);
+	  break;
+
+	case 'o':
+	  strcpy(oname,optarg);
+	  ifout=1;
+	  break;
+
+	case 'v':
+	  ifverbose=1;
+	  break;
+
+	case 'h':
+	  usage(argv[0]);
+	  return 0;
+
+	default:
+	  usage(argv[0]);
+	  return 0;
+	}
+    }
+
+  if(optind>=argc)
+    {
+      fprintf(stderr,"Error: No input VDIF file.\n");
+      exit(0);
+    }
+  if(ifout && argc-optind>1)
+    {
+      fprintf(stderr,"Error: Output index file given for more than one input.\n");
+      exit(0);
+    }
+
+  for(i=optind;i<argc;i++)
+    {
+      if(ifout)
+	strcpy(idxname,oname);
+      else
+	vdifidx_name(idxname,sizeof(idxname),argv[i]);
+
+      printf("Indexing %s...\n",argv[i]);
+      nfr=vdifidx_build(argv[i],idxname,fbytes,fps);
+
+      // Summary
+      ix=vdifidx_open(idxname);
+      ninval=0;
+      for(k=0;k<ix->hdr->nentry;k++)
+	if(!(ix->entry[k].flags & VDIFIDX_VALID))
+	  ninval++;
+      nmiss=0;
+      for(k=0;k<ix->hdr->ngap;k++)
+	{
+	  nmiss+=ix->gap[k].nmissing;
+	  if(ifverbose)
+	    printf("Gap of %lu frame(s) before thread %d second %u frame %u.\n",(unsigned long)ix->gap[k].nmissing,ix->entry[ix->gap[k].entry].thread,ix->entry[ix->gap[k].entry].second,ix->entry[ix->gap[k].entry].frame);
+	}
+      printf("%s: %ld frames of %u bytes, %ld invalid, %lu gaps missing %ld frames, %u frames per second.\n",idxname,(long)nfr,ix->hdr->framebytes,(long)ninval,(unsigned long)ix->hdr->ngap,(long)nmiss,ix->hdr->fps);
+      vdifidx_close(ix);
+    }
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+//Pre-generate FFTW wisdom for the detection FFTs of the converters
+//Wisdom goes to $PSRCOV_WISDOM, or else $HOME/.psrcov
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fftw3.h>
+#include "vdifdet.h"
+
+int usage(char *prg_name)
+{
+  fprintf(stdout,
+	  "%s [options]\n"
+	  " -f   Bytes of payload per VDIF frame, for vdif2psrfitsPico and vdif2psrfitsALMA\n"
+	  " -c   Number of channels in the VDIF frame, 1 for Pico and 32 for ALMA (by default 1)\n"
+	  " -d   Number of thread to use in FFT (by default 1)\n"
+	  " -u   FFT length factor of UDP2psrfits, need to be power of 2 up to 128\n"
+	  " -e   Plan FFT with FFTW_PATIENT\n"
+	  " -h   Available options\n",
+	  prg_name);
+  exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+  int arg,i,fbytes,vdif_nchan,nthd,len,Nts;
+  struct vdifdet *vdet;
+  struct udpdet *udet;
+
+  // Default
+  fbytes=0;
+  vdif_nchan=1;
+  nthd=1;
+  len=0;
+
+  //Read arguments
+  while ((arg=getopt(argc,argv,"hf:c:d:u:e")) != -1)
+    {
+      switch(arg)
+	{
+	case 'f':
+	  fbytes=atoi(optarg);
+	  break;
+
+	case 'c':
+	  vdif_nchan=atoi(optarg);
+	  break;
+
+	case 'd':
+	  nthd=atoi(optarg);
+	  break;
+
+	case 'u':
+	  len=atoi(optarg);
+	  break;
+
+	case 'e':
+	  fftwisdom_patient(1);
+	  break;
+
+	case 'h':
+	  usage(argv[0]);
+	  return 0;
+
+	default:
+	  usage(argv[0]);
+	  return 0;
+	}
+    }
+
+  if(fbytes<=0 && len<=0)
+    {
+      fprintf(stderr,"Error: Give frame bytes (-f) and/or UDP FFT length factor (-u).\n");
+      exit(0);
+    }
+  if(vdif_nchan!=1 && vdif_nchan!=32)
+    {
+      fprintf(stderr,"Error: Invalid number of VDIF channels %d.\n",vdif_nchan);
+      exit(0);
+    }
+
+  if(fbytes>0)
+    {
+      if(nthd > 1) {
+	i=fftwf_init_threads();
+	if(!i) {
+	  fprintf(stderr,"Error in initializing threads.\n");
+	  exit(0);
+	}
+	fftwf_plan_with_nthreads(nthd);
+      }
+      Nts = (vdif_nchan == 32) ? fbytes*4/32 : fbytes*4;
+      printf("Planning VDIF detection FFT...length %d, %d thread(s)...",Nts,nthd);
+      fflush(stdout);
+      fftwisdom_load(vdif_nchan == 32 ? "vdif32chan" : "vdif1chan",Nts,nthd);
+      vdet=vdifdet_create(fbytes,vdif_nchan,1,'I');
+      fftwisdom_save(vdif_nchan == 32 ? "vdif32chan" : "vdif1chan",Nts,nthd);
+      vdifdet_destroy(vdet);
+      printf("Done.\n");
+    }
+
+  if(len>0)
+    {
+      // UDP2psrfits plans in one thread, with 4096 samples per block
+      if(nthd > 1)
+	fftwf_plan_with_nthreads(1);
+      Nts = 4096*len*2;
+      printf("Planning UDP detection FFT...length %d...",Nts);
+      fflush(stdout);
+      fftwisdom_load("udp",Nts,1);
+      udet=udpdet_create(Nts,'I');
+      fftwisdom_save("udp",Nts,1);
+      udpdet_destroy(udet);
+      printf("Done.\n");
+    }
+
+  return 0;
+}
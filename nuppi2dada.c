@@ -1,5 +1,5 @@
 //convert nuppi format raw data to DADA format
-//extract a single channel
+//extract one or more subbands in one pass, each to its own dada files
 
 #include <stdio.h>
 #include "fitshead.h"
@@ -9,10 +9,35 @@
 #include <strings.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "hget.c"
 #include "mjd2date.c"
 #include "ascii_header.c"
 #include "srcname_corr.c"
+#include "dadawriter.h"
+#include "vdifchan.h"
+
+void read_at(int fd, char *buf, size_t bytes, off_t pos, char *name)
+{
+  ssize_t n;
+
+  //Read exactly bytes from pos, a short read means a broken file
+  while(bytes>0)
+    {
+      n=pread(fd,buf,bytes,pos);
+      if(n<0 && errno==EINTR) continue;
+      if(n<=0)
+	{
+	  printf("Cannot read %s at byte %ld.\n",name,(long)pos);
+	  exit(0);
+	}
+      buf+=n;
+      pos+=n;
+      bytes-=n;
+    }
+}
 
 int usage(char *prg_name)
 {
@@ -21,10 +46,11 @@ int usage(char *prg_name)
            " -N   Maximum size of nuppi file header (by default 131072)\n"
            " -D   Dada file header size (by default 4096)\n"
            " -B   Required bytes for a single output file (by default 640000000)\n"
-           " -b   Subband index to extract, begin from 0\n"
+           " -b   Subband indices to extract, begin from 0 (e.g. 3, 0-31 or 1,5,8-11)\n"
            " -L   List of input files\n"
            " -S   Sample data header file\n"
            " -O   Route for output (by default /data2/kliu/tmp/)\n"
+           " -d   Write output with O_DIRECT\n"
 	   " -h   Available options\n",
 	  prg_name);
   exit(0);
@@ -32,7 +58,8 @@ int usage(char *prg_name)
 
 main(int argc, char *argv[])
 {
-  FILE *fraw,*dadahdr_spl,*list,*outdada;
+  FILE *fraw,*dadahdr_spl,*list;
+  struct dadawriter *outdada[VDIFCHAN_MAXCHAN];
 
   //default nuppi&dada header file set up
   int MAX_HEADER_SIZE=1024*128;
@@ -44,11 +71,11 @@ main(int argc, char *argv[])
   //640000000 for 10s integration time
   long B_out=640000000;
 
-  int bdidx=-1,arg;
-  char *listfile=0,*dadahdrsamp=0;
+  int bdidx[VDIFCHAN_MAXCHAN],nbd,bdlo,bdhi,b,arg,wflags=0;
+  char *listfile=0,*dadahdrsamp=0,*bdlist=0;
 
   //read in arguments
-  while ((arg=getopt(argc,argv,"hN:D:B:b:L:S:O:")) != -1)
+  while ((arg=getopt(argc,argv,"hN:D:B:b:L:S:O:d")) != -1)
     {
       switch(arg)
 	{
@@ -65,7 +92,7 @@ main(int argc, char *argv[])
 	  break;
 
 	case 'b':
-	  bdidx=atoi(optarg);
+	  bdlist=optarg;
 	  break;
 
 	case 'L':
@@ -80,6 +107,10 @@ main(int argc, char *argv[])
           strcpy(outroute,optarg);          
           break;
 
+	case 'd':
+	  wflags|=DADAWRITER_ODIRECT;
+	  break;
+
 	case 'h':
 	  usage(argv[0]);
 	  return 0;
@@ -91,7 +122,7 @@ main(int argc, char *argv[])
     }
 
   //check if provided info is enough
-  if(bdidx==-1)
+  if(bdlist==0)
     {
       printf("Extracted band index must be give.\n");
       exit(0);
@@ -109,20 +140,18 @@ main(int argc, char *argv[])
       exit(0);
     }
 
-  int hdrlength,blocksize,imjd,smjd,n_bit,n_pol,n_band,blocksize_chan,blocksize_p1,blocksize_p2,ct_block,ct_outfile,i,pktidx_step,pktidx,pktsize,pktidx_pre,overlap,opkt,obyte_chan;
+  int fd,directio,hdrlength,blocksize,imjd,smjd,n_bit,n_pol,n_band,blocksize_chan,pktidx_step,pktidx,pktsize,pktidx_pre,overlap,opkt,obyte_chan;
   int jd;
   fpos_t fileposi;
-  long fileoffset;
-  char hdr_buffer[MAX_HEADER_SIZE],src_name[20],src_name_new[20],ra[15],dec[15],cmd[200],datafilename[200],filebasename[50],outname[50],ut[30],dadahdr[DADAHDR_SIZE],mjd_str[25],*block,*block_p1,*block_p2,buf;
+  struct stat fst;
+  struct hindex hx;
+  long k,nblock;
+  off_t pos;
+  char hdr_buffer[MAX_HEADER_SIZE],src_name[20],src_name_new[20],ra[15],dec[15],cmd[200],datafilename[200],filebasename[50],stem[100],ut[30],dadahdr[DADAHDR_SIZE],mjd_str[25],*block,*hbuf,buf;
   float freq,t_samp,freq_sub,bw;
+  size_t bytes_read;
   long double mjd,fmjd;
 
-  //initialize counters
-  fileoffset=0;
-  blocksize_p1=0;
-  blocksize_p2=0;
-  ct_outfile=0;
-
   list=fopen(listfile,"rt");
   if(list==NULL)
     {
@@ -148,34 +177,54 @@ main(int argc, char *argv[])
   fread(hdr_buffer,1,MAX_HEADER_SIZE,fraw);
 
   /*-------Obtain header information-------*/
-  //get header length                                  
-  hdrlength = gethlength(hdr_buffer);
+  //index the header cards by keyword and get header length
+  memset(&hx,0,sizeof(hx));
+  hdrlength = hindex_build(&hx,hdr_buffer,MAX_HEADER_SIZE);
+  if(hdrlength==0)
+    {
+      printf("No header END found in %s.\n",datafilename);
+      exit(0);
+    }
+
+  //Header padded to 512 bytes with DIRECTIO
+  directio=0;
+  hindex_geti4(&hx,"DIRECTIO", &directio);
+  if(directio) hdrlength=(hdrlength+511)/512*512;
 
   //Get block size without header   
-  hgeti4(hdr_buffer, "BLOCSIZE", &blocksize);
+  hindex_geti4(&hx,"BLOCSIZE", &blocksize);
 
   //Get packet size
-  hgeti4(hdr_buffer, "PKTSIZE", &pktsize);
+  hindex_geti4(&hx,"PKTSIZE", &pktsize);
 
   //Get number of bands 
-  hgeti4(hdr_buffer,"OBSNCHAN",&n_band);
-  if(bdidx>=n_band)
+  hindex_geti4(&hx,"OBSNCHAN",&n_band);
+  nbd=vdifchan_parse_list(bdlist,bdidx,n_band);
+  if(nbd<1)
     {
       printf("Required channel index exceeds number of bands.\n");
       exit(0);
     }
 
+  //Range of subbands to read from each block
+  bdlo=bdhi=bdidx[0];
+  for(b=1;b<nbd;b++)
+    {
+      if(bdidx[b]<bdlo) bdlo=bdidx[b];
+      if(bdidx[b]>bdhi) bdhi=bdidx[b];
+    }
+
   //Get number of polarisation samples
-  hgeti4(hdr_buffer,"NPOL",&n_pol);
+  hindex_geti4(&hx,"NPOL",&n_pol);
 
   //Get number of sampling bits
-  hgeti4(hdr_buffer,"NBITS",&n_bit);
+  hindex_geti4(&hx,"NBITS",&n_bit);
 
   //Get overlap between blocks, in samples per channel
-  hgeti4(hdr_buffer, "OVERLAP", &overlap);
+  hindex_geti4(&hx,"OVERLAP", &overlap);
 
   //Get the packet index of the new block    
-  hgeti4(hdr_buffer, "PKTIDX", &pktidx);
+  hindex_geti4(&hx,"PKTIDX", &pktidx);
 
   //Number of packets within a block, not overlapped
   obyte_chan=overlap*n_pol*n_bit/8;
@@ -190,13 +239,13 @@ main(int argc, char *argv[])
     }
 
   //get source name                                                     
-  hgets(hdr_buffer,"SRC_NAME",20,src_name);
+  hindex_gets(&hx,"SRC_NAME",20,src_name);
 
   //get starting MJD integer 
-  hgeti4(hdr_buffer,"STT_IMJD",&imjd);
+  hindex_geti4(&hx,"STT_IMJD",&imjd);
 
   //get starting MJD second                                             
-  hgeti4(hdr_buffer,"STT_SMJD",&smjd);
+  hindex_geti4(&hx,"STT_SMJD",&smjd);
 
   //convert starting MJD to UT, based on the fact that starting time from an integer second     
   mjd=(long double)imjd+(long double)smjd/86400.0;
@@ -206,31 +255,28 @@ main(int argc, char *argv[])
   sprintf(mjd_str,"%i.%016.0Lf",imjd,(long double)smjd/86400*1.0e16);
 
   //get RA                                                              
-  hgets(hdr_buffer,"RA_STR",15,ra);
+  hindex_gets(&hx,"RA_STR",15,ra);
 
   //get DEC                                                             
-  hgets(hdr_buffer,"DEC_STR",15,dec);
+  hindex_gets(&hx,"DEC_STR",15,dec);
 
   //get central frequency                                               
-  hgetr4(hdr_buffer,"OBSFREQ",&freq);
+  hindex_getr4(&hx,"OBSFREQ",&freq);
 
   //get length of full bandwidth
-  hgetr4(hdr_buffer,"OBSBW",&bw);
+  hindex_getr4(&hx,"OBSBW",&bw);
 
   //get sampling time, and convert into microsecond                     
-  hgetr4(hdr_buffer,"TBIN",&t_samp);
+  hindex_getr4(&hx,"TBIN",&t_samp);
   t_samp*=1.0e6;
 
   //get file basic name without extension                               
-  hgets(hdr_buffer,"BASENAME",50,filebasename);
+  hindex_gets(&hx,"BASENAME",50,filebasename);
 
   /*-----------------------------------*/
 
-  //go back to the beginning of data file 
-  fseek(fraw, 0, SEEK_SET);
-
-  //calculate central frequency of the output file
-  freq_sub=freq-bw/2+bw/n_band/2+bw*bdidx/n_band;
+  //done with the first header, blocks are read from the list below
+  fclose(fraw);
 
   //read sample DADA format header into memory
   memset(dadahdr,0,DADAHDR_SIZE);
@@ -238,173 +284,96 @@ main(int argc, char *argv[])
   fread(dadahdr,1,DADAHDR_SIZE,dadahdr_spl);
   fclose(dadahdr_spl);
 
-  //allocate memo for channel block
-  block=malloc((blocksize_chan-obyte_chan)*sizeof(char));
-
-  while(feof(list)==0)
-  {
-    //calculate expected fileoffset for the next output file
-    fileoffset=B_out*ct_outfile;
-
-    //open an output file, file name: UT(obs start)_freq_offset.dada
-    sprintf(outname,"%s%s_%.1f_%016ld.000000.dada",outroute,ut,freq_sub,fileoffset);
-    outdada=fopen(outname,"wb");
-
-    //modify sample header saved in memory
-    ascii_header_set(dadahdr,"FILE_SIZE","%ld",B_out);
-    ascii_header_set(dadahdr,"UTC_START","%s",ut);
-    ascii_header_set(dadahdr,"MJD_START","%s",mjd_str);
-    //modify source name to match dada format requirement
-    srcname_corr(src_name,src_name_new);
-    ascii_header_set(dadahdr,"SOURCE","%s",src_name_new);
-    ascii_header_set(dadahdr,"RA","%s",ra);
-    ascii_header_set(dadahdr,"DEC","%s",dec);
-    ascii_header_set(dadahdr,"FREQ","%f",freq_sub);
-    ascii_header_set(dadahdr,"BW","%f",bw/n_band);
-    ascii_header_set(dadahdr,"TSAMP","%f",t_samp);
-    ascii_header_set(dadahdr,"FILE_NAME","%s",filebasename);
-    ascii_header_set(dadahdr,"OBS_OFFSET","%ld",fileoffset);
-
-    //Write header into output file
-    fwrite(dadahdr,1,DADAHDR_SIZE,outdada);
-
-    //If there is left over from previously read block, write in
-    if(blocksize_p2!=0) 
-      {
-	fwrite(block_p2,1,blocksize_p2,outdada);
-	free(block_p2);
-      }
-
-    //Compute how many integer number of blocks to read next and the leftover
-    ct_block=floor((B_out-blocksize_p2)/(blocksize_chan-obyte_chan));
-    printf("Integer number of block to read: %i\n",ct_block);
-    blocksize_p1=B_out-(blocksize_chan-obyte_chan)*ct_block-blocksize_p2;
-    blocksize_p2=blocksize_chan-obyte_chan-blocksize_p1;
-    printf("Fraction at the tail: %d\n",blocksize_p1);
-    printf("Leftover for the next: %d\n",blocksize_p2);
-
-    //write in data
-    for(i=0;i<=ct_block;i++)
-      {
-	//Read in one more char to see if reach the end of nuppi file
-	fgetc(fraw);
-
-	//if the end of the nuppi file, switch to the next
-	if(feof(fraw)!=0)
-	  {
-	    printf("%s finished.\n",datafilename);
-	    fclose(fraw);
-	    fscanf(list,"%s",datafilename);
-
-	    //If no more data to read
-	    if(feof(list)!=0)
-	      {
-		printf("Data file list finished.\n");
-		free(block);
-		fclose(list);
-		fclose(outdada);
-		exit(0);
-	      }
-
-	    fraw=fopen(datafilename,"rt");
-	    if(fraw==NULL)
-	      {
-		printf("Data file %s not found.\n",datafilename);
-		exit(0);
-	      }
-	  }
-	else
-	  //Switch back by one char
-	  {
-	    fseek(fraw,-sizeof(char),SEEK_CUR);
-	  }
-
-	//Read block header into buffer
-	memset(hdr_buffer,0,MAX_HEADER_SIZE);
-	fread(hdr_buffer,1,MAX_HEADER_SIZE,fraw);
-
-	//Get the packet index of the new block
-	hgeti4(hdr_buffer, "PKTIDX", &pktidx);
-
-	//Switch back to the beginning of block
-	fseek(fraw, -MAX_HEADER_SIZE, SEEK_CUR);
-
-	//If bloc missed
-	if(pktidx!=pktidx_pre+pktidx_step)
-	  {
-	    printf("%i\n",pktidx);
-	    printf("Bloc missed at PKTIDX=%i. Supplement with bloc of zeros.\n",pktidx_pre+pktidx_step);
-
-	    //If the last block to read, write in fractional part and save the left
-	    if(i==ct_block)
-	      {
-		//Allocate memo for part to read and part to leave   
-		block_p1=malloc(blocksize_p1*sizeof(char));
-		block_p2=malloc(blocksize_p2*sizeof(char));
-
-		//Fill the memo with zero
-		memset(block_p1,0,blocksize_p1);
-		memset(block_p2,0,blocksize_p2);
-
-		//Write out tail
-		fwrite(block_p1,1,blocksize_p1,outdada);
-		free(block_p1);
-	      }
-	    //Write entire bloc
-	    else
-	      {
-		//Fill the memo with zero
-		memset(block,0,blocksize_chan-obyte_chan);
-
-		//Write out channel data
-		fwrite(block,1,blocksize_chan-obyte_chan,outdada);
-	      }
-	    pktidx_pre+=pktidx_step;
-	  }
-	//If bloc not missed
-	else{
-	  //If the last block to read, write in fractional part and save the left
-	  if(i==ct_block)
-	    {
-	      //Allocate memo for part to read and part to leave
-	      block_p1=malloc(blocksize_p1*sizeof(char));
-	      block_p2=malloc(blocksize_p2*sizeof(char));
+  //allocate memo for block header and the subbands read, reused for every block
+  bytes_read=(size_t)blocksize_chan*(bdhi-bdlo)+blocksize_chan-obyte_chan;
+  hbuf=malloc((hdrlength+1)*sizeof(char));
+  block=malloc(bytes_read*sizeof(char));
+
+  //modify sample header saved in memory
+  ascii_header_set(dadahdr,"UTC_START","%s",ut);
+  ascii_header_set(dadahdr,"MJD_START","%s",mjd_str);
+  //modify source name to match dada format requirement
+  srcname_corr(src_name,src_name_new);
+  ascii_header_set(dadahdr,"SOURCE","%s",src_name_new);
+  ascii_header_set(dadahdr,"RA","%s",ra);
+  ascii_header_set(dadahdr,"DEC","%s",dec);
+  ascii_header_set(dadahdr,"BW","%f",bw/n_band);
+  ascii_header_set(dadahdr,"TSAMP","%f",t_samp);
+
+  //output files of B_out bytes each for every subband, file name: UT(obs start)_freq_offset.dada
+  for(b=0;b<nbd;b++)
+    {
+      //calculate central frequency of the subband
+      freq_sub=freq-bw/2+bw/n_band/2+bw*bdidx[b]/n_band;
+      ascii_header_set(dadahdr,"FREQ","%f",freq_sub);
+      sprintf(stem,"%s_%.1f",ut,freq_sub);
+      outdada[b]=dadawriter_open(dadahdr,DADAHDR_SIZE,outroute,stem,0,B_out,wflags,nbd);
+    }
 
-	      //Skip the header and find the write channel
-	      fseek(fraw,hdrlength+blocksize_chan*bdidx,SEEK_CUR);
+  //write in data, block by block; the output files split blocks where they fill
+  do
+    {
+      fd=open(datafilename,O_RDONLY);
+      if(fd<0 || fstat(fd,&fst)<0)
+	{
+	  printf("Data file %s not found.\n",datafilename);
+	  exit(0);
+	}
 
-	      //Read in channel data into two parts
-	      fread(block_p1,1,blocksize_p1,fraw);
-	      fread(block_p2,1,blocksize_p2,fraw);
+      //Blocks follow each other at fixed steps of header and data
+      nblock=fst.st_size/(hdrlength+blocksize);
+      for(k=0;k<nblock;)
+	{
+	  pos=(off_t)k*(hdrlength+blocksize);
 
-	      //Switch to the end of the block
-	      fseek(fraw,-blocksize_chan*bdidx-(blocksize_chan-obyte_chan)+blocksize,SEEK_CUR);
+	  //Read block header, only as long as it is, to get the packet index;
+	  //headers of the same layout keep the index of the first one
+	  read_at(fd,hbuf,hdrlength,pos,datafilename);
+	  hbuf[hdrlength]=0;
+	  hindex_rebind(&hx,hbuf,hdrlength);
+	  hindex_geti4(&hx,"PKTIDX",&pktidx);
 
-	      //Write out tail
-	      fwrite(block_p1,1,blocksize_p1,outdada);
-	      free(block_p1);
+	  //If bloc missed, keep the block for the next packet index
+	  if(pktidx>pktidx_pre+pktidx_step)
+	    {
+	      printf("%i\n",pktidx);
+	      printf("Bloc missed at PKTIDX=%i. Supplement with bloc of zeros.\n",pktidx_pre+pktidx_step);
+
+	      //Fill the memo with zero
+	      memset(block,0,bytes_read);
+	    }
+	  //If the block goes back in packet index, skip it
+	  else if(pktidx<pktidx_pre+pktidx_step)
+	    {
+	      printf("Bloc at PKTIDX=%i out of order. Skip it.\n",pktidx);
+	      k++;
+	      continue;
 	    }
-	  //Write in entire block
+	  //If bloc not missed, read in the channel data, from the first to the last subband wanted
 	  else
 	    {
-	      //Skip the header and find the write channel
-	      fseek(fraw,hdrlength+blocksize_chan*bdidx,SEEK_CUR);
-
-	      //Read in channel data
-	      fread(block,1,blocksize_chan-obyte_chan,fraw);
+	      read_at(fd,block,bytes_read,pos+hdrlength+(off_t)blocksize_chan*bdlo,datafilename);
+	      k++;
+	    }
 
-	      //Switch to the end of the block
-	      fseek(fraw,-blocksize_chan*bdidx-(blocksize_chan-obyte_chan)+blocksize,SEEK_CUR);
+	  //write out channel data of each subband
+	  for(b=0;b<nbd;b++)
+	    dadawriter_write(outdada[b],block+(size_t)blocksize_chan*(bdidx[b]-bdlo),blocksize_chan-obyte_chan);
 
-	      //write out channel data
-	      fwrite(block,1,blocksize_chan-obyte_chan,outdada);
-	    }
 	  //Update the previous packet index
 	  pktidx_pre+=pktidx_step;
 	}
-      }
-    printf("%s created.\n",outname);
-    fclose(outdada);
-    ct_outfile++;
-  }
+
+      close(fd);
+      printf("%s finished.\n",datafilename);
+    }
+  while(fscanf(list,"%s",datafilename)==1);
+  printf("Data file list finished.\n");
+
+  for(b=0;b<nbd;b++)
+    dadawriter_close(outdada[b]);
+  hindex_free(&hx);
+  free(hbuf);
+  free(block);
+  fclose(list);
 }
@@ -124,7 +124,10 @@ struct psrfits {
 
 // In write_psrfits.c
 int psrfits_create(struct psrfits *pf);
+int psrfits_create_shard(struct psrfits *pf, int filenum, int tot_rows);
 int psrfits_write_subint(struct psrfits *pf);
+int psrfits_write_row(struct psrfits *pf, int flush);
+int psrfits_next_file(struct psrfits *pf);
 int psrfits_write_polycos(struct psrfits *pf, struct polyco *pc, int npc);
 int psrfits_write_ephem(struct psrfits *pf, FILE *parfile);
 int psrfits_close(struct psrfits *pf);
@@ -134,6 +137,16 @@ int psrfits_obs_mode(const char *obs_mode);
 int psrfits_remove_polycos(struct psrfits *pf);
 int psrfits_remove_ephem(struct psrfits *pf);
 
+// In downsample.c
+struct ewstat;
+void pf_8bit_to_4bit(struct psrfits *pf);
+void pf_float_to_nbit(struct psrfits *pf, struct ewstat *es);
+void get_stokes_I(struct psrfits *pf);
+void downsample_freq(struct psrfits *pf);
+void downsample_time(struct psrfits *pf);
+void pf_fdata_to_rawdata(struct psrfits *pf, struct ewstat *es);
+void guppi_update_ds_params(struct psrfits *pf);
+
 // In read_psrfits.c
 int is_search_PSRFITS(char *filename);
 void psrfits_set_files(struct psrfits *pf, int numfiles, char *filenames[]);
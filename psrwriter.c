@@ -0,0 +1,206 @@
+/* psrwriter.c */
+// Writer thread for PSRFITS subints. Subints queue up in a ring of nbuf
+// buffers; the writer flushes the file only every flush_rows rows or
+// flush_sec seconds, and creates the next file of the scan as soon as
+// the current one is full, while the caller is still making the next
+// subint.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "psrwriter.h"
+
+static double psrwriter_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+static int psrwriter_full(const struct psrfits *pf)
+// The current file takes no more rows
+{
+    int mode = psrfits_obs_mode(pf->hdr.obs_mode);
+
+    return (mode == SEARCH_MODE || pf->multifile == 1) && pf->rownum > pf->rows_per_file;
+}
+
+size_t psrwriter_bytes(const struct psrfits *pf)
+{
+    // 4-bit samples are held one per byte until written
+    if (pf->hdr.nbits == 4)
+        return 2 * (size_t)pf->sub.bytes_per_subint;
+    return pf->sub.bytes_per_subint;
+}
+
+static void *psrwriter_thread(void *arg)
+{
+    struct psrwriter *w = (struct psrwriter *)arg;
+    struct psrfits *pf = &w->wpf;
+    struct psrwriter_row *r;
+    double tflush, now;
+    int nrow = 0, flush;
+
+    tflush = psrwriter_now();
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->quit && w->nwritten == w->nput) {
+            // Idle with the current file full, create the next one now,
+            // unless it belongs to whoever writes on after the caller
+            if (psrwriter_full(pf) && !pf->status && (w->lastfile <= 0 || pf->filenum < w->lastfile)) {
+                pthread_mutex_unlock(&w->lock);
+                psrfits_next_file(pf);
+                pthread_mutex_lock(&w->lock);
+                w->ahead = 1;
+                if (pf->status && !w->status)
+                    w->status = pf->status;
+                continue;
+            }
+            pthread_cond_wait(&w->cond_put, &w->lock);
+        }
+        if (w->nwritten == w->nput)
+            break;
+        r = &w->row[w->nwritten % w->nbuf];
+        pthread_mutex_unlock(&w->lock);
+
+        // 4-bit samples come one per byte and are packed in place
+        pf->sub.rawdata = r->rawdata;
+        pf->sub.data = r->rawdata;
+        pf->sub.offs = r->offs;
+        pf->sub.dat_offsets = r->dat_offsets;
+        pf->sub.dat_scales = r->dat_scales;
+
+        nrow++;
+        now = psrwriter_now();
+        flush = (w->flush_rows <= 0 && w->flush_sec <= 0.0) ||
+                (w->flush_rows > 0 && nrow >= w->flush_rows) ||
+                (w->flush_sec > 0.0 && now - tflush >= w->flush_sec);
+        psrfits_write_row(pf, flush);
+        if (flush) {
+            nrow = 0;
+            tflush = now;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        w->ahead = 0;
+        if (pf->status && !w->status)
+            w->status = pf->status;
+        w->nwritten++;
+        pthread_cond_broadcast(&w->cond_done);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+struct psrwriter *psrwriter_start(struct psrfits *pf, int nbuf, int flush_rows, double flush_sec,
+                                  int lastfile)
+{
+    struct psrwriter *w;
+    size_t bytes;
+    int i, n;
+
+    if (nbuf < 2)
+        nbuf = 2;
+    w = (struct psrwriter *)calloc(1, sizeof(struct psrwriter));
+    w->pf = pf;
+    memcpy(&w->wpf, pf, sizeof(struct psrfits));
+    w->nbuf = nbuf;
+    w->flush_rows = flush_rows;
+    w->flush_sec = flush_sec;
+    w->lastfile = lastfile;
+    w->status = pf->status;
+
+    // The buffer the caller has is the first of the ring
+    n = pf->hdr.nchan * pf->hdr.npol;
+    bytes = psrwriter_bytes(pf);
+    w->nivals = n;
+    w->row = (struct psrwriter_row *)calloc(nbuf, sizeof(struct psrwriter_row));
+    for (i = 0 ; i < nbuf ; i++) {
+        w->row[i].rawdata = (i == 0) ? pf->sub.rawdata :
+            (unsigned char *)malloc(bytes);
+        w->row[i].dat_offsets = (float *)malloc(sizeof(float) * n);
+        w->row[i].dat_scales = (float *)malloc(sizeof(float) * n);
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond_put, NULL);
+    pthread_cond_init(&w->cond_done, NULL);
+    if (pthread_create(&w->tid, NULL, psrwriter_thread, w) != 0) {
+        fprintf(stderr, "Error: Cannot start PSRFITS writer thread.\n");
+        exit(1);
+    }
+
+    return w;
+}
+
+void psrwriter_put(struct psrwriter *w)
+// Hand over the subint in pf->sub, waiting only if all buffers are queued
+{
+    struct psrfits *pf = w->pf;
+    struct psrwriter_row *r;
+
+    pthread_mutex_lock(&w->lock);
+    r = &w->row[w->nput % w->nbuf];
+    r->offs = pf->sub.offs;
+    memcpy(r->dat_offsets, pf->sub.dat_offsets, sizeof(float) * w->nivals);
+    memcpy(r->dat_scales, pf->sub.dat_scales, sizeof(float) * w->nivals);
+    w->nput++;
+    pthread_cond_signal(&w->cond_put);
+
+    // Next buffer to fill
+    while (w->nput - w->nwritten >= w->nbuf)
+        pthread_cond_wait(&w->cond_done, &w->lock);
+    pf->sub.rawdata = w->row[w->nput % w->nbuf].rawdata;
+    pf->status = w->status;
+    pthread_mutex_unlock(&w->lock);
+
+    // Counters as psrfits_write_subint() leaves them
+    if (psrwriter_full(pf)) {
+        pf->filenum++;
+        pf->rownum = 1;
+        pf->hdr.offset_subint = pf->tot_rows;
+        sprintf(pf->filename, "%s_%04d.fits", pf->basefilename, pf->filenum);
+    }
+    pf->rownum++;
+    pf->tot_rows++;
+    pf->N += pf->hdr.nsblk / pf->hdr.ds_time_fact;
+    pf->T += pf->sub.tsubint;
+}
+
+int psrwriter_finish(struct psrwriter *w)
+{
+    struct psrfits *pf = w->pf;
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_signal(&w->cond_put);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->tid, NULL);
+
+    // A file created ahead of time and not needed in the end is removed
+    if (w->ahead) {
+        printf("Removing unused file '%s'\n", w->wpf.filename);
+        fits_delete_file(w->wpf.fptr, &(w->wpf.status));
+    } else {
+        fits_close_file(w->wpf.fptr, &(w->wpf.status));
+    }
+
+    pf->fptr = w->wpf.fptr;
+    pf->status = w->wpf.status;
+    for (i = 0 ; i < w->nbuf ; i++) {
+        if (w->row[i].rawdata != pf->sub.rawdata)
+            free(w->row[i].rawdata);
+        free(w->row[i].dat_offsets);
+        free(w->row[i].dat_scales);
+    }
+    free(w->row);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond_put);
+    pthread_cond_destroy(&w->cond_done);
+    free(w);
+
+    return pf->status;
+}
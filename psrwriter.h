@@ -0,0 +1,56 @@
+/* psrwriter.h */
+#ifndef _PSRWRITER_H
+#define _PSRWRITER_H
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "psrfits.h"
+
+// A subint handed over to the writer thread
+struct psrwriter_row {
+    unsigned char *rawdata;
+    double offs;
+    float *dat_offsets;         // hdr.nchan x hdr.npol
+    float *dat_scales;
+};
+
+// PSRFITS subints written from a thread of their own, so that the thread
+// making them never waits for the disk or CFITSIO. The caller fills
+// pf->sub as before and hands the subint over with psrwriter_put(), which
+// gives pf->sub.rawdata a free buffer. The counters of pf (rownum,
+// tot_rows, filenum, N, T) go on as if the subint had been written, and
+// pf->status reports errors of the writer.
+struct psrwriter {
+    struct psrfits *pf;         // Caller's state
+    struct psrfits wpf;         // Writer's own copy of the state
+    int nbuf;                   // Subint buffers, one filled by the caller, the others queued
+    struct psrwriter_row *row;
+    int nivals;                 // Size of dat_offsets and dat_scales
+    int64_t nput;               // Subints handed over
+    int64_t nwritten;           // Subints written
+    int flush_rows;             // Flush the file after so many rows, 0 for no limit
+    double flush_sec;           // Flush the file after so many seconds, 0 for no limit
+    int ahead;                  // Next file created ahead of time, no row in it yet
+    int lastfile;               // No file past this number created ahead, 0 for no limit
+    int status;                 // CFITSIO status of the writer
+    int quit;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_put;
+    pthread_cond_t cond_done;
+};
+
+// In psrwriter.c
+// Size of each rawdata buffer, the caller's first one included
+size_t psrwriter_bytes(const struct psrfits *pf);
+// The first file of pf must be created and pf->sub allocated. With neither
+// flush_rows nor flush_sec set, the file is flushed after every row.
+// lastfile is the number of the last file the caller writes, e.g. the
+// last of its part of a scan, or 0 if it writes on to the end.
+struct psrwriter *psrwriter_start(struct psrfits *pf, int nbuf, int flush_rows, double flush_sec,
+                                  int lastfile);
+void psrwriter_put(struct psrwriter *w);
+// Write all subints handed over and close the file. Returns the CFITSIO status.
+int psrwriter_finish(struct psrwriter *w);
+
+#endif
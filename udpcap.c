@@ -0,0 +1,103 @@
+/* udpcap.c */
+// Live capture of a packet stream from a UDP socket, on a udpring keyed
+// by the packet counter. Reads may end within a packet, so the bytes of
+// the packet at base already handed out are kept in off.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "udpcap.h"
+
+static int udpcap_key(struct udpring *r, int sock, const unsigned char *pkt, size_t len,
+                      int *stream, int64_t *key)
+{
+    uint64_t cnt;
+
+    if (len != r->hdrbytes + r->payload)
+        return -1;
+    memcpy(&cnt, pkt, sizeof(cnt));
+    *stream = 0;
+    *key = (int64_t)be64toh(cnt);
+
+    return 0;
+}
+
+struct udpcap *udpcap_open(const char *addr, int hdrbytes, size_t payload, int rcvbuf, double idle)
+{
+    struct udpcap *c;
+    int fd;
+
+    if (hdrbytes < 8 || payload == 0) {
+        fprintf(stderr, "Error: Wrong packet layout, %d header and %zu payload bytes.\n", hdrbytes, payload);
+        exit(1);
+    }
+    c = (struct udpcap *)calloc(1, sizeof(struct udpcap));
+    c->ring = udpring_create(1, UDPCAP_NSLOT, UDPCAP_DEPTH, udpcap_key, c);
+    snprintf(c->ring->name[0], sizeof(c->ring->name[0]), "%s", addr);
+    udpring_setup(c->ring, hdrbytes, payload);
+    fd = udpring_bind(addr, rcvbuf);
+    udpring_start(c->ring, &fd, 1, hdrbytes + payload, idle);
+
+    return c;
+}
+
+int64_t udpcap_first(struct udpcap *c)
+{
+    if (udpring_first(c->ring) < 0)
+        return -1;
+
+    return c->ring->base;
+}
+
+void udpcap_seek(struct udpcap *c, uint64_t cnt)
+{
+    udpring_seek(c->ring, (int64_t)cnt);
+    c->off = 0;
+}
+
+size_t udpcap_read(struct udpcap *c, char *dst, size_t bytes)
+{
+    struct udpring *r = c->ring;
+    const unsigned char *src;
+    size_t got = 0, n;
+    int st;
+
+    pthread_mutex_lock(&r->lock);
+    while (got < bytes) {
+        n = r->payload - c->off;
+        if (n > bytes - got)
+            n = bytes - got;
+
+        st = r->started ? udpring_state(r, 0, 0) : 0;
+        if (st > 0) {
+            src = udpring_slot(r, 0);
+            pthread_mutex_unlock(&r->lock);
+            memcpy(dst + got, src + c->off, n);
+            pthread_mutex_lock(&r->lock);
+        } else if (st < 0) {
+            memset(dst + got, 0, n);
+        } else if (r->eof) {
+            break;
+        } else {
+            udpring_wait(r, 0.0);
+            continue;
+        }
+
+        got += n;
+        c->off += n;
+        r->busy = 1;
+        if (c->off == r->payload) {
+            udpring_next(r);
+            c->off = 0;
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return got;
+}
+
+void udpcap_close(struct udpcap *c)
+{
+    udpring_close(c->ring);
+    free(c);
+}
@@ -0,0 +1,37 @@
+/* udpcap.h */
+#ifndef _UDPCAP_H
+#define _UDPCAP_H
+#include <stdint.h>
+#include <stddef.h>
+#include "udpring.h"
+
+// Packets in the reorder ring of a stream, a power of 2
+#define UDPCAP_NSLOT 16384
+// A missing packet is given up as lost once one so many packets later has come
+#define UDPCAP_DEPTH 64
+// Default socket receive buffer
+#define UDPCAP_RCVBUF 268435456
+
+// A stream of packets received on a UDP port, each a 64-bit big-endian
+// packet counter in its first hdrbytes, then payload bytes of samples,
+// kept in a udpring keyed by the counter. The samples are handed out as
+// bytes in counter order, lost packets as zeros.
+struct udpcap {
+    struct udpring *ring;
+    size_t off;                     // Bytes of the packet at base handed out already
+};
+
+// In udpcap.c
+// addr is [address:]port, rcvbuf the socket receive buffer in bytes.
+// Exits if the socket cannot be bound.
+struct udpcap *udpcap_open(const char *addr, int hdrbytes, size_t payload, int rcvbuf, double idle);
+// Counter of the first packet, waiting for it; -1 if the stream ended before
+int64_t udpcap_first(struct udpcap *c);
+// Start handing out samples at packet counter cnt, dropping earlier ones
+void udpcap_seek(struct udpcap *c, uint64_t cnt);
+// Next bytes of samples, fewer only once the stream has ended
+size_t udpcap_read(struct udpcap *c, char *dst, size_t bytes);
+// Print the packet counts, stop the thread and close the socket
+void udpcap_close(struct udpcap *c);
+
+#endif
@@ -0,0 +1,380 @@
+/* udpring.c */
+// Keyed reorder rings of UDP packets and their receiving thread, shared
+// by the live captures of udpcap.c and vdifcap.c, see udpring.h
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "udpring.h"
+
+static volatile sig_atomic_t udpring_sigint_seen = 0;
+
+static void udpring_sigint(int sig)
+{
+    udpring_sigint_seen = 1;
+}
+
+int udpring_interrupted(void)
+{
+    return udpring_sigint_seen;
+}
+
+void udpring_catch_sigint(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = udpring_sigint;
+    sigaction(SIGINT, &sa, NULL);
+}
+
+double udpring_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+static int64_t udpring_maxkey(const struct udpring *r)
+// Later packets of any stream count, so a stream that stops does not hold up the others
+{
+    int64_t mx = r->maxkey[0];
+    int s;
+
+    for (s = 1 ; s < r->nstream ; s++)
+        if (r->maxkey[s] > mx)
+            mx = r->maxkey[s];
+
+    return mx;
+}
+
+static void udpring_put(struct udpring *r, int sock, const unsigned char *pkt, size_t len)
+// Put a packet in its slot, with the lock held
+{
+    int64_t key, slot;
+    int s, ii, st;
+
+    st = r->keyfn(r, sock, pkt, len, &s, &key);
+    if (st < 0)
+        r->nbad++;
+    if (st != 0)
+        return;
+    if (!r->started) {
+        r->started = 1;
+        r->base = key;
+        for (ii = 0 ; ii < r->nstream ; ii++)
+            r->maxkey[ii] = key - 1;
+    }
+
+    slot = key & (r->nslot - 1);
+    if (r->stamp[s][slot] == key)
+        return;
+    // A sender started again counts from anew, which no longer lines up
+    // with the packets handed out
+    if (key + r->nslot < r->base) {
+        fprintf(stderr, "Warning: Packet key of %s went back from %lld to %lld, capture ended.\n",
+                r->name[s], (long long)r->base, (long long)key);
+        r->eof = 1;
+        return;
+    }
+    // Given up already, or being handed out as missing
+    if (key < r->base || (key == r->base && r->busy)) {
+        r->nlate[s]++;
+        return;
+    }
+    // Even a packet past the end of the ring, after an outage, moves the
+    // capture on: the ones before it are then given up, not waited for
+    if (key > r->maxkey[s])
+        r->maxkey[s] = key;
+    // Slot still holding a packet not handed out, the ring full
+    if (r->stamp[s][slot] != UDPRING_EMPTY) {
+        r->ndrop[s]++;
+        return;
+    }
+    memcpy(r->ring[s] + slot * r->payload, pkt + r->hdrbytes, r->payload);
+    r->stamp[s][slot] = key;
+    r->nrecv[s]++;
+}
+
+static void *udpring_thread(void *arg)
+{
+    struct udpring *r = (struct udpring *)arg;
+    struct mmsghdr msgs[UDPRING_VLEN];
+    struct iovec iov[UDPRING_VLEN];
+    struct pollfd pfd[UDPRING_MAXFD];
+    double last = 0.0, now;
+    unsigned char *batch;
+    int ii, j, n;
+
+    // One byte more than the longest packet, to tell packets too long
+    batch = (unsigned char *)malloc(UDPRING_VLEN * (r->maxlen + 1));
+    memset(msgs, 0, sizeof(msgs));
+    for (ii = 0 ; ii < UDPRING_VLEN ; ii++) {
+        iov[ii].iov_base = batch + ii * (r->maxlen + 1);
+        iov[ii].iov_len = r->maxlen + 1;
+        msgs[ii].msg_hdr.msg_iov = &iov[ii];
+        msgs[ii].msg_hdr.msg_iovlen = 1;
+    }
+    for (j = 0 ; j < r->nfd ; j++) {
+        pfd[j].fd = r->fd[j];
+        pfd[j].events = POLLIN;
+    }
+
+    for (;;) {
+        n = poll(pfd, r->nfd, 100);
+        now = udpring_now();
+
+        pthread_mutex_lock(&r->lock);
+        if (r->quit || r->eof || udpring_sigint_seen || (r->started && now - last > r->idle)) {
+            r->eof = 1;
+            pthread_cond_broadcast(&r->cond_recv);
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        pthread_mutex_unlock(&r->lock);
+        if (n <= 0)
+            continue;
+
+        for (j = 0 ; j < r->nfd ; j++) {
+            if (!(pfd[j].revents & POLLIN))
+                continue;
+            n = recvmmsg(r->fd[j], msgs, UDPRING_VLEN, MSG_DONTWAIT, NULL);
+            if (n <= 0) {
+                if (n < 0 && errno != EAGAIN && errno != EINTR)
+                    perror("udpring");
+                continue;
+            }
+            last = now;
+
+            pthread_mutex_lock(&r->lock);
+            for (ii = 0 ; ii < n && !r->eof ; ii++)
+                udpring_put(r, j, (unsigned char *)iov[ii].iov_base, msgs[ii].msg_len);
+            pthread_cond_broadcast(&r->cond_recv);
+            pthread_mutex_unlock(&r->lock);
+        }
+    }
+    free(batch);
+
+    return NULL;
+}
+
+int udpring_bind(const char *addr, int rcvbuf)
+{
+    struct sockaddr_in sa;
+    char host[64];
+    const char *colon;
+    int fd, one = 1, got;
+    socklen_t len = sizeof(got);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    colon = strrchr(addr, ':');
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+        if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+            fprintf(stderr, "Error: Wrong address %s.\n", addr);
+            exit(1);
+        }
+        addr = colon + 1;
+    }
+    sa.sin_port = htons(atoi(addr));
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("udpring");
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // Past net.core.rmem_max if allowed to
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    // The kernel reports twice the size set
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &got, &len) == 0 && got / 2 < rcvbuf)
+        fprintf(stderr, "Warning: Receive buffer of %d bytes only, raise net.core.rmem_max.\n", got / 2);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        perror("udpring");
+        exit(1);
+    }
+
+    return fd;
+}
+
+struct udpring *udpring_create(int nstream, int nslot, int depth, udpring_key_fn keyfn, void *arg)
+{
+    struct udpring *r;
+    pthread_condattr_t ca;
+
+    r = (struct udpring *)calloc(1, sizeof(struct udpring));
+    r->nstream = nstream;
+    r->nslot = nslot;
+    r->depth = depth;
+    r->keyfn = keyfn;
+    r->arg = arg;
+
+    // Waits for missing packets are timed on the monotonic clock
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&r->cond_recv, &ca);
+    pthread_condattr_destroy(&ca);
+
+    return r;
+}
+
+void udpring_setup(struct udpring *r, size_t hdrbytes, size_t payload)
+{
+    size_t bytes = (size_t)r->nslot * payload;
+    int ii, s;
+
+    r->hdrbytes = hdrbytes;
+    r->payload = payload;
+    for (s = 0 ; s < r->nstream ; s++) {
+        r->ring[s] = (unsigned char *)malloc(bytes);
+        r->stamp[s] = (int64_t *)malloc(r->nslot * sizeof(int64_t));
+        if (r->ring[s] == NULL || r->stamp[s] == NULL) {
+            fprintf(stderr, "Error: Cannot allocate ring for %s.\n", r->name[s]);
+            exit(1);
+        }
+        memset(r->ring[s], 0, bytes);
+        mlock(r->ring[s], bytes);
+        for (ii = 0 ; ii < r->nslot ; ii++)
+            r->stamp[s][ii] = UDPRING_EMPTY;
+    }
+}
+
+void udpring_start(struct udpring *r, const int *fd, int nfd, size_t maxlen, double idle)
+{
+    int j;
+
+    r->nfd = nfd;
+    for (j = 0 ; j < nfd ; j++)
+        r->fd[j] = fd[j];
+    r->maxlen = maxlen;
+    r->idle = idle;
+    if (pthread_create(&r->tid, NULL, udpring_thread, r) != 0) {
+        fprintf(stderr, "Error: Cannot start receiving thread for %s.\n", r->name[0]);
+        exit(1);
+    }
+}
+
+int udpring_first(struct udpring *r)
+{
+    int ret;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->started && !r->eof)
+        pthread_cond_wait(&r->cond_recv, &r->lock);
+    ret = r->started ? 0 : -1;
+    pthread_mutex_unlock(&r->lock);
+
+    return ret;
+}
+
+void udpring_seek(struct udpring *r, int64_t key)
+{
+    int ii, s;
+
+    pthread_mutex_lock(&r->lock);
+    // Packets from key on stay, wherever they are in the ring
+    for (s = 0 ; s < r->nstream ; s++) {
+        for (ii = 0 ; ii < r->nslot ; ii++)
+            if (r->stamp[s][ii] < key)
+                r->stamp[s][ii] = UDPRING_EMPTY;
+        if (!r->started || r->maxkey[s] < key - 1)
+            r->maxkey[s] = key - 1;
+    }
+    r->base = key;
+    r->busy = 0;
+    r->started = 1;
+    pthread_mutex_unlock(&r->lock);
+}
+
+int udpring_state(const struct udpring *r, int s, int waited)
+{
+    int64_t mx = udpring_maxkey(r);
+
+    if (r->stamp[s][r->base & (r->nslot - 1)] == r->base)
+        return 1;
+    if (mx >= r->base + r->depth || ((r->eof || waited) && mx >= r->base))
+        return -1;
+
+    return 0;
+}
+
+const unsigned char *udpring_slot(const struct udpring *r, int s)
+{
+    return r->ring[s] + (r->base & (r->nslot - 1)) * r->payload;
+}
+
+void udpring_next(struct udpring *r)
+{
+    int64_t slot = r->base & (r->nslot - 1);
+    int s;
+
+    for (s = 0 ; s < r->nstream ; s++) {
+        // A slot given up may hold a later packet already
+        if (r->stamp[s][slot] == r->base)
+            r->stamp[s][slot] = UDPRING_EMPTY;
+        else
+            r->nlost[s]++;
+    }
+    r->base++;
+    r->busy = 0;
+}
+
+int udpring_end(const struct udpring *r)
+{
+    return r->eof && udpring_maxkey(r) < r->base;
+}
+
+int udpring_wait(struct udpring *r, double until)
+{
+    struct timespec dl;
+
+    if (until == 0.0) {
+        pthread_cond_wait(&r->cond_recv, &r->lock);
+        return 0;
+    }
+    dl.tv_sec = (time_t)until;
+    dl.tv_nsec = (long)((until - dl.tv_sec) * 1.0e9);
+
+    return pthread_cond_timedwait(&r->cond_recv, &r->lock, &dl) == ETIMEDOUT;
+}
+
+void udpring_close(struct udpring *r)
+{
+    int j, s;
+
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->tid, NULL);
+
+    for (s = 0 ; s < r->nstream ; s++)
+        printf("%s: %ld packets received, %ld lost, %ld late, %ld dropped with the ring full.\n",
+               r->name[s], r->nrecv[s], r->nlost[s], r->nlate[s], r->ndrop[s]);
+    if (r->nbad > 0)
+        printf("%ld packets of the wrong size or of no stream.\n", r->nbad);
+
+    for (j = 0 ; j < r->nfd ; j++)
+        close(r->fd[j]);
+    for (s = 0 ; s < r->nstream && r->payload > 0 ; s++) {
+        munlock(r->ring[s], (size_t)r->nslot * r->payload);
+        free(r->ring[s]);
+        free(r->stamp[s]);
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond_recv);
+    free(r);
+}
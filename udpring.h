@@ -0,0 +1,102 @@
+/* udpring.h */
+#ifndef _UDPRING_H
+#define _UDPRING_H
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Sockets and streams of a ring at most
+#define UDPRING_MAXFD 2
+#define UDPRING_MAXSTREAM 2
+// Packets taken from a socket at a time
+#define UDPRING_VLEN 64
+// Slot not holding any packet
+#define UDPRING_EMPTY INT64_MIN
+
+struct udpring;
+
+// Place of a packet received on socket sock: the stream it belongs to and
+// its key, consecutive packets of a stream having consecutive keys.
+// Returns 0 to keep it, 1 to leave it out (counted by the callback itself),
+// -1 for a packet of the wrong size or of no stream. Called with the lock
+// held, by the receiving thread.
+typedef int (*udpring_key_fn)(struct udpring *r, int sock, const unsigned char *pkt, size_t len,
+                              int *stream, int64_t *key);
+
+// Packets of one or two streams received on UDP sockets. A thread of its
+// own takes the packets from the sockets in batches and puts the payload
+// of each in the ring of its stream at the slot of its key, so the caller
+// hands them out in key order whatever order they came in. A packet still
+// missing once one depth later of any stream has come is given up; one
+// going back further than the ring ends the capture.
+struct udpring {
+    int nfd;
+    int fd[UDPRING_MAXFD];
+    size_t maxlen;                  // Longest packet taken
+    int nstream;
+    char name[UDPRING_MAXSTREAM][64];   // Of each stream, in messages
+    int nslot;                      // Slots per stream, a power of 2
+    int depth;
+    udpring_key_fn keyfn;
+    void *arg;                      // Of keyfn
+    // Set by udpring_setup()
+    size_t hdrbytes;                // Bytes of a packet before its payload
+    size_t payload;                 // Bytes of payload kept of a packet
+    unsigned char *ring[UDPRING_MAXSTREAM];
+    int64_t *stamp[UDPRING_MAXSTREAM];  // Key of the packet in each slot
+    int64_t base;                   // Key of the next packets to hand out
+    int busy;                       // Slot of base partly handed out
+    int64_t maxkey[UDPRING_MAXSTREAM];  // Largest key received per stream
+    int started;                    // Any packet kept
+    double idle;                    // Seconds without packets that end the capture
+    int eof;                        // Capture ended, by idle time, interrupt or reset
+    // Counts of packets per stream
+    long nrecv[UDPRING_MAXSTREAM];  // Received and kept
+    long nlost[UDPRING_MAXSTREAM];  // Never received in time, handed out as missing
+    long nlate[UDPRING_MAXSTREAM];  // Received after being given up
+    long ndrop[UDPRING_MAXSTREAM];  // Dropped with their slot still taken
+    long nbad;                      // Of the wrong size or of no stream
+    int quit;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_recv;       // On the monotonic clock
+};
+
+// In udpring.c
+struct udpring *udpring_create(int nstream, int nslot, int depth, udpring_key_fn keyfn, void *arg);
+// Allocate the rings, touched and locked now rather than on the first
+// packets. Before udpring_start(), or from keyfn on the first packet kept.
+void udpring_setup(struct udpring *r, size_t hdrbytes, size_t payload);
+// Start receiving packets of at most maxlen bytes on nfd bound sockets
+void udpring_start(struct udpring *r, const int *fd, int nfd, size_t maxlen, double idle);
+// Wait for the first packet kept: 0 once in, -1 if the capture ended before
+int udpring_first(struct udpring *r);
+// Hand out packets from key on, dropping earlier ones
+void udpring_seek(struct udpring *r, int64_t key);
+
+// With the lock held, once started
+// State of the packet at base of stream s: 1 in its slot, -1 given up, 0
+// still to wait for. With waited, any later packet gives it up.
+int udpring_state(const struct udpring *r, int s, int waited);
+// Payload of the packet at base of stream s, left in place by the thread
+// while the lock is released
+const unsigned char *udpring_slot(const struct udpring *r, int s);
+// Move on to the next key, counting the streams without their packet as lost
+void udpring_next(struct udpring *r);
+// Nothing left to hand out and nothing more to come
+int udpring_end(const struct udpring *r);
+// Wait for more packets, until the monotonic time until if not 0. Returns 1 past it.
+int udpring_wait(struct udpring *r, double until);
+
+// Seconds on the monotonic clock
+double udpring_now(void);
+// Print the packet counts, stop the thread and close the sockets
+void udpring_close(struct udpring *r);
+// End all captures on SIGINT instead of killing the program
+void udpring_catch_sigint(void);
+// SIGINT caught since udpring_catch_sigint()
+int udpring_interrupted(void);
+// UDP socket bound to [address:]port with a receive buffer of rcvbuf bytes, exits on failure
+int udpring_bind(const char *addr, int rcvbuf);
+
+#endif
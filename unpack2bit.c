@@ -0,0 +1,105 @@
+/* unpack2bit.c */
+// Unpack 2-bit VDIF samples straight into float FFT input, centred on
+// the mean of unsigned 2-bit samples. Samples are packed 4 per byte,
+// first sample in the 2 LSBs, as in convert2to8().
+#include <stdint.h>
+#include "vdifdet.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UNPACK2BIT_X86
+#include <immintrin.h>
+#endif
+
+// Mean of unsigned 2-bit samples
+#define UNPACK2BIT_MEAN 1.5f
+
+void unpack2bit_scalar(float *dest, const unsigned char *src, int bytes)
+// bytes is the number of bytes in src, dest gets 4*bytes floats
+{
+    int ii;
+    unsigned char uctmp;
+
+    for (ii = 0 ; ii < bytes ; ii++) {
+        uctmp = src[ii];
+        *dest++ = (float)(uctmp & 0x3) - UNPACK2BIT_MEAN;
+        *dest++ = (float)((uctmp >> 2) & 0x3) - UNPACK2BIT_MEAN;
+        *dest++ = (float)((uctmp >> 4) & 0x3) - UNPACK2BIT_MEAN;
+        *dest++ = (float)(uctmp >> 6) - UNPACK2BIT_MEAN;
+    }
+}
+
+#ifdef UNPACK2BIT_X86
+__attribute__((target("avx2")))
+static void unpack2bit_avx2(float *dest, const unsigned char *src, int bytes)
+// 8 input bytes, i.e. 32 samples, per iteration
+{
+    const __m256i shift = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    const __m256i mask = _mm256_set1_epi32(0x3);
+    const __m256 mean = _mm256_set1_ps(UNPACK2BIT_MEAN);
+    // Repeat each of 2 bytes 4 times, for the 4 pairs of bytes in 8
+    const __m128i rep[4] = {
+        _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1, -1, -1, -1, -1, -1, -1, -1, -1),
+        _mm_setr_epi8(2, 2, 2, 2, 3, 3, 3, 3, -1, -1, -1, -1, -1, -1, -1, -1),
+        _mm_setr_epi8(4, 4, 4, 4, 5, 5, 5, 5, -1, -1, -1, -1, -1, -1, -1, -1),
+        _mm_setr_epi8(6, 6, 6, 6, 7, 7, 7, 7, -1, -1, -1, -1, -1, -1, -1, -1)
+    };
+    __m128i raw;
+    __m256i v;
+    int ii, jj;
+
+    for (ii = 0 ; ii + 8 <= bytes ; ii += 8) {
+        raw = _mm_loadl_epi64((const __m128i *)(src + ii));
+        for (jj = 0 ; jj < 4 ; jj++) {
+            v = _mm256_cvtepu8_epi32(_mm_shuffle_epi8(raw, rep[jj]));
+            v = _mm256_and_si256(_mm256_srlv_epi32(v, shift), mask);
+            _mm256_storeu_ps(dest, _mm256_sub_ps(_mm256_cvtepi32_ps(v), mean));
+            dest += 8;
+        }
+    }
+    unpack2bit_scalar(dest, src + ii, bytes - ii);
+}
+
+__attribute__((target("avx512f")))
+static void unpack2bit_avx512(float *dest, const unsigned char *src, int bytes)
+// 16 input bytes, i.e. 64 samples, per iteration
+{
+    const __m512i shift = _mm512_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6,
+                                            0, 2, 4, 6, 0, 2, 4, 6);
+    const __m512i mask = _mm512_set1_epi32(0x3);
+    const __m512 mean = _mm512_set1_ps(UNPACK2BIT_MEAN);
+    // Repeat each of 4 bytes 4 times, for the 4 quads of bytes in 16
+    const __m128i rep[4] = {
+        _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3),
+        _mm_setr_epi8(4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7),
+        _mm_setr_epi8(8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11),
+        _mm_setr_epi8(12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15)
+    };
+    __m128i raw;
+    __m512i v;
+    int ii, jj;
+
+    for (ii = 0 ; ii + 16 <= bytes ; ii += 16) {
+        raw = _mm_loadu_si128((const __m128i *)(src + ii));
+        for (jj = 0 ; jj < 4 ; jj++) {
+            v = _mm512_cvtepu8_epi32(_mm_shuffle_epi8(raw, rep[jj]));
+            v = _mm512_and_si512(_mm512_srlv_epi32(v, shift), mask);
+            _mm512_storeu_ps(dest, _mm512_sub_ps(_mm512_cvtepi32_ps(v), mean));
+            dest += 16;
+        }
+    }
+    unpack2bit_scalar(dest, src + ii, bytes - ii);
+}
+#endif
+
+unpack2bit_fn unpack2bit_select(void)
+// Pick the fastest unpacker the running CPU supports
+{
+#ifdef UNPACK2BIT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return unpack2bit_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return unpack2bit_avx2;
+#endif
+    return unpack2bit_scalar;
+}
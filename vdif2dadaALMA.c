@@ -18,8 +18,11 @@
 #include "hget.c"
 #include "mjd2date.c"
 #include "ascii_header.c"
-#include "cvrt2to8.c"
 #include "ran.c"
+#include "vdifidx.h"
+#include "vdifstat.h"
+#include "vdifchan.h"
+#include "dadawriter.h"
 
 //Calculate MJD from number of 6-mon counts and seconds
 long double get_mjd(int mon, long sec)
@@ -48,6 +51,26 @@ long double get_mjd(int mon, long sec)
   return((long double)imjd+fmjd);
 }
 
+//Get info of the next valid frame from the frame index, 0 if no more
+int nextIndexFrame(struct vdifidx *ix, int64_t *cur, long *off, int *mon, long *sec, long *num)
+{
+  const struct vdifidx_entry *e;
+
+  while(*cur < (int64_t)ix->hdr->nentry && !(ix->entry[*cur].flags & VDIFIDX_VALID))
+	(*cur)++;
+  if(*cur >= (int64_t)ix->hdr->nentry)
+	return 0;
+
+  e=&ix->entry[*cur];
+  *off=e->offset;
+  *mon=e->epoch;
+  *sec=e->second;
+  *num=e->frame;
+  (*cur)++;
+
+  return 1;
+}
+
 int usage(char *prg_name)
 {
   fprintf(stdout,
@@ -56,23 +79,23 @@ int usage(char *prg_name)
           "Each file is 2-bit, real sampled, 32 freq chans;\n"
 		  "A complete sample is 32 bit, so two CS for a time samp;\n"
 		  "Data rate 2 Gbyte/s (include 2 pols);\n"
-		  "Code to extract a single channel;\n"
+		  "Code to extract one or more channels, each to its own dada files;\n"
 		             "%s [options]\n"
 		             " -f   Central frequency of the data (MHz)\n"
 		             " -l   Frame size in Byte (without header, by default 8000)\n"
 		             " -r   Frame header in Byte (by default 32)\n"
             		 " -i   Input vdif file for p1\n"
 		             " -j   Input vdif file for p2\n"
-		             " -n   Index of frequency channel to extract\n"
-		             " -p   Header table for p1\n"
-		             " -q   Header table for p2\n"
+		             " -n   Indices of frequency channels to extract (e.g. 3, 0-31 or 1,5,8-11)\n"
+		             " -p   Frame index for p1 (by default <p1 file>.vidx, built if missing)\n"
+		             " -q   Frame index for p2 (by default <p2 file>.vidx, built if missing)\n"
 		             " -D   Dada file header size (by default 4096)\n"
 		             " -B   Bytes for one dada file (by default 2500000000,10s)\n"
 		             " -S   Sample data header file\n"
 		             " -u   L/U side band (0 for lower, 1 for upper)\n"
-		             " -s   Number of seconds to get sample statistics (default 10)\n"
-		             " -k   Number of seconds to skip from the beginning when getting statistics (default 10)\n"
+		             " -s   Number of seconds of data the running sample statistics average over (default 1)\n"
 		             " -O   Route for output \n"
+		             " -d   Write output with O_DIRECT\n"
 		  " -h   Available options\n",
 		  prg_name);
   exit(0);
@@ -80,7 +103,8 @@ int usage(char *prg_name)
 
 main(int argc, char *argv[])
 {
-  FILE *invdif[2],*dada,*hdr,*phdr[2];
+  FILE *invdif[2],*hdr;
+  struct vdifidx *pidx[2];
 
   //Default dada header file set up
   int DADAHDR_SIZE=4096;
@@ -94,13 +118,20 @@ main(int argc, char *argv[])
   //Default bytes of a frame header
   int fhdr=32;
   
-  char ifile[200], jfile[200],oroute[200], hdrfile[200],phdrfile[200],qhdrfile[200],dadahdr[DADAHDR_SIZE],ut[30],mjd_str[25],filename[200],dat;
-  unsigned char *inbuffer[2], *outbuffer[2];
-  int arg,j_i,j_j,j_q,j_O,j_S,j_p,n_f,n_cs,mon[2],ctoffset,i,j,k,ifreq,nfchan,B_cs,mon_nxt,n_f_s,bs,nf_stat,dati,n_skip;
-  float cw,freq,cfreq,ns_stat,s_skip;
-  double mean[2],sq,rms[2];
+  char ifile[200], jfile[200],oroute[200], hdrfile[200],phdrfile[200],qhdrfile[200],dadahdr[DADAHDR_SIZE],ut[30],mjd_str[25];
+  char chlist[200],stem[200],*chdr,*obuffer;
+  unsigned char *inbuffer[2];
+  int arg,j_i,j_j,j_q,j_O,j_S,j_p,n_f,n_cs,mon[2],i,j,k,c,nfchan,B_cs,mon_nxt,n_f_s,bs,nf_stat,dati,mon_ahead,B_f,nch,wflags;
+  int ifreq[VDIFCHAN_MAXCHAN],pos[VDIFCHAN_MAXCHAN];
+  float cw,freq,cfreq[VDIFCHAN_MAXCHAN],ofreq,ns_stat;
+  struct dadawriter *out[VDIFCHAN_MAXCHAN];
+  double m1,m2;
+  struct ewstat *es[2];
   long double mjd;
   long int idx[2],sec[2],num[2],offset0,sec_nxt,num_nxt,seed[2];
+  int64_t cur[2],cur_ahead;
+  long int idx_ahead,sec_ahead,num_ahead;
+  int pend[2],miss[2];
   time_t t;
   
   j_i=0;
@@ -110,10 +141,10 @@ main(int argc, char *argv[])
   j_p=0;
   j_q=0;
   freq=0.0;
-  ctoffset=0;
-  ifreq=-1;
+  wflags=0;
+  nch=0;
+  strcpy(chlist,"");
   ns_stat=1.0;
-  s_skip=10.0;
 
   //Hard coded ALMA vdif output
   //Number of channel
@@ -126,7 +157,7 @@ main(int argc, char *argv[])
   cw=-62.5;
   
   //Read arguments
-  while ((arg=getopt(argc,argv,"hf:l:r:i:j:n:p:q:D:B:S:u:O:")) != -1)
+  while ((arg=getopt(argc,argv,"hf:l:r:i:j:n:p:q:D:B:S:u:s:O:d")) != -1)
 	{
 	  switch(arg)
 		{
@@ -153,7 +184,7 @@ main(int argc, char *argv[])
 		  break;
 		  
 		case 'n':
-		  ifreq=atoi(optarg);
+		  strcpy(chlist,optarg);
 		  break;
 
 		case 'p':
@@ -192,9 +223,10 @@ main(int argc, char *argv[])
 		  ns_stat=atof(optarg);
 		  break;
 
-		case 'k':
-		  s_skip=atof(optarg);
+		case 'd':
+		  wflags|=DADAWRITER_ODIRECT;
 		  break;
+
 		  
 		case 'h':
 		  usage(argv[0]);
@@ -237,23 +269,13 @@ main(int argc, char *argv[])
 	  exit(0);
 	}
 
-  if(ifreq<0)
+  nch=vdifchan_parse_list(chlist,ifreq,nfchan);
+  if(nch<1)
 	{
 	  printf("No/not valid index of frequency channel.\n");
 	  exit(0);
 	}
 
-  if(j_p==0)
-	{
-	  printf("No header info provided for pol1.\n");
-	  exit(0);
-	}
-
-  if(j_q==0)
-	{
-	  printf("No header info provided for pol2.\n");
-	  exit(0);
-	}
   if(bs==0)
 	{
 	}
@@ -281,25 +303,32 @@ main(int argc, char *argv[])
   //B_out / 4 (2bit in 8 bit out) / 2 (2 pols in 2 files) / (len / nchan (size of time sample per frame) )
   n_f=B_out/4/2/(len/nfchan);
   printf("Number of frames to read to fill a dada file: %i.\n",n_f);
+  if(n_f<1)
+	{
+	  printf("Dada file size too small.\n");
+	  exit(0);
+	}
 
-  //Number of frame to skip
-  n_skip=n_f_s*s_skip;
-  printf("Number of frames to skip from the beginning to get statistics: %i.\n",n_skip);
-  
-  //Number of frames to get sample statistics
+  //Number of frames the running sample statistics average over
   nf_stat=ns_stat*n_f_s;
-  printf("Number of frames to get statistics: %i.\n",nf_stat);
+  printf("Number of frames for running statistics: %i.\n",nf_stat);
   
   //Number of complete samples in a frame
   n_cs=len/4;
   
-  //Allocate memo for one frame
+  //Position of each channel in a time sample of two CS, ch15...ch00 ch31...ch16
+  for(c=0;c<nch;c++)
+	pos[c]=vdifchan_pos32(ifreq[c]);
+
+  //Output bytes of a frame, a byte per pol for every two CS; dada files hold whole frames
+  B_f=n_cs;
+  B_out=(long)n_f*B_f;
+
+  //Allocate memo for one frame of input, and output buffers sharing a block between them
   for(j=0;j<2;j++)
 	{
 	  inbuffer[j]=malloc(sizeof(unsigned char)*len);
-	  outbuffer[j]=malloc(sizeof(unsigned char)*len*4);
 	  memset(inbuffer[j],0,len);
-	  memset(outbuffer[j],0,len*4);
 	}
   
   //Read sample dada header
@@ -308,12 +337,19 @@ main(int argc, char *argv[])
   fread(dadahdr,1,DADAHDR_SIZE,hdr);
   fclose(hdr);
 
-  //Read headers file to get time
-  phdr[0]=fopen(phdrfile,"rt");
-  phdr[1]=fopen(qhdrfile,"rt");
-  
-  fscanf(phdr[0],"%ld %i %ld %ld",&idx[0],&mon[0],&sec[0],&num[0]);
-  fscanf(phdr[1],"%ld %i %ld %ld",&idx[1],&mon[1],&sec[1],&num[1]);
+  //Map frame indices to get time
+  pidx[0]=j_p ? vdifidx_open(phdrfile) : vdifidx_open_for(ifile,len+fhdr);
+  pidx[1]=j_q ? vdifidx_open(qhdrfile) : vdifidx_open_for(jfile,len+fhdr);
+  for(j=0;j<2;j++)
+	{
+	  if(pidx[j]==NULL)
+		{
+		  printf("Cannot read frame index for pol%i.\n",j+1);
+		  exit(0);
+		}
+	  cur[j]=0;
+	  pend[j]=!nextIndexFrame(pidx[j],&cur[j],&idx[j],&mon[j],&sec[j],&num[j]);
+	}
 
   if(mon[0]!=mon[1])
 	{
@@ -360,154 +396,117 @@ main(int argc, char *argv[])
   //write accurate starting time into a string
   sprintf(mjd_str,"%.16Lf",mjd);
 
-  //Caculate central frequency of the channel
-  cfreq=freq+cw*((float)ifreq-15.5);
-
-  //Get sample statistics of each polarisation
-  printf("Getting sample statistics from %f s of data, after skipping the first %f...\n",ns_stat,s_skip);  
-  for(j=0;j<2;j++)
-	{
-	  mean[j]=0.0;
-	  sq=0.0;
-	  rms[j]=0.0;
-	  if(j==0)
-		invdif[j]=fopen(ifile,"rb");
-	  else
-		invdif[j]=fopen(jfile,"rb");
-
-	  //Skip the first given length of data
-	  for(i=0;i<n_skip;i++)
-		fseek(invdif[j],fhdr+len,SEEK_CUR);
-
-	  for(i=0;i<nf_stat;i++)
-		{
-		  //Skip the frame header
-		  fseek(invdif[j],fhdr,SEEK_CUR);
-
-		  //Read data
-		  fread(inbuffer[j],1,len,invdif[j]);
-
-		  //Expand from 2-bit to 8-bit
-		  convert2to8(outbuffer[j], inbuffer[j], len);
-
-		  //Get values
-		  for(k=0;k<len*4;k++)
-			{
-			  dati=(int)outbuffer[j][k];
-			  mean[j]+=(double)dati;
-			  sq+=pow((double)dati,2.0);
-			}
-		}
-	  fclose(invdif[j]);
-	  mean[j]=mean[j]/nf_stat/len/4;
-	  rms[j]=sqrt(sq/nf_stat/len/4-pow(mean[j],2.0));
-	  printf("Mean: %lf; rms: %lf\n",mean[j],rms[j]);
-	}
-  
   //Update dada header
-  ascii_header_set(dadahdr,"FILE_SIZE","%ld",B_out);
   ascii_header_set(dadahdr,"UTC_START","%s",ut);
   ascii_header_set(dadahdr,"MJD_START","%s",mjd_str);
-  ascii_header_set(dadahdr,"FREQ","%f",cfreq);
   ascii_header_set(dadahdr,"TSAMP","%.16lf",1.0/fabs(cw)/2);
   ascii_header_set(dadahdr,"NDIM","%i",1);
   ascii_header_set(dadahdr,"NPOL","%i",2);
   ascii_header_set(dadahdr,"BW","%f",cw);
+
+  //Dada header of each channel, with the central frequency of the channel
+  chdr=malloc(sizeof(char)*DADAHDR_SIZE*nch);
+  for(c=0;c<nch;c++)
+	{
+	  cfreq[c]=freq+cw*((float)ifreq[c]-15.5);
+	  memcpy(chdr+c*DADAHDR_SIZE,dadahdr,DADAHDR_SIZE);
+	  ascii_header_set(chdr+c*DADAHDR_SIZE,"FREQ","%f",cfreq[c]);
+
+	  //File names keep the observing frequency for a single channel, and carry that of the channel for more
+	  ofreq=(nch==1) ? freq : cfreq[c];
+	  sprintf(stem,"%s_%.01f",ut,ofreq);
+	  out[c]=dadawriter_open(chdr+c*DADAHDR_SIZE,DADAHDR_SIZE,oroute,stem,offset0,B_out,wflags,nch);
+	}
   
   //Open files
   invdif[0]=fopen(ifile,"rb");
   invdif[1]=fopen(jfile,"rb");
 
-  //Main loop
-  while(feof(phdr[0])!=1 && feof(phdr[1])!=1)
+  //Seed running sample statistics of each polarisation with frames read ahead, so that early gaps can be filled
+  for(j=0;j<2;j++)
 	{
-	  //Set filename and byte offset
-	  sprintf(filename,"%s_%.01f_%016ld.000000.dada",ut,freq,offset0+B_out*ctoffset);
-	  ascii_header_set(dadahdr,"FILE_NAME","%s",filename);
-	  ascii_header_set(dadahdr,"OBS_OFFSET","%ld",offset0+B_out*ctoffset);
-
-	  //Open output dada file
-	  sprintf(filename,"%s/%s_%.01f_%016ld.000000.dada",oroute,ut,freq,offset0+B_out*ctoffset);
-	  dada=fopen(filename,"wb");
-	  if(dada==NULL)
+	  es[j]=ewstat_create(1,nf_stat);
+	  cur_ahead=cur[j];
+	  idx_ahead=idx[j];
+	  for(i=0;!pend[j] && i<EWSTAT_LOOKAHEAD;i++)
 		{
-		  printf("Could not generate output file.\n");
-		  exit(1);
+		  fseek(invdif[j],idx_ahead+fhdr,SEEK_SET);
+		  fread(inbuffer[j],1,len,invdif[j]);
+		  vdifstat_moments(inbuffer[j],len,&m1,&m2);
+		  ewstat_update_moments(es[j],&m1,&m2);
+		  if(!nextIndexFrame(pidx[j],&cur_ahead,&idx_ahead,&mon_ahead,&sec_ahead,&num_ahead))
+			break;
 		}
-	  //Write header
-	  fwrite(dadahdr,1,DADAHDR_SIZE,dada);
+	  printf("Pol%i: mean %lf; rms %lf\n",j,ewstat_mean(es[j],0),ewstat_rms(es[j],0));
+	}
 
-	  //Loop over to write content
-	  for(i=0;i<n_f;i++)
+  //Main loop, the dada files follow one another as they fill
+  while(!pend[0] && !pend[1])
+	{
+	  //Treat individual pols
+	  for(j=0;j<2;j++)
 		{
-		  //Treat individual pols
-		  for(j=0;j<2;j++)
+		  //If the available frame matches the time
+		  miss[j]=!(mon[j]==mon_nxt && num[j]==num_nxt && sec[j]==sec_nxt);
+		  if(!miss[j])
 			{
-			  //If the available frame matches the time
-			  if(mon[j]==mon_nxt && num[j]==num_nxt && sec[j]==sec_nxt)
-				{
-				  //Move to the right frame and read the data
-				  fseek(invdif[j],(len+fhdr)*idx[j]+fhdr,SEEK_SET);
-				  fread(inbuffer[j],1,len,invdif[j]);
-				  convert2to8(outbuffer[j], inbuffer[j], len);
+			  //Move to the right frame and read the data
+			  fseek(invdif[j],idx[j]+fhdr,SEEK_SET);
+			  fread(inbuffer[j],1,len,invdif[j]);
 
-				  //Get info of the next available frame
-				  fscanf(phdr[j],"%ld %i %ld %ld",&idx[j],&mon[j],&sec[j],&num[j]);
-				}
-			  //Fill noise
-			  else
-				{
-				  printf("Miss available frame at second %ld and number %ld for pol%i. Fill with random noise.\n",sec_nxt,num_nxt,j);
-				  for(k=0;k<len*4;k++)
-					{
-					  dati=(int)roundf((float)mean[j]+gasdev(&seed[j])*(float)rms[j]);
-					  if(dati<0) dati=0;
-					  if(dati>255) dati=255;
-					  outbuffer[j][k]=(unsigned char)dati;
-					}
-				}
-			}
+			  //Update running sample statistics
+			  vdifstat_moments(inbuffer[j],len,&m1,&m2);
+			  ewstat_update_moments(es[j],&m1,&m2);
 
-		  //Write data
-          for(k=0;k<n_cs/2;k++)
-			{
-			  for(j=0;j<2;j++)
-				{
-				  if(ifreq<16)
-					{
-					  dat=(char)((int)outbuffer[j][2*k*B_cs+B_cs-ifreq]-128);
-					}
-				  else
-					{
-					  dat=(char)((int)outbuffer[j][2*k*B_cs+B_cs*3-ifreq]-128);
-					}					  
-				  fwrite(&dat,1,1,dada);
-				}
+			  //Get info of the next available frame
+			  pend[j]=!nextIndexFrame(pidx[j],&cur[j],&idx[j],&mon[j],&sec[j],&num[j]);
 			}
-		  
-		  //If the end of table file, break
-		  if(feof(phdr[0])==1 || feof(phdr[1])==1) break;
-		  		  
-		  //Count the next frame to read
-		  num_nxt++;
-		  if(num_nxt==n_f_s)
+		  else
 			{
-			  num_nxt=0;
-			  sec_nxt++;
+			  printf("Miss available frame at second %ld and number %ld for pol%i. Fill with random noise.\n",sec_nxt,num_nxt,j);
 			}
 		}
-	  //Close output
-	  fclose(dada);
-	  ctoffset++;
-	  printf("%s created.\n",filename);
+
+	  //Fan the frame out to the channels
+	  for(c=0;c<nch;c++)
+		{
+		  //Gather the channel of both pols, one sample per two CS, pols interleaved
+		  obuffer=dadawriter_reserve(out[c],B_f);
+		  vdifchan_gather2(obuffer,inbuffer[0],pos[c],inbuffer[1],pos[c],n_cs/2,B_cs/2,vdifchan_levels);
+
+		  //Fill noise for a missing frame
+		  for(j=0;j<2;j++)
+			if(miss[j])
+			  for(k=0;k<n_cs/2;k++)
+				{
+				  dati=(int)roundf((float)ewstat_mean(es[j],0)+gasdev(&seed[j])*(float)ewstat_rms(es[j],0));
+				  if(dati<0) dati=0;
+				  if(dati>255) dati=255;
+				  obuffer[2*k+j]=(char)(dati-128);
+				}
+		}
+
+	  //If the end of frame index, break
+	  if(pend[0] || pend[1]) break;
+
+	  //Count the next frame to read
+	  num_nxt++;
+	  if(num_nxt==n_f_s)
+		{
+		  num_nxt=0;
+		  sec_nxt++;
+		}
 	}
 	
   //Close and clean up
   for(j=0;j<2;j++)
 	{
 	  fclose(invdif[j]);
-	  fclose(phdr[j]);
+	  vdifidx_close(pidx[j]);
+	  ewstat_destroy(es[j]);
 	  free(inbuffer[j]);
-	  free(outbuffer[j]);
 	}
+  for(c=0;c<nch;c++)
+	dadawriter_close(out[c]);
+  free(chdr);
 }
@@ -16,47 +16,16 @@
 #include "hget.c"
 #include "mjd2date.c"
 #include "ascii_header.c"
+#include "vdifidx.h"
+#include "vdifchan.h"
+#include "dadawriter.h"
 
-//Convert 2-bit string to 8-bit, taken from vdif2to8
-//Arguments are output, input, number of bytes in input
-static void convert2to8(unsigned char *dest, const unsigned char *src, int bytes)
-{
-  /* choose levels such that the ratio of high to low is as close to 3.3359                     
-   * as possible to best maintain amplitude scaling.  127.5 is the center of                    
-   * the scale (equates to 0).  118.5/35.5 is pretty close to optimal.                          
-   */
-  const unsigned char levels[4] = {9, 92, 163, 246};
-  static int first = 1;
-  static unsigned char lut2to8[256][4];   /* mapping from input 8 bits (4 samples) to output 4 8-bit samples */
-  int i, o;
-
-  if(first)
-	{
-	  /* assemble look up table */
-
-	  for(i = 0; i < 256; ++i)
-		{
-		  int j;
-
-		  for(j = 0; j < 4; ++j)
-			{
-			  int k;
-
-			  k = (i >> (2*j)) & 0x3;
-			  lut2to8[i][j] = levels[k];
-			}
-		}
-	}
-
-  o = 0;
-  for(i = 0; i < bytes; ++i)
-	{
-	  dest[o++] = lut2to8[src[i]][0];
-	  dest[o++] = lut2to8[src[i]][1];
-	  dest[o++] = lut2to8[src[i]][2];
-	  dest[o++] = lut2to8[src[i]][3];
-	}
-}
+//Levels of 2-bit samples in 8 bit, taken from vdif2to8
+/* choose levels such that the ratio of high to low is as close to 3.3359
+ * as possible to best maintain amplitude scaling.  127.5 is the center of
+ * the scale (equates to 0).  118.5/35.5 is pretty close to optimal.
+ */
+static const unsigned char levels[4] = {9, 92, 163, 246};
 
 //Calculate MJD from number of 6-mon counts and seconds
 long double get_mjd(int mon, long sec)
@@ -85,6 +54,26 @@ long double get_mjd(int mon, long sec)
   return((long double)imjd+fmjd);
 }
 
+//Get info of the next valid frame from the frame index, 0 if no more
+int nextIndexFrame(struct vdifidx *ix, int64_t *cur, long *off, int *mon, long *sec, long *num)
+{
+  const struct vdifidx_entry *e;
+
+  while(*cur < (int64_t)ix->hdr->nentry && !(ix->entry[*cur].flags & VDIFIDX_VALID))
+	(*cur)++;
+  if(*cur >= (int64_t)ix->hdr->nentry)
+	return 0;
+
+  e=&ix->entry[*cur];
+  *off=e->offset;
+  *mon=e->epoch;
+  *sec=e->second;
+  *num=e->frame;
+  (*cur)++;
+
+  return 1;
+}
+
 int usage(char *prg_name)
 {
   fprintf(stdout,
@@ -92,16 +81,17 @@ int usage(char *prg_name)
 		  "Data configured as 16x32 MHz, where 16 = 2 pol x 8 freq;"
 		  "A complete sample is 16 x 2 = 32 bit, exactly a 32-bit word, meaning no reverse-order in sample storage.\n"  
 		             "%s [options]\n"
-		             " -f   Central frequency of the selected channel (MHz)\n"
+		             " -f   Central frequency of each selected channel (MHz, comma separated in the order of -n)\n"
 		             " -l   Frame size in Byte (without header, by default 8000)\n"
 		             " -r   Frame header in Byte (by default 32)\n"
             		 " -i   Input vdif file\n"
-		             " -n   Index of frequency channel to extract\n"
-		             " -p   Header table\n"
+		             " -n   Indices of frequency channels to extract, each to its own dada files (e.g. 3, 0-7 or 1,5)\n"
+		             " -p   Frame index (by default <input file>.vidx, built if missing)\n"
 		             " -D   Dada file header size (by default 4096)\n"
 		             " -B   Bytes for one dada file (by default 1280000000,10s)\n"
 		             " -S   Sample data header file\n"
 		             " -O   Route for output \n"
+		             " -d   Write output with O_DIRECT\n"
 		  " -h   Available options\n",
 		  prg_name);
   exit(0);
@@ -109,7 +99,8 @@ int usage(char *prg_name)
 
 main(int argc, char *argv[])
 {
-  FILE *invdif,*dada,*hdr,*phdr;
+  FILE *invdif,*hdr;
+  struct vdifidx *pidx;
 
   //Default dada header file set up
   int DADAHDR_SIZE=4096;
@@ -123,20 +114,25 @@ main(int argc, char *argv[])
   //Default bytes of a frame header
   int fhdr=32;
   
-  char ifile[200], oroute[200], hdrfile[200],phdrfile[200],dadahdr[DADAHDR_SIZE],ut[30],mjd_str[25],filename[200],dat;
-  unsigned char *inbuffer, *outbuffer;
-  int arg,j_i,j_O,j_S,j_p,n_f,n_cs,mon,ctoffset,i,j,k,t,ifreq,nfchan,B_cs,mon_nxt,n_f_s;
-  float bw, freq;
+  char ifile[200], oroute[200], hdrfile[200],phdrfile[200],dadahdr[DADAHDR_SIZE],ut[30],mjd_str[25],stem[200],chlist[200],flist[1024];
+  char *chdr,*tok;
+  unsigned char *inbuffer;
+  int arg,j_i,j_O,j_S,j_p,n_f,n_cs,mon,j,t,c,nfchan,B_cs,mon_nxt,n_f_s,B_f,nch,nfreq,wflags;
+  int ifreq[VDIFCHAN_MAXCHAN];
+  float bw, freq[VDIFCHAN_MAXCHAN];
+  struct dadawriter *out[VDIFCHAN_MAXCHAN];
   long double mjd;
   long int idx,sec,num,offset0,sec_nxt,num_nxt;
+  int64_t cur;
+  int pend;
   
   j_i=0;
   j_O=0;
   j_S=0;
   j_p=0;
-  freq=0.0;
-  ctoffset=0;
-  ifreq=-1;
+  nfreq=0;
+  wflags=0;
+  strcpy(chlist,"");
 
   //Specific for EB vdif output
   bw=32.0;
@@ -146,12 +142,14 @@ main(int argc, char *argv[])
   B_cs=16;
   
   //Read arguments
-  while ((arg=getopt(argc,argv,"hf:l:r:i:n:p:D:B:S:O:")) != -1)
+  while ((arg=getopt(argc,argv,"hf:l:r:i:n:p:D:B:S:O:d")) != -1)
 	{
 	  switch(arg)
 		{
 		case 'f':
-		  freq=atof(optarg);
+		  strcpy(flist,optarg);
+		  for(tok=strtok(flist,",");tok!=NULL && nfreq<VDIFCHAN_MAXCHAN;tok=strtok(NULL,","))
+			freq[nfreq++]=atof(tok);
 		  break;
 
 		case 'l':
@@ -168,7 +166,7 @@ main(int argc, char *argv[])
 		  break;
 		  
 		case 'n':
-		  ifreq=atoi(optarg);
+		  strcpy(chlist,optarg);
 		  break;
 
 		case 'p':
@@ -194,6 +192,10 @@ main(int argc, char *argv[])
 		  j_O=1;
 		  break;
 
+		case 'd':
+		  wflags|=DADAWRITER_ODIRECT;
+		  break;
+
 		case 'h':
 		  usage(argv[0]);
 		  return 0;
@@ -205,7 +207,7 @@ main(int argc, char *argv[])
 	}
   
   //Check if arguments are enough to procceed
-  if(freq==0.0)
+  if(nfreq==0)
 	{
 	  printf("Missing info of observing frequency.\n");
 	  exit(0);
@@ -229,12 +231,19 @@ main(int argc, char *argv[])
 	  exit(0);
 	}
 
-  if(ifreq<0)
+  nch=vdifchan_parse_list(chlist,ifreq,nfchan);
+  if(nch<1)
 	{
 	  printf("No/not valid index of frequency channel.\n");
 	  exit(0);
 	}
 
+  if(nfreq!=nch)
+	{
+	  printf("Give one observing frequency for each channel.\n");
+	  exit(0);
+	}
+
   if(nfchan<1)
 	{
 	  printf("No/not valid number of frequency channels.\n");
@@ -249,15 +258,22 @@ main(int argc, char *argv[])
   //Number of frames to read to fill a dada file
   n_f=B_out/(len*4/nfchan);
   printf("Number of frames to read to fill a dada file: %i.\n",n_f);
+  if(n_f<1)
+	{
+	  printf("Dada file size too small.\n");
+	  exit(0);
+	}
 
   //Number of complete samples in a frame
   n_cs=len/4;
   
-  //Allocate memo for one frame
+  //Output bytes of a frame, a byte per pol for every CS; dada files hold whole frames
+  B_f=n_cs*2;
+  B_out=(long)n_f*B_f;
+
+  //Allocate memo for one frame of input, and output buffers sharing a block between them
   inbuffer=malloc(sizeof(unsigned char)*len);
-  outbuffer=malloc(sizeof(unsigned char)*len*4);
   memset(inbuffer,0,len);
-  memset(outbuffer,0,len*4);
   
   //Read sample dada header
   memset(dadahdr,0,DADAHDR_SIZE);
@@ -265,9 +281,15 @@ main(int argc, char *argv[])
   fread(dadahdr,1,DADAHDR_SIZE,hdr);
   fclose(hdr);
 
-  //Read headers file to get time
-  phdr=fopen(phdrfile,"rt");
-  fscanf(phdr,"%ld %i %ld %ld",&idx,&mon,&sec,&num);
+  //Map frame index to get time
+  pidx=j_p ? vdifidx_open(phdrfile) : vdifidx_open_for(ifile,len+fhdr);
+  if(pidx==NULL)
+	{
+	  printf("Cannot read frame index.\n");
+	  exit(0);
+	}
+  cur=0;
+  pend=!nextIndexFrame(pidx,&cur,&idx,&mon,&sec,&num);
 
   mon_nxt=mon;
   sec_nxt=sec;
@@ -288,97 +310,76 @@ main(int argc, char *argv[])
   sprintf(mjd_str,"%.16Lf",mjd);
   
   //Update header
-  ascii_header_set(dadahdr,"FILE_SIZE","%ld",B_out);
   ascii_header_set(dadahdr,"UTC_START","%s",ut);
   ascii_header_set(dadahdr,"MJD_START","%s",mjd_str);
-  ascii_header_set(dadahdr,"FREQ","%f",freq);
   ascii_header_set(dadahdr,"TSAMP","%.16lf",1.0/bw/2);
   ascii_header_set(dadahdr,"NDIM","%i",1);
   ascii_header_set(dadahdr,"NPOL","%i",2);
-  if(ifreq==0 || ifreq==2 || ifreq==4 || ifreq==6)
-	{
-	  ascii_header_set(dadahdr,"BW","%f",-bw);
-	}
-  else
+
+  //Dada header of each channel, with its frequency and side band
+  chdr=malloc(sizeof(char)*DADAHDR_SIZE*nch);
+  for(c=0;c<nch;c++)
 	{
-	  ascii_header_set(dadahdr,"BW","%f",bw);
+	  memcpy(chdr+c*DADAHDR_SIZE,dadahdr,DADAHDR_SIZE);
+	  ascii_header_set(chdr+c*DADAHDR_SIZE,"FREQ","%f",freq[c]);
+	  if(ifreq[c]==0 || ifreq[c]==2 || ifreq[c]==4 || ifreq[c]==6)
+		{
+		  ascii_header_set(chdr+c*DADAHDR_SIZE,"BW","%f",-bw);
+		}
+	  else
+		{
+		  ascii_header_set(chdr+c*DADAHDR_SIZE,"BW","%f",bw);
+		}
+	  sprintf(stem,"%s_%.01f",ut,freq[c]);
+	  out[c]=dadawriter_open(chdr+c*DADAHDR_SIZE,DADAHDR_SIZE,oroute,stem,offset0,B_out,wflags,nch);
 	}
   
   //Open files
   invdif=fopen(ifile,"rb");
 
-  //Main loop
-  while(feof(phdr)!=1)
+  //Main loop, the dada files follow one another as they fill
+  while(!pend)
 	{
-	  //Set filename and byte offset
-	  sprintf(filename,"%s_%.01f_%016ld.000000.dada",ut,freq,offset0+B_out*ctoffset);
-	  ascii_header_set(dadahdr,"FILE_NAME","%s",filename);
-	  ascii_header_set(dadahdr,"OBS_OFFSET","%ld",offset0+B_out*ctoffset);
-
-	  //Open output dada file
-	  sprintf(filename,"%s/%s_%.01f_%016ld.000000.dada",oroute,ut,freq,offset0+B_out*ctoffset);
-	  dada=fopen(filename,"wb");
-	  if(dada==NULL)
+	  //If the available frame matches the time
+	  if(mon==mon_nxt && num==num_nxt && sec==sec_nxt)
 		{
-		  printf("Could not generate output file.\n");
-		  exit(1);
-		}
-	  //Write header
-	  fwrite(dadahdr,1,DADAHDR_SIZE,dada);
+		  //Move to the right frame and read the data
+		  fseek(invdif,idx+fhdr,SEEK_SET);
+		  fread(inbuffer,1,len,invdif);
 
-	  //Loop over to write content
-	  for(i=0;i<n_f;i++)
+		  //Get info of the next available frame
+		  pend=!nextIndexFrame(pidx,&cur,&idx,&mon,&sec,&num);
+
+		  //If the end of frame index, break
+		  if(pend) break;
+
+		  //Gather each channel, the two pols next to each other in a CS
+		  for(c=0;c<nch;c++)
+			vdifchan_gather2(dadawriter_reserve(out[c],B_f),inbuffer,2*ifreq[c],inbuffer,2*ifreq[c]+1,n_cs,B_cs/4,levels);
+		}
+	  //Fill zeros
+	  else
 		{
-		  //If the available frame matches the time
-		  if(mon==mon_nxt && num==num_nxt && sec==sec_nxt)
-			{
-			  //Move to the right frame and read the data
-			  fseek(invdif,(len+fhdr)*idx+fhdr,SEEK_SET);
-			  fread(inbuffer,1,len,invdif);
-			  convert2to8(outbuffer, inbuffer, len);
-
-			  //Get info of the next available frame
-			  fscanf(phdr,"%ld %i %ld %ld",&idx,&mon,&sec,&num);
-			}
-		  //Fill zeros
-		  else
-			{
-			  printf("Miss available frame for sec %ld and index %ld. Fill zeros.\n",sec_nxt,num_nxt);
-			  memset(outbuffer,0,len*4);
-			}
-		
-		  //If the end of table file, break
-		  if(feof(phdr)==1) break;
-
-		  //Write data
-		  for(k=0;k<n_cs;k++)
-			{
-			  dat=(char)((int)outbuffer[k*B_cs+2*ifreq]-128);
-			  fwrite(&dat,1,1,dada);
-			  //printf("%i\n",(int)dat);
-			  dat=(char)((int)outbuffer[k*B_cs+2*ifreq+1]-128);
-			  fwrite(&dat,1,1,dada);
-			}
-
-		  //Count the next frame to read
-		  num_nxt++;
-		  if(num_nxt==n_f_s)
-			{
-			  num_nxt=0;
-			  sec_nxt++;
-			}
+		  printf("Miss available frame for sec %ld and index %ld. Fill zeros.\n",sec_nxt,num_nxt);
+		  for(c=0;c<nch;c++)
+			memset(dadawriter_reserve(out[c],B_f),-128,B_f);
 		}
 
-	  //Close output
-	  fclose(dada);
-	  ctoffset++;
-	  printf("%s created.\n",filename);
+	  //Count the next frame to read
+	  num_nxt++;
+	  if(num_nxt==n_f_s)
+		{
+		  num_nxt=0;
+		  sec_nxt++;
+		}
 	}
   
   //Close and clean up
   fclose(invdif);
-  fclose(phdr);
+  vdifidx_close(pidx);
   free(inbuffer);
-  free(outbuffer);
+  for(c=0;c<nch;c++)
+	dadawriter_close(out[c]);
+  free(chdr);
 }
 
@@ -21,6 +21,8 @@
 #include "vdifio.h"
 #include "vdif2psrfits.h"
 #include "dec2hms.h"
+#include "vdifchan.h"
+#include "dadawriter.h"
 
 static uint32_t VDIF_BW = 512; //Bandwidth in MHz
 
@@ -80,6 +82,7 @@ int usage(char *prg_name)
 		             " -B   Bytes for one dada file (by default 2560000000)\n"
 		             " -S   Sample data header file\n"
 		             " -O   Route for output \n"
+		             " -d   Write output with O_DIRECT\n"
 		  " -h   Available options\n",
 		  prg_name);
   exit(0);
@@ -87,7 +90,7 @@ int usage(char *prg_name)
 
 main(int argc, char *argv[])
 {
-  FILE *invdif,*dada,*hdr,*phdr;
+  FILE *invdif,*hdr,*phdr;
 
   //Default dada header file set up
   int DADAHDR_SIZE=4096;
@@ -101,9 +104,10 @@ main(int argc, char *argv[])
   //Default bytes of a frame header
   int fhdr=32;
   
-  char ifile[200], oroute[200], hdrfile[200], dadahdr[DADAHDR_SIZE],ut[30],mjd_str[25],filename[200],dat, vfhdr[VDIF_HEADER_BYTES], vfhdrst[VDIF_HEADER_BYTES];
+  char ifile[200], oroute[200], hdrfile[200], dadahdr[DADAHDR_SIZE],ut[30],mjd_str[25],stem[200], vfhdr[VDIF_HEADER_BYTES], vfhdrst[VDIF_HEADER_BYTES];
   unsigned char *outbuffer;
-  int arg,j_i,j_O,j_S,j_p,n_f,n_cs,mon,ctoffset,i,j,k,t,ifreq,nfchan,B_cs,mon_nxt,n_f_s, bs, npol, ndim, offset, offset_pre;
+  struct dadawriter *out;
+  int arg,j_i,j_O,j_S,j_p,n_f,n_cs,mon,t,ifreq,nfchan,B_cs,mon_nxt,n_f_s, bs, npol, ndim, offset, offset_pre, B_f, wflags;
   float bw, freq;
   long double mjd;
   long int idx,sec,num,offset0,sec_nxt,num_nxt;
@@ -114,7 +118,7 @@ main(int argc, char *argv[])
   j_S=0;
   j_p=0;
   freq=0.0;
-  ctoffset=0;
+  wflags=0;
   ifreq=-1;
 
   //Specific for TMRT vdif output
@@ -127,7 +131,7 @@ main(int argc, char *argv[])
   fbytes = 8192;
   
   //Read arguments
-  while ((arg=getopt(argc,argv,"hf:l:r:i:n:D:B:S:O:")) != -1)
+  while ((arg=getopt(argc,argv,"hf:l:r:i:n:D:B:S:O:d")) != -1)
 	{
 	  switch(arg)
 		{
@@ -170,6 +174,10 @@ main(int argc, char *argv[])
 		  j_O=1;
 		  break;
 
+		case 'd':
+		  wflags|=DADAWRITER_ODIRECT;
+		  break;
+
 		case 'h':
 		  usage(argv[0]);
 		  return 0;
@@ -225,6 +233,11 @@ main(int argc, char *argv[])
   //Number of frames to read to fill a dada file
   n_f = B_out / (fbytes / nfchan);
   printf("Number of frames to read to fill a dada file: %i.\n",n_f);
+  if(n_f<1)
+    {
+      printf("Dada file size too small.\n");
+      exit(0);
+    }
 
   //Number of complete time samples in a frame
   n_cs = fbytes / B_cs;
@@ -232,7 +245,11 @@ main(int argc, char *argv[])
   // Number of frames per second
   fps=1000000 * 2 * VDIF_BW * npol / fbytes;
   
-  //Allocate memo for one frame
+  //Output bytes of a frame; dada files hold whole frames
+  B_f = n_cs * npol * ndim;
+  B_out = (long)n_f * B_f;
+
+  //Allocate memo for one frame of input and a block of output
   outbuffer=malloc(sizeof(unsigned char)*fbytes);
   memset(outbuffer,0,fbytes);
   
@@ -269,7 +286,6 @@ main(int argc, char *argv[])
   printf("Offset at the beginning in bytes: %ld.\n",offset0);
   
   //Update dada header
-  ascii_header_set(dadahdr,"FILE_SIZE","%ld",B_out);
   ascii_header_set(dadahdr,"UTC_START","%s",ut);
   ascii_header_set(dadahdr,"MJD_START","%s",mjd_str);
   ascii_header_set(dadahdr,"FREQ","%f",freq);
@@ -277,76 +293,45 @@ main(int argc, char *argv[])
   ascii_header_set(dadahdr,"NDIM","%i",ndim);
   ascii_header_set(dadahdr,"NPOL","%i",npol);
   ascii_header_set(dadahdr,"BW","%f",bw*bs);
+  sprintf(stem,"%s_%.01f",ut,freq);
+  out=dadawriter_open(dadahdr,DADAHDR_SIZE,oroute,stem,offset0,B_out,wflags,1);
   
-  //Main loop
+  //Main loop over VDIF frames, the dada files follow one another as they fill
   while(feof(invdif) != 1)
     {
-      // Set filename and byte offset
-      sprintf(filename,"%s_%.01f_%016ld.000000.dada",ut,freq,offset0+B_out*ctoffset);
-      ascii_header_set(dadahdr,"FILE_NAME","%s",filename);
-      ascii_header_set(dadahdr,"OBS_OFFSET","%ld",offset0+B_out*ctoffset);
-
-      // Open output dada file
-      sprintf(filename,"%s/%s_%.01f_%016ld.000000.dada",oroute,ut,freq,offset0+B_out*ctoffset);
-      dada=fopen(filename,"wb");
-      if(dada==NULL)
+      // Find the next valid frame
+      while (true)
 	{
-	  printf("Could not generate output file.\n");
-	  exit(1);
+	  fread(vfhdr, 1, VDIF_HEADER_BYTES, invdif);
+	  if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr, VDIF_HEADER_BYTES+fbytes, false))
+	    break;
+	  printf("Invalid frame. Move to the next.\n");
+	  fseek(invdif, fbytes, SEEK_CUR);
 	}
-      // Write dada header
-      fwrite(dadahdr,1,DADAHDR_SIZE,dada);
 
-      // Loop over VDIF frames to write content
-      for(i=0;i<n_f;i++)
+      // Get frame offset                                                                                                                                
+      offset = getVDIFFrameOffset((const vdif_header *)vfhdrst, (const vdif_header *)vfhdr, fps);
+
+      // Gap from the last frames, fill in data buffer with zeros
+      if(offset > offset_pre + 1)
 	{
-	  // Find the next valid frame
-	  while (true)
-	    {
-	      fread(vfhdr, 1, VDIF_HEADER_BYTES, invdif);
-	      if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr, VDIF_HEADER_BYTES+fbytes, false))
-		break;
-	      printf("Invalid frame. Move to the next.\n");
-	      fseek(invdif, fbytes, SEEK_CUR);
-	    }
-
-	  // Get frame offset                                                                                                                                
-	  offset = getVDIFFrameOffset((const vdif_header *)vfhdrst, (const vdif_header *)vfhdr, fps);
-
-	  // Gap from the last frames, fill in data buffer with zeros
-	  if(offset > offset_pre + 1)
-	    {
-	      printf("Miss available frame. Fill zeros.\n");
-	      memset(outbuffer, 0, fbytes);
-	      fseek(invdif,  VDIF_HEADER_BYTES, SEEK_CUR);
-	    }
-	  // Consecutive
-	  else
-	    fread(outbuffer, 1, fbytes, invdif);
-
-	  offset_pre++;
-
-	  // Write data
-	  for(k=0;k<n_cs;k++)
-	    {
-	      for(j=0; j<npol*ndim; j++)
-		{
-		  dat = outbuffer[k * B_cs + npol * ndim * ifreq + j];
-		  fwrite(&dat,1,1,dada);
-		}
-	    }
-	  if(feof(invdif) == 1)
-	    break;
+	  printf("Miss available frame. Fill zeros.\n");
+	  memset(outbuffer, 0, fbytes);
+	  fseek(invdif,  VDIF_HEADER_BYTES, SEEK_CUR);
 	}
+      // Consecutive
+      else
+	fread(outbuffer, 1, fbytes, invdif);
+
+      offset_pre++;
 
-      // Close output
-      fclose(dada);
-      ctoffset++;
-      printf("%s created.\n",filename);
+      // Gather the channel, all pols of it next to each other
+      vdifchan_gather8(dadawriter_reserve(out, B_f), outbuffer, n_cs, B_cs, npol * ndim * ifreq, npol * ndim);
     }
   
   //Close and clean up
   fclose(invdif);
   free(outbuffer);
+  dadawriter_close(out);
 }
 
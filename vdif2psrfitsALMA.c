@@ -17,6 +17,10 @@
 #include "psrfits.h"
 #include "vdif2psrfits.h"
 #include "dec2hms.h"
+#include "det_pipeline.h"
+#include "psrwriter.h"
+#include "vdifmap.h"
+#include "vdifstat.h"
 #include <fftw3.h>
 #include <stdbool.h>
 #include "ran.c"
@@ -33,7 +37,7 @@ void usage(char *prg_name)
                   "  -i      Input vdif pol0\n"
 		  "  -j      Input vdif pol1\n"
 		  "  -n      Band sense (-1 for lower-side, 1 for upper-side, by default 1)\n" 
-		  "  -s      Seconds to get statistics to fill in invalid frames\n"
+		  "  -s      Seconds of data the running statistics to fill in invalid frames average over (by default 1)\n"
                   "  -k      Seconds to skip from the beginning (default 0)\n"
 		  "  -t      Time sample scrunch factor (by default 1). One time sample 8 microsecond\n"
                   "  -S      Name of the source (by default J0000+0000)\n"
@@ -41,6 +45,13 @@ void usage(char *prg_name)
                   "  -c      Dec of the source (+AA:BB:CC.DD)\n"
 		  "  -D      Ouput data status (I for Stokes I, C for coherence product, X for pol0 I, Y for pol1 I, S for Stokes, P for polarised signal, S for stokes, by default C)\n"
 	          "  -d      Number of thread to use in FFT (by default 1)\n"
+	          "  -w      Number of detection worker threads (by default 1)\n"
+	          "  -e      Plan FFT with FFTW_PATIENT, slow but the wisdom is cached for later runs\n"
+	          "  -m      Average so many output time samples together (by default 1)\n"
+	          "  -g      Average so many adjacent channels together (by default 1)\n"
+	          "  -B      Bits per output sample, 32 (float), 8 or 4 (by default 32)\n"
+	          "  -R      Scale 8 or 4-bit output with the running statistics over -s seconds instead of those of each subint\n"
+	          "  -F      Seconds between flushes of the output file to disk, 0 for every subint (by default 10)\n"
 	          "  -v      Verbose\n"
 		  "  -O      Route of the output file(s).\n"
 		  "  -h      Available options\n"
@@ -53,66 +64,210 @@ void usage(char *prg_name)
   exit(0);
 }
 
-// get offset VDIF frame from beginning
-int64_t getVDIFFrameOffset(const vdif_header *headerst, const vdif_header *header, uint32_t fps)
+// State of the in-order subint assembler, including power dip patching
+struct alma_asm {
+  struct psrfits *pf;
+  int nchan;
+  int npol;
+  int tsf;
+  int pch;
+  long int pha_ct;
+  long int len_scan_nf;
+  long int len_dip_nf;
+  long int fct;
+  long int seed;
+  long int iseed;
+  float (*sdet)[4];
+  double (*mean_det)[4];
+  double (*rms_det)[4];
+  double (*acc_det)[4];
+  double (*accsq_det)[4];
+  struct ewstat *es;
+};
+
+// Seed the running detection statistics with frames read ahead
+static void alma_seed_assemble(void *arg, const struct detjob *job)
 {
-  uint32_t day[2],sec[2],num[2];
-  int64_t offset;
+  struct alma_asm *a = (struct alma_asm *)arg;
 
-  // Get epoch      
-  day[0]=getVDIFFrameMJD(headerst);
-  day[1]=getVDIFFrameMJD(header);
+  ewstat_update(a->es,&job->det[0][0]);
+}
+
+// Patch and accumulate frame detections to time samples, write them in pf.sub.rawdata,
+// or in pf.sub.fdata to be downsampled or requantised
+static void alma_assemble(void *arg, const struct detjob *job)
+{
+  struct alma_asm *a = (struct alma_asm *)arg;
+  float (*det)[4];
+  unsigned char *dst;
+  int i,j,k,p,nchan;
+
+  nchan=a->nchan;
+  det=job->det;
+
+  // Frame within the time sample and time sample within the subint
+  k=job->seq%a->tsf;
+  i=(job->seq/a->tsf)%a->pf->hdr.nsblk;
+
+  // Initialize detection block
+  if(k==0)
+    for(j=0;j<nchan;j++)
+      for(p=0;p<a->npol;p++)
+	a->sdet[j][p]=0.0;
+
+  // Valid frame
+  if(job->kind==DETJOB_DETECT)
+    {
+      // Subscan phase
+      if(a->pha_ct < a->len_scan_nf)
+	{
+	  // Update running statistics to fill invalid frames
+	  ewstat_update(a->es,&det[0][0]);
+
+	  // Accumulate values for detection (running) mean
+	  for(j=0;j<nchan;j++)
+	    for(p=0;p<4;p++)
+	      {
+		a->acc_det[j][p]+=(double)det[j][p];
+		a->accsq_det[j][p]+=pow((double)det[j][p],2.0);
+	      }
+	  a->fct++;
+	}
+      else // Dip phase
+	{
+	  // Update patching param, when entering dip phase
+	  if(a->pha_ct == a->len_scan_nf)
+	    {
+	      // Update detection mean
+	      for(j=0;j<nchan;j++)
+		for(p=0;p<4;p++)
+		  {
+		    if(a->acc_det[j][p]!=0.0)
+		      {
+			a->mean_det[j][p]=a->acc_det[j][p]/(double)a->fct;
+			a->rms_det[j][p]=sqrt(a->accsq_det[j][p]/(double)a->fct-pow(a->mean_det[j][p],2.0));
+		      }
+
+		    // Reset accumulation
+		    a->acc_det[j][p]=0.0;
+		    a->accsq_det[j][p]=0.0;
+		  }
+	      a->fct=0;
+	    }
+	  // Patch detection with mean+rms
+	  if(a->pch == 1)
+	    {
+	      for(j=0;j<nchan;j++)
+		for(p=0;p<4;p++)
+		  det[j][p]=a->mean_det[j][p]+a->rms_det[j][p]*gasdev(&a->seed);
+	    }
+	  else if(a->pch == 2)
+	    {
+	      // Patch fake detection from mean
+	      for(j=0;j<nchan;j++)
+		for(p=0;p<4;p++)
+		  det[j][p]=a->mean_det[j][p];
+	    }
+	}
+    }
+  else // Invalid frame or gap, fake detection with running mean
+    {
+      for(j=0;j<nchan;j++)
+	for(p=0;p<4;p++)
+	  det[j][p]=ewstat_mean(a->es,j*4+p);
+    }
+
+  // Accumulate detection value
+  for(j=0;j<nchan;j++)
+    for(p=0;p<a->npol;p++)
+      a->sdet[j][p]+=det[j][p];
+
+  // Update phase counters
+  a->pha_ct++;
 
-  // Get second after epoch
-  sec[0]=getVDIFFrameSecond(headerst);
-  sec[1]=getVDIFFrameSecond(header);
+  // Reset phase and counter
+  if(a->pha_ct == (a->len_scan_nf + a->len_dip_nf))
+    {
+      a->pha_ct = 0;
 
-  // Get number of frame after second
-  num[0]=getVDIFFrameNumber(headerst);
-  num[1]=getVDIFFrameNumber(header);
+      // Start another sequence for ran
+      a->iseed=a->iseed-2;
+      a->seed=a->iseed;
+    }
 
-  offset=(day[1]-day[0])*86400*fps+(sec[1]-sec[0])*fps+(num[1]-num[0]);
+  // Sample not complete yet
+  if(k!=a->tsf-1) return;
 
-  return offset;
+  // Write detections in 32-bit float and FPT order (freq, pol, time)
+  dst=(a->pf->sub.fdata==NULL) ? a->pf->sub.rawdata : (unsigned char *)a->pf->sub.fdata;
+  for(j=0;j<nchan;j++)
+    {
+      if (a->npol == 4)
+	{
+	  memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*j,&a->sdet[j][0],sizeof(float));
+	  memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*1+sizeof(float)*j,&a->sdet[j][1],sizeof(float));
+	  memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*2+sizeof(float)*j,&a->sdet[j][2],sizeof(float));
+	  memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*3+sizeof(float)*j,&a->sdet[j][3],sizeof(float));
+	}
+      else if (a->npol == 2)
+	{
+	  memcpy(dst+i*sizeof(float)*2*nchan+sizeof(float)*j,&a->sdet[j][0],sizeof(float));
+	  memcpy(dst+i*sizeof(float)*2*nchan+sizeof(float)*nchan*1+sizeof(float)*j,&a->sdet[j][1],sizeof(float));
+	}
+      else if (a->npol == 1)
+	{
+	  memcpy(dst+i*sizeof(float)*1*nchan+sizeof(float)*j,&a->sdet[j][0],sizeof(float));
+	}
+    }
 }
 
 
 int main(int argc, char *argv[])
 {
   FILE *vdif[2],*out;
-  bool pval[2], ifverbose, ifpol[2], ifout, chkend[2], pend[2];
+  bool pval[2], ifverbose, ifpol[2], ifout, pend[2];
   struct psrfits pf;
   
   char vname[2][1024], oroute[1024], ut[30],mjd_str[25],vfhdr[2][VDIF_HEADER_BYTES],vfhdrst[VDIF_HEADER_BYTES],srcname[16],dstat,ra[64],dec[64];
-  int arg,j_i,j_j,j_O,n_f,i,j,k,p,nfps,fbytes,fnum,vd[2],nf_stat,ftot[2][2][VDIF_NCHAN],ct,tsf,bs,tet,nf_skip,dati,npol,pch,mean_sampl,sk,nthd,nread[2];
-  float freq,s_stat,dat,s_skip,*in_p0, *in_p1;
+  int arg,j_i,j_j,j_O,n_f,i,j,k,p,nfps,fbytes,fnum,vd[2],nf_stat,ftot[2][2][VDIF_NCHAN],ct,tsf,bs,tet,nf_skip,dati,npol,pch,mean_sampl,sk,nthd,nwork,kind;
+  int nbits,dsf[2];
+  bool ifrun;
+  float freq,s_stat,dat,s_skip,flush_sec;
   double spf,pha_start,len_scan,len_dip,mean_det[VDIF_NCHAN][4],acc_det[VDIF_NCHAN][4],rms_det[VDIF_NCHAN][4],accsq_det[VDIF_NCHAN][4], mjd[2];
-  long int idx[2],seed,iseed,pha_start_nf,len_scan_nf,len_dip_nf,pha_ct,fct,Nfm,index[2],nfm_p[2],chunksize[2],Nts,chunksize_org,nskip;
-  unsigned char *buffer[2], *obuffer[2],*chunk[2];
-  float det[VDIF_NCHAN][4],sdet[VDIF_NCHAN][4];
+  long int idx[2],iseed,pha_start_nf,Nts,chunksize,nskip;
+  const unsigned char *fr[2];
+  struct vdifmap *vm[2];
+  float sdet[VDIF_NCHAN][4];
   time_t t;
-  fftwf_complex *out_p0,*out_p1;
-  fftwf_plan pl0,pl1;
+  struct detpipe *dp;
+  struct detjob *job;
+  struct alma_asm aasm;
+  struct psrwriter *pw;
+  struct ewstat *qes;
   int64_t offset_pre[2],offset[2];
   uint32_t fps,inval,inval_sub;
   
   freq=0.0;
-  s_stat=0.0;
+  s_stat=1.0;
   tsf=1;
   s_skip=0.0;
   strcpy(srcname,"J0835-4510");
   dstat='C';
   npol=4;
   nthd=1;
+  nwork=1;
+  flush_sec=10.0;
+  nbits=32;
+  dsf[0]=1;
+  dsf[1]=1;
+  ifrun=false;
   inval=0;
   ifverbose = false;
   ifout = false;
-  chunksize_org=1000000000;
+  chunksize=256000000;
   for(i=0;i<2;i++) {
     ifpol[i] = false;
-    chkend[i]=false;
     pend[i]=false;
-    chunksize[i]=chunksize_org;
   }
   pch=0;
   pha_start=0.0;
@@ -127,7 +282,7 @@ int main(int argc, char *argv[])
     }
   
   // Read arguments
-  while ((arg=getopt(argc,argv,"hf:i:j:s:n:k:t:O:S:D:r:c:d:Pp:Mv")) != -1)
+  while ((arg=getopt(argc,argv,"hf:i:j:s:n:k:t:O:S:D:r:c:d:w:ePp:MF:B:Rm:g:v")) != -1)
 	{
 	  switch(arg)
 		{
@@ -190,6 +345,26 @@ int main(int argc, char *argv[])
 		case 'M':
 		  pch=2;
 		  break;
+
+		case 'F':
+		  flush_sec=atof(optarg);
+		  break;
+
+		case 'B':
+		  nbits=atoi(optarg);
+		  break;
+
+		case 'R':
+		  ifrun=true;
+		  break;
+
+		case 'm':
+		  dsf[0]=atoi(optarg);
+		  break;
+
+		case 'g':
+		  dsf[1]=atoi(optarg);
+		  break;
 		  
 		case 'p':
 		  pha_start=atof(optarg);
@@ -199,6 +374,14 @@ int main(int argc, char *argv[])
 		  nthd=atoi(optarg);
 		  break;
 
+		case 'w':
+		  nwork=atoi(optarg);
+		  break;
+
+		case 'e':
+		  fftwisdom_patient(1);
+		  break;
+
 		case 'O':
 		  strcpy(oroute,optarg);
 		  ifout=true;
@@ -244,6 +427,11 @@ int main(int argc, char *argv[])
 	  fprintf(stderr,"No output route specified.\n");
 	  exit(0);
 	}
+  if(nbits!=32 && nbits!=8 && nbits!=4)
+	{
+	  fprintf(stderr,"Invalid number of bits per output sample.\n");
+	  exit(0);
+	}
   if(bs!=-1 && bs!=1)
 	{
 	  fprintf(stderr,"Not readable band sense.\n");
@@ -258,7 +446,6 @@ int main(int argc, char *argv[])
   // Get seed for random generator
   time(&t);
   iseed=0-t;
-  seed=iseed;
 
   // Read the first header of vdif pol0
   vdif[0]=fopen(vname[0],"rb");
@@ -276,24 +463,31 @@ int main(int argc, char *argv[])
   //Frame per second
   fps=1000000*VDIF_BIT/8*2*VDIF_BW/fbytes;
   
-  // Calculate how many frames to get statistics
+  // Calculate how many frames the running statistics average over
   nf_stat=s_stat*1.0e6/spf;
 
-  //Calculate number of frames in one read chunk
-  Nfm=chunksize_org/(fbytes+VDIF_HEADER_BYTES);
-  printf("Number of frame per reading chunk: %ld\n",Nfm);
-
   // Calculate how many frames to skip from the beginning
   nf_skip=s_skip*1.0e6/spf;
   printf("Number of frames to skip from the beginning: %i.\n",nf_skip);
     
-  // Prepare FFT
+  // Assembler state, shared by the statistics scan and the main loop
+  aasm.pf=&pf;
+  aasm.nchan=VDIF_NCHAN;
+  aasm.npol=npol;
+  aasm.tsf=tsf;
+  aasm.pch=pch;
+  aasm.iseed=iseed;
+  aasm.seed=iseed;
+  aasm.sdet=sdet;
+  aasm.mean_det=mean_det;
+  aasm.rms_det=rms_det;
+  aasm.acc_det=acc_det;
+  aasm.accsq_det=accsq_det;
+  aasm.es=ewstat_create(VDIF_NCHAN*4,nf_stat);
+
+  // Prepare FFT, one set of plans per detection worker
   Nts = fbytes*4/VDIF_NCHAN;
-  in_p0 = (float *) malloc(sizeof(float)*Nts);
-  in_p1 = (float *) malloc(sizeof(float)*Nts);
-  out_p0 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(Nts/2+1));
-  out_p1 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(Nts/2+1));
-  fprintf(stdout,"Determining FFT plan...length %d...",Nts);
+  fprintf(stdout,"Determining FFT plan...length %d, %d worker(s)...",Nts,nwork);
   if(nthd > 1) {
     i=fftwf_init_threads();
     if(!i) {
@@ -302,32 +496,19 @@ int main(int argc, char *argv[])
     }
     fftwf_plan_with_nthreads(nthd);
   }
-  pl0 = fftwf_plan_dft_r2c_1d(Nts, in_p0, out_p0, FFTW_MEASURE);
-  pl1 = fftwf_plan_dft_r2c_1d(Nts, in_p1, out_p1, FFTW_MEASURE);
-  if (pl0 != NULL && pl1 != NULL)
-    fprintf(stdout,"Done.\n");
-  else
-    {
-      fprintf(stderr,"Error in creating FFT plan.\n");
-      exit(0);
-    }
-  
-  // Allocate memo for frames
-  for(j=0;j<2;j++)
-	{
-	  buffer[j]=malloc(sizeof(unsigned char)*fbytes);
-	  obuffer[j]=malloc(sizeof(unsigned char)*fbytes*4);
-	}
+  fftwisdom_load("vdif32chan",Nts,nthd);
+  dp=detpipe_create(nwork,4*nwork,fbytes,VDIF_NCHAN,VDIF_NCHAN,dstat,alma_seed_assemble,&aasm);
+  fftwisdom_save("vdif32chan",Nts,nthd);
+  fprintf(stdout,"Done.\n");
   
-  // Scan the beginning specified length of data, choose valid frames to get mean of total value in each frame
-  fprintf(stderr,"Scan %.2f s data to get statistics, after skipping the first %.2f data...\n",s_stat,s_skip);
+  // Seed the running statistics with valid frames read ahead, so that early gaps can be filled
   for(j=0;j<4;j++)
 	for(k=0;k<VDIF_NCHAN;k++)
 	  {
 	    acc_det[k][j]=0.0;
 	    accsq_det[k][j]=0.0;
 	  }
-  fct=0;	  
+  aasm.fct=0;
   for(j=0;j<2;j++)
 	{
 	  vdif[j]=fopen(vname[j],"rb");
@@ -335,28 +516,24 @@ int main(int argc, char *argv[])
 	  // Skip the first given length of data
 	  fseek(vdif[j],(VDIF_HEADER_BYTES+fbytes)*nf_skip,SEEK_CUR);
 	}
-  for(i=0;i<nf_stat;i++)
+  k=0;
+  for(i=0;i<EWSTAT_LOOKAHEAD*16 && k<EWSTAT_LOOKAHEAD;i++)
     {
 	  // Read header
-	  fread(vfhdr[0],1,VDIF_HEADER_BYTES,vdif[0]);
-	  fread(vfhdr[1],1,VDIF_HEADER_BYTES,vdif[1]);
+	  if(fread(vfhdr[0],1,VDIF_HEADER_BYTES,vdif[0])!=VDIF_HEADER_BYTES || fread(vfhdr[1],1,VDIF_HEADER_BYTES,vdif[1])!=VDIF_HEADER_BYTES)
+		break;
 		  
 	  // Valid frame for both pols
 	  if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[0],fbytes+VDIF_HEADER_BYTES) && !getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[1],fbytes+VDIF_HEADER_BYTES))
 		{
 		  // Read data in frame
-		  fread(buffer[0],1,fbytes,vdif[0]);
-		  fread(buffer[1],1,fbytes,vdif[1]);
+		  job=detpipe_slot(dp);
+		  fread(job->buf[0],1,fbytes,vdif[0]);
+		  fread(job->buf[1],1,fbytes,vdif[1]);
 		  
-		  // Accumulate values for detection mean
-		  getVDIFFrameDetection_32chan(buffer[0],buffer[1],fbytes,det,dstat,in_p0,in_p1,out_p0,out_p1,pl0,pl1);
-		  for(j=0;j<VDIF_NCHAN;j++)
-			for(p=0;p<4;p++)
-			  {
-				acc_det[j][p]+=(double)det[j][p];
-				accsq_det[j][p]+=pow((double)det[j][p],2.0);
-			  }
-		  fct++;
+		  // Update running statistics, in alma_seed_assemble
+		  detpipe_submit(dp,DETJOB_DETECT);
+		  k++;
 		}
 	  // Invalid frame
 	  else
@@ -367,13 +544,16 @@ int main(int argc, char *argv[])
 	}
   fclose(vdif[0]);
   fclose(vdif[1]);
+  detpipe_drain(dp);
+  if(k==0)
+	fprintf(stderr,"No valid frame ahead to seed the statistics, early invalid frames are filled with zero.\n");
 
   // Initialize patching param.
   for(j=0;j<VDIF_NCHAN;j++)
 	for(p=0;p<4;p++)
 	  {
-		mean_det[j][p]=acc_det[j][p]/(double)fct;
-		rms_det[j][p]=sqrt(accsq_det[j][p]/fct-pow(mean_det[j][p],2.0));
+		mean_det[j][p]=ewstat_mean(aasm.es,j*4+p);
+		rms_det[j][p]=ewstat_rms(aasm.es,j*4+p);
 		if(ifverbose)
 		  fprintf(stderr,"Mean & rms det chan%i, pol%i: %lf %lf\n",j,p,mean_det[j][p],rms_det[j][p]);
 	  }
@@ -427,11 +607,14 @@ int main(int argc, char *argv[])
   mjd2date(mjd[0],ut);
   printf("Starting time synchronized. Start UT of VDIF: %s\n",ut);
 
-  // Set starting position for reading
+  // Set starting position for reading, data are read in place from mapped files
   for(j=0;j<2;j++)
     {
       fseek(vdif[j],-VDIF_HEADER_BYTES,SEEK_CUR);
       offset_pre[j]=-1;
+      vm[j]=vdifmap_open(vname[j],chunksize);
+      vdifmap_seek(vm[j],ftell(vdif[j]));
+      fclose(vdif[j]);
     }
 
   // Set psrfits main header
@@ -482,7 +665,7 @@ int main(int argc, char *argv[])
   pf.hdr.offset_subint = 0;
   pf.hdr.orig_nchan = pf.hdr.nchan;
   pf.hdr.orig_df = pf.hdr.df = pf.hdr.BW / pf.hdr.nchan;
-  pf.hdr.nbits = 32;
+  pf.hdr.nbits = nbits;
   pf.hdr.npol = npol;
   pf.hdr.chan_dm = 0.0;
   pf.hdr.fd_hand = 1;
@@ -490,9 +673,15 @@ int main(int argc, char *argv[])
   pf.hdr.fd_xyph = 0;
   pf.hdr.be_phase = 1;
   pf.hdr.nsblk = 8192;
-  pf.hdr.ds_time_fact = 1;
-  pf.hdr.ds_freq_fact = 1;
+  pf.hdr.ds_time_fact = dsf[0];
+  pf.hdr.ds_freq_fact = dsf[1];
   sprintf(pf.basefilename, "%s/%s",oroute,ut);
+
+  if(pf.hdr.ds_time_fact<1 || pf.hdr.ds_freq_fact<1 || pf.hdr.nsblk%pf.hdr.ds_time_fact!=0 || pf.hdr.nchan%pf.hdr.ds_freq_fact!=0)
+	{
+	  fprintf(stderr,"Error: Downsampling factors must divide %d samples per subint and %d channels.\n",pf.hdr.nsblk,pf.hdr.nchan);
+	  exit(0);
+	}
   
   psrfits_create(&pf);
   
@@ -526,15 +715,31 @@ int main(int argc, char *argv[])
 	  pf.sub.dat_offsets[i] = 0.0;
 	  pf.sub.dat_scales[i] = 1.0;
 	}
+
+  // Channel frequencies and arrays of the downsampled output
+  guppi_update_ds_params(&pf);
   
-  pf.sub.rawdata = (unsigned char *)malloc(pf.sub.bytes_per_subint);
+  pf.sub.rawdata = (unsigned char *)malloc(psrwriter_bytes(&pf));
+
+  // Downsampled or 8 or 4-bit output, detections are reworked from floats
+  pf.sub.fdata = NULL;
+  qes = NULL;
+  if(nbits!=32 || pf.hdr.ds_time_fact>1 || pf.hdr.ds_freq_fact>1)
+	{
+	  pf.sub.fdata = (float *)malloc(sizeof(float) * pf.hdr.nchan * pf.hdr.npol * pf.hdr.nsblk);
+	  if(ifrun)
+		qes=ewstat_create(pf.hdr.nchan / pf.hdr.ds_freq_fact * pf.hdr.npol, s_stat / pf.sub.tsubint);
+	}
+
+  // Subints are written by their own thread, triple buffered
+  pw=psrwriter_start(&pf,3,0,flush_sec,0);
 
   // Initialize param. for patching
   pha_start_nf = lround(pha_start * (len_scan + len_dip) / (pf.hdr.dt/tsf) );
-  len_scan_nf = len_scan / (pf.hdr.dt/tsf);
-  len_dip_nf = len_dip / (pf.hdr.dt/tsf);
-  pha_ct = pha_start_nf;
-  fct=0;
+  aasm.len_scan_nf = len_scan / (pf.hdr.dt/tsf);
+  aasm.len_dip_nf = len_dip / (pf.hdr.dt/tsf);
+  aasm.pha_ct = pha_start_nf;
+  aasm.fct=0;
   for(j=0;j<4;j++)
 	for(k=0;k<VDIF_NCHAN;k++)
 	  {
@@ -542,35 +747,29 @@ int main(int argc, char *argv[])
 		accsq_det[k][j]=0.0;
 	  }
   
+  // Detections from now on go to the subint assembler
+  detpipe_set_assembler(dp,alma_assemble,&aasm);
+
   fprintf(stdout,"Header prepared. Start to write data...\n");
 
-  // First read of data chunk
-  for(i=0;i<2;i++)
-    {
-      chunk[i] = (unsigned char *)malloc(chunksize[i]+fbytes+VDIF_HEADER_BYTES);
-      nread[i] = fread(chunk[i],1,chunksize[i],vdif[i]);
-      index[i] = 0;
-      nfm_p[i] = Nfm;
-    }
-  
   // Main loop to write subints
   do
 	{
 	  inval_sub = 0;
-	  memset(pf.sub.rawdata,0,sizeof(unsigned char)*pf.sub.bytes_per_subint);
+	  if(pf.sub.fdata==NULL)
+		memset(pf.sub.rawdata,0,sizeof(unsigned char)*pf.sub.bytes_per_subint);
+	  else
+		memset(pf.sub.fdata,0,sizeof(float)*pf.hdr.nchan*pf.hdr.npol*pf.hdr.nsblk);
 
 	  // Fill time samples in each subint: pf.sub.rawdata
 	  for(i=0;i<pf.hdr.nsblk;i++)
 		{
-		  // Initialize detection block
-		  for(k=0;k<VDIF_NCHAN;k++)
-			{
-			  for(p=0;p<npol;p++)
-			    sdet[k][p]=0.0;
-			} 
 		  // Accumulate frame detections
 		  for(k=0;k<tsf;k++)
 			{
+			  // Get a free slot of the detection pipeline
+			  job=detpipe_slot(dp);
+
 			  // Consecutive check on both pols
 			  for(j=0;j<2;j++)
 			    {
@@ -578,33 +777,18 @@ int main(int argc, char *argv[])
 
 			      // Get real frame header while dealing with non-integer gaps in between frames
 			      for(;;) {
-				// Not enough data in chunk to fill header
-				if(index[j] + VDIF_HEADER_BYTES > chunksize[j])
+				fr[j]=vdifmap_get(vm[j],VDIF_HEADER_BYTES);
+				// Not enough data left to fill header
+				if(fr[j]==NULL)
 				  {
-				    if(ifverbose)
-				      fprintf(stdout,"Pol %i read new chunk.\n",j);
-				    // Reset data chunk: Move leftover to the beginning and read in another chunk
-				    memmove(chunk[j],chunk[j]+index[j],chunksize[j]-index[j]);
-				    if(!chkend[j])
-				      nread[j]=fread(chunk[j]+chunksize[j]-index[j],1,chunksize_org, vdif[j]);
-				    else
-				      {
-					pend[j]=true;
-					break;
-				      }
-				    if(nread[j]<chunksize_org)
-				      chkend[j]=true;
-				    
-				    // New data chunk size and index
-				    chunksize[j] = nread[j] + chunksize[j]-index[j];
-				    index[j]=0;
+				    pend[j]=true;
+				    break;
 				  }
-				memcpy(vfhdr[j],chunk[j]+index[j],VDIF_HEADER_BYTES);
-				if (getVDIFFrameBytes((const vdif_header *)vfhdr[j]) == fbytes+VDIF_HEADER_BYTES)
+				if (getVDIFFrameBytes((const vdif_header *)fr[j]) == fbytes+VDIF_HEADER_BYTES)
 				  break;
 				else
 				  {
-				    index[j]++;
+				    vdifmap_skip(vm[j],1);
 				    nskip++;
 				  }
 			      }
@@ -618,10 +802,10 @@ int main(int argc, char *argv[])
 			      pval[j] = true;
 
 			      // Get frame offset
-			      offset[j]=getVDIFFrameOffset((const vdif_header *)vfhdrst, (const vdif_header *)vfhdr[j], fps);
+			      offset[j]=getVDIFFrameOffset((const vdif_header *)vfhdrst, (const vdif_header *)fr[j], fps);
 
 			      // Valid frame and Gap from the last frames
-			      if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[j],fbytes+VDIF_HEADER_BYTES) && offset[j] > offset_pre[j]+1)
+			      if(!getVDIFFrameInvalid_robust((const vdif_header *)fr[j],fbytes+VDIF_HEADER_BYTES) && offset[j] > offset_pre[j]+1)
 				{
 				  if(ifverbose)
 				    fprintf(stderr,"Pol%i: Current frame (%Ld) not consecutive from previous (%Ld).\n",j,offset[j],offset_pre[j]);
@@ -630,32 +814,18 @@ int main(int argc, char *argv[])
 				}
 			      else // Consecutive
 				{
-				  // Not enough data in chunk to fill in frame
-				  if(index[j] + VDIF_HEADER_BYTES + fbytes > chunksize[j])
+				  // Frame in place, not enough data left to fill in frame
+				  fr[j]=vdifmap_get(vm[j],VDIF_HEADER_BYTES+fbytes);
+				  if(fr[j]==NULL)
 				    {
-				      if(ifverbose)
-					fprintf(stdout,"Pol %i read new chunk.\n",j);
-				      // Reset data chunk: Move leftover to the beginning and read in another chunk
-				      memmove(chunk[j],chunk[j]+index[j],chunksize[j]-index[j]);
-				      if(!chkend[j])
-					nread[j]=fread(chunk[j]+chunksize[j]-index[j],1,chunksize_org, vdif[j]);
-				      else
-					{
-					  pend[j]=true;
-					  break;
-					}
-				      if(nread[j]<chunksize_org)
-					chkend[j]=true;
-				      
-				      // New data chunk size and index
-				      chunksize[j] = nread[j] + chunksize[j]-index[j];
-				      index[j]=0;
+				      pend[j]=true;
+				      break;
 				    }
 
 				  // Get data
-				  memcpy(buffer[j],chunk[j] + index[j] + VDIF_HEADER_BYTES,fbytes);
+				  job->src[j]=fr[j]+VDIF_HEADER_BYTES;
 				  offset_pre[j]++;
-				  index[j]+=fbytes+VDIF_HEADER_BYTES;
+				  vdifmap_skip(vm[j],VDIF_HEADER_BYTES+fbytes);
 				}
 			    }
 
@@ -666,155 +836,69 @@ int main(int argc, char *argv[])
 			  if(pval[0] == true && pval[1] == true) 
 			    {
 			      // Valid frame
-			      if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[0],fbytes+VDIF_HEADER_BYTES) && !getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[1],fbytes+VDIF_HEADER_BYTES))
+			      if(!getVDIFFrameInvalid_robust((const vdif_header *)fr[0],fbytes+VDIF_HEADER_BYTES) && !getVDIFFrameInvalid_robust((const vdif_header *)fr[1],fbytes+VDIF_HEADER_BYTES))
 				{
-				  getVDIFFrameDetection_32chan(buffer[0],buffer[1],fbytes,det,dstat,in_p0,in_p1,out_p0,out_p1,pl0,pl1);
-
-				  // Subscan phase
-				  if(pha_ct < len_scan_nf)
-				    {
-				      // Accumulate values for detection (running) mean
-				      for(j=0;j<VDIF_NCHAN;j++)
-					for(p=0;p<4;p++)
-					  {
-					    acc_det[j][p]+=(double)det[j][p];
-					    accsq_det[j][p]+=pow((double)det[j][p],2.0);
-					  }
-				      fct++;
-				    }
-				  else // Dip phase
-				    {
-				      // Update patching param, when entering dip phase
-				      if(pha_ct == len_scan_nf)
-					{
-					  // Update detection mean
-					  for(j=0;j<VDIF_NCHAN;j++)
-					    for(p=0;p<4;p++)
-					      {
-						if(acc_det[j][p]!=0.0)
-						  {
-						    mean_det[j][p]=acc_det[j][p]/(double)fct;
-						    rms_det[j][p]=sqrt(accsq_det[j][p]/(double)fct-pow(mean_det[j][p],2.0));
-						  }
-
-						// Reset accumulation
-						acc_det[j][p]=0.0;
-						accsq_det[j][p]=0.0;
-					      }
-					  fct=0;
-					}
-				      // Patch detection with mean+rms
-				      if(pch == 1)
-					{
-					  for(j=0;j<VDIF_NCHAN;j++)
-					    for(p=0;p<4;p++)
-					      det[j][p]=mean_det[j][p]+rms_det[j][p]*gasdev(&seed);
-					}
-				      else if(pch == 2)
-					{
-					    // Patch fake detection from mean
-					  for(j=0;j<VDIF_NCHAN;j++)
-					    for(p=0;p<4;p++)
-					      det[j][p]=mean_det[j][p];
-					}
-				    }
+				  // Detection, with power dip patching done in alma_assemble
+				  kind=DETJOB_DETECT;
 				}
 			      else // Invalid frame 
 				{
-				  // Create fake detection with measured mean
+				  // Create fake detection from running statistics
 				  if(ifverbose)
-				    fprintf(stderr,"Invalid frame detected in file %d subint %d (%f sec). Fake detection with measured mean.\n", pf.filenum, pf.tot_rows, pf.T);
-				  for(j=0;j<VDIF_NCHAN;j++)
-				    for(p=0;p<4;p++)
-				      det[j][p]=mean_det[j][p];
+				    fprintf(stderr,"Invalid frame detected in file %d subint %d (%f sec). Fake detection from running statistics.\n", pf.filenum, pf.tot_rows, pf.T);
+				  kind=DETJOB_SKIP;
 				  inval++; inval_sub++;
 				}
 			    }
 			  // One pol not consecutive
 			  else 
 			    {
-			      // Create fake detection with measured mean
+			      // Create fake detection from running statistics
 			      if(ifverbose)
-				fprintf(stderr,"Gap in frame count detected in file %d subint %d (%f sec). Fake detection with measured mean.\n", pf.filenum, pf.tot_rows, pf.T);
-			      for(j=0;j<VDIF_NCHAN;j++)
-				for(p=0;p<4;p++)
-				  det[j][p]=mean_det[j][p];
+				fprintf(stderr,"Gap in frame count detected in file %d subint %d (%f sec). Fake detection from running statistics.\n", pf.filenum, pf.tot_rows, pf.T);
+			      kind=DETJOB_SKIP;
 			      inval++; inval_sub++;
 			    }
-			
-			  // Accumulate detection value
-			  for(j=0;j<VDIF_NCHAN;j++)
-			    {
-			      for(p=0;p<npol;p++)
-				sdet[j][p]+=det[j][p];
-			    }
-
-			  // Update phase counters
-			  pha_ct++;
-				  
-			  // Reset phase and counter
-			  if(pha_ct == (len_scan_nf + len_dip_nf))
-				{
-				  pha_ct = 0;
 
-				  // Start another sequence for ran
-				  iseed=iseed-2;
-				  seed=iseed;
-				}
+			  // Hand over to the detection workers, samples are assembled in frame order by alma_assemble
+			  detpipe_submit(dp,kind);
 			}
 		
 		  // Break when not enough frames to get a sample
 		  if(k!=tsf) break;
-		  
-		  // Write detections in pf.sub.rawdata, in 32-bit float and FPT order (freq, pol, time)
-		  for(j=0;j<VDIF_NCHAN;j++)
-			{
-			  if (npol == 4)
-				{
-				  memcpy(pf.sub.rawdata+i*sizeof(float)*4*VDIF_NCHAN+sizeof(float)*j,&sdet[j][0],sizeof(float));
-				  memcpy(pf.sub.rawdata+i*sizeof(float)*4*VDIF_NCHAN+sizeof(float)*VDIF_NCHAN*1+sizeof(float)*j,&sdet[j][1],sizeof(float));
-				  memcpy(pf.sub.rawdata+i*sizeof(float)*4*VDIF_NCHAN+sizeof(float)*VDIF_NCHAN*2+sizeof(float)*j,&sdet[j][2],sizeof(float));
-				  memcpy(pf.sub.rawdata+i*sizeof(float)*4*VDIF_NCHAN+sizeof(float)*VDIF_NCHAN*3+sizeof(float)*j,&sdet[j][3],sizeof(float));
-				}
-			  else if (npol == 2)
-				{
-                  memcpy(pf.sub.rawdata+i*sizeof(float)*2*VDIF_NCHAN+sizeof(float)*j,&sdet[j][0],sizeof(float));
-				  memcpy(pf.sub.rawdata+i*sizeof(float)*2*VDIF_NCHAN+sizeof(float)*VDIF_NCHAN*1+sizeof(float)*j,&sdet[j][1],sizeof(float));
-				}
-			  else if (npol == 1)
-				{
-				  memcpy(pf.sub.rawdata+i*sizeof(float)*1*VDIF_NCHAN+sizeof(float)*j,&sdet[j][0],sizeof(float));
-				}
-			}
 		}
 
+	  // Wait for all detections of the subint
+	  detpipe_drain(dp);
+
 	  // Update offset from Start of subint
 	  pf.sub.offs = (pf.tot_rows + 0.5) * pf.sub.tsubint;
 
-	  // Write subint
-	  psrfits_write_subint(&pf);
+	  // Downsample or requantise, and write subint
+	  if(pf.sub.fdata!=NULL)
+		pf_fdata_to_rawdata(&pf,qes);
+	  psrwriter_put(pw);
 	  fprintf(stdout,"Subint written: %d. Faked samples: %lu out of %lu.\n",pf.tot_rows,inval_sub,pf.hdr.nsblk);
 	  
 	  // Break when subint is not complete
 	  if(k!=tsf || i!=pf.hdr.nsblk) break;
 
-	} while(!feof(vdif[0]) && !feof(vdif[1]) && !pf.status && pf.T < pf.hdr.scanlen);
+	} while(!pend[0] && !pend[1] && !pf.status && pf.T < pf.hdr.scanlen);
  	
   // Close the last file and cleanup
-  fits_close_file(pf.fptr, &(pf.status));
+  psrwriter_finish(pw);
   free(pf.sub.dat_freqs);
   free(pf.sub.dat_weights);
   free(pf.sub.dat_offsets);
   free(pf.sub.dat_scales);
   free(pf.sub.rawdata);
-  free(buffer[0]);
-  free(buffer[1]);
-  fclose(vdif[0]);
-  fclose(vdif[1]);
-  fftwf_free(out_p0);
-  fftwf_free(out_p1);
-  fftwf_destroy_plan(pl0);
-  fftwf_destroy_plan(pl1);
+  free(pf.sub.fdata);
+  if(qes!=NULL)
+    ewstat_destroy(qes);
+  vdifmap_close(vm[0]);
+  vdifmap_close(vm[1]);
+  detpipe_destroy(dp);
+  ewstat_destroy(aasm.es);
   if(nthd>1)
     fftwf_cleanup_threads();
 
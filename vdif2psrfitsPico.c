@@ -2,6 +2,7 @@
 //Input vdif configuration is 2-bit real-sampled, 2048 MHz bandwdith, one frequency channel, two pols in separated files
 //Sampling interval 1/2048/2 microsecond
 //One frame 8192 bytes, thus 8 microsecond per frame (one frame contains only one pol)
+//With -U the frames are received live over UDP instead of read from files
 
 
 #define VDIF_HEADER_BYTES       32
@@ -13,10 +14,17 @@
 #include <string.h>
 #include <time.h>
 #include <malloc.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include "vdifio.h"
 #include "vdif2psrfits.h"
 #include "psrfits.h"
 #include "dec2hms.h"
+#include "det_pipeline.h"
+#include "psrwriter.h"
+#include "vdifmap.h"
+#include "vdifstat.h"
+#include "vdifcap.h"
 #include <fftw3.h>
 #include <stdbool.h>
 
@@ -31,8 +39,13 @@ void usage(char *prg_name)
 	  " -f   Observing central frequency (MHz)\n"
           " -i   Input vdif pol0\n"
 	  " -j   Input vdif pol1\n"
+	  " -U   Receive VDIF over UDP instead of -i and -j: [address:]port of pol0,pol1, or of both pols told apart by thread ID\n"
+	  " -T   Thread IDs of pol0,pol1 on a single port (by default 0,1)\n"
+	  " -M   Socket receive buffer per port (MB, by default 256)\n"
+	  " -W   Seconds without frames that end the capture (by default 5)\n"
+	  " -L   Longest wait for a missing frame (ms, by default 50)\n"
 	  " -b   Band sense (-1 for lower-side, 1 for upper-side, by default 1)\n"
-	  " -s   Seconds to get statistics to fill in invalid frames\n"
+	  " -s   Seconds of data the running statistics to fill in invalid frames average over (by default 1)\n"
 	  " -t   Time sample scrunch factor (by default 1). One time sample 8 microsecond\n"
 	  " -S   Name of the source (by default J0835-4510)\n"
           " -r   RA of the source (AA:BB:CC.DD)\n"
@@ -40,6 +53,15 @@ void usage(char *prg_name)
 	  " -D   Ouput data status (I for Stokes I, C for coherence product, X for pol0 I, Y for pol1 I, S for Stokes, P for polarised signal, S for stokes, by default C)\n"
 	  " -n   Number of channels kept (Power of 2 up to 4096, by default 1)\n"
 	  " -d   Number of thread to use in FFT (by default 1)\n"
+	  " -w   Number of worker threads for detection and statistics (by default 1)\n"
+	  " -e   Plan FFT with FFTW_PATIENT, slow but the wisdom is cached for later runs\n"
+	  " -z   Fill invalid frames with noise of the running rms (1) or with the running mean only (0, by default)\n"
+	  " -P   Convert part k of N of the scan (k/N, k from 0), or all N parts in parallel processes (N)\n"
+	  " -m   Average so many output time samples together (by default 1)\n"
+	  " -g   Average so many adjacent channels together (by default 1)\n"
+	  " -B   Bits per output sample, 32 (float), 8 or 4 (by default 32)\n"
+	  " -R   Scale 8 or 4-bit output with the running statistics over -s seconds instead of those of each subint\n"
+	  " -F   Seconds between flushes of the output file to disk, 0 for every subint (by default 10)\n"
 	  " -v   Verbose\n"
 	  " -O   Route of the output file \n"
 	  " -h   Available options\n",
@@ -47,68 +69,216 @@ void usage(char *prg_name)
   exit(0);
 }
 
-// get offset VDIF frame from beginning
-int64_t getVDIFFrameOffset(const vdif_header *headerst, const vdif_header *header, uint32_t fps)
+// Move to the first valid frame at least target frames after headerst, the first frame of data being at pos0.
+// Returns the offset of that frame, or -1 if data end before.
+int64_t seekVDIFFrameOffset(struct vdifmap *vm, off_t pos0, const vdif_header *headerst, int64_t target, int fbytes, uint32_t fps)
 {
-  uint32_t day[2],sec[2],num[2];
-  int64_t offset;
+  off_t fsize;
+  int64_t n,off;
+  const unsigned char *fr;
 
-  // Get epoch                                                                                 
-  day[0]=getVDIFFrameMJD(headerst);
-  day[1]=getVDIFFrameMJD(header);
+  fsize=fbytes+VDIF_HEADER_BYTES;
 
-  // Get second after epoch 
-  sec[0]=getVDIFFrameSecond(headerst);
-  sec[1]=getVDIFFrameSecond(header);
+  // Guess the position as if no frame were missing, then step back over missing frames
+  n=target;
+  if(pos0+(n+1)*fsize > vm->fsize)
+    n=(vm->fsize-pos0)/fsize-1;
+  while(n>0)
+    {
+      vdifmap_seek(vm,pos0+n*fsize);
+      fr=vdifmap_get(vm,fsize);
+      if(getVDIFFrameInvalid_robust((const vdif_header *)fr,fsize))
+	{
+	  n--;
+	  continue;
+	}
+      off=getVDIFFrameOffset(headerst,(const vdif_header *)fr,fps);
+      if(off<=target)
+	break;
+      n-=off-target;
+    }
+  if(n<0)
+    n=0;
 
-  // Get number of frame after second   
-  num[0]=getVDIFFrameNumber(headerst);
-  num[1]=getVDIFFrameNumber(header);
+  // Go forward to the target
+  vdifmap_seek(vm,pos0+n*fsize);
+  while((fr=vdifmap_get(vm,fsize))!=NULL)
+    {
+      if(!getVDIFFrameInvalid_robust((const vdif_header *)fr,fsize))
+	{
+	  off=getVDIFFrameOffset(headerst,(const vdif_header *)fr,fps);
+	  if(off>=target)
+	    return off;
+	}
+      vdifmap_skip(vm,fsize);
+    }
+
+  return -1;
+}
 
-  offset=(day[1]-day[0])*86400*fps+(sec[1]-sec[0])*fps+(num[1]-num[0]);
+// State of the in-order subint assembler
+struct pico_asm {
+  struct psrfits *pf;
+  int nchan;
+  int npol;
+  int tsf;
+  float (*sdet)[4];
+  struct ewstat *es;
+  int noise;
+  long int seed;
+};
+
+float gasdev(long *idum);
+
+// Seed the running detection statistics with frames read ahead
+static void pico_seed_assemble(void *arg, const struct detjob *job)
+{
+  struct pico_asm *a = (struct pico_asm *)arg;
 
-  return offset;
+  ewstat_update(a->es,&job->det[0][0]);
+}
+
+// Accumulate frame detections to time samples and write them in pf.sub.rawdata,
+// or in pf.sub.fdata to be downsampled or requantised
+static void pico_assemble(void *arg, const struct detjob *job)
+{
+  struct pico_asm *a = (struct pico_asm *)arg;
+  unsigned char *dst;
+  int i,j,k,nchan;
+
+  nchan=a->nchan;
+
+  // Valid frame, update running statistics
+  if(job->kind==DETJOB_DETECT)
+    ewstat_update(a->es,&job->det[0][0]);
+  // Invalid frame or gap, fake detection from running statistics
+  else
+    for(j=0;j<nchan;j++)
+      for(k=0;k<4;k++)
+	{
+	  job->det[j][k]=ewstat_mean(a->es,j*4+k);
+	  if(a->noise)
+	    job->det[j][k]+=ewstat_rms(a->es,j*4+k)*gasdev(&a->seed);
+	}
+
+  // Frame within the time sample and time sample within the subint
+  k=job->seq%a->tsf;
+  i=(job->seq/a->tsf)%a->pf->hdr.nsblk;
+
+  // Initialize sample block
+  if(k==0)
+    for(j=0;j<nchan;j++)
+      {
+	a->sdet[j][0]=0.0;
+	a->sdet[j][1]=0.0;
+	a->sdet[j][2]=0.0;
+	a->sdet[j][3]=0.0;
+      }
+
+  // Accumulate detection
+  for(j=0;j<nchan;j++)
+    {
+      a->sdet[j][0]+=job->det[j][0];
+      a->sdet[j][1]+=job->det[j][1];
+      a->sdet[j][2]+=job->det[j][2];
+      a->sdet[j][3]+=job->det[j][3];
+    }
+
+  // Sample not complete yet
+  if(k!=a->tsf-1) return;
+
+  // Write detections in 32-bit float and FPT order (freq, pol, time)
+  dst=(a->pf->sub.fdata==NULL) ? a->pf->sub.rawdata : (unsigned char *)a->pf->sub.fdata;
+  for(j=0;j<nchan;j++)
+    {
+      if (a->npol == 4)
+	{
+	  memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*j,&a->sdet[j][0],sizeof(float));
+	  memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*1+sizeof(float)*j,&a->sdet[j][1],sizeof(float));
+	  memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*2+sizeof(float)*j,&a->sdet[j][2],sizeof(float));
+	  memcpy(dst+i*sizeof(float)*4*nchan+sizeof(float)*nchan*3+sizeof(float)*j,&a->sdet[j][3],sizeof(float));
+	}
+      else if (a->npol == 2)
+	{
+	  memcpy(dst+i*sizeof(float)*2*nchan+sizeof(float)*j,&a->sdet[j][0],sizeof(float));
+	  memcpy(dst+i*sizeof(float)*2*nchan+sizeof(float)*nchan*1+sizeof(float)*j,&a->sdet[j][1],sizeof(float));
+	}
+      else if (a->npol == 1)
+	{
+	  memcpy(dst+i*sizeof(float)*1*nchan+sizeof(float)*j,&a->sdet[j][0],sizeof(float));
+	}
+    }
 }
 
 
 int main(int argc, char *argv[])
 {
   FILE *vdif[2],*out;
-  bool pval[2], ifverbose, ifpol[2], ifout;
+  bool pval[2], ifverbose, ifpol[2], ifout, pend;
   struct psrfits pf;
   
   char vname[2][1024],oroute[1024],ut[30],dat,vfhdr[2][VDIF_HEADER_BYTES],vfhdrst[VDIF_HEADER_BYTES],srcname[16],dstat,ra[64],dec[64];
-  int arg,n_f,i,j,k,fbytes,vd[2],nf_stat,ct,tsf,dati,nchan,npol,bs,Nts,nthd,nread[2],nf_skip;
-  float freq,s_stat,fmean[2][2], *in_p0, *in_p1,s_skip;
+  int arg,n_f,i,j,k,fbytes,vd[2],nf_stat,tsf,nchan,npol,bs,Nts,nthd,nwork,nnoise,kind,nahead;
+  int ishard,nshard,nfile,file0,file1,st;
+  int nbits,dsf[2];
+  int naddr,tids[2],rcvbuf,got;
+  char caddr[2][64];
+  float idle,latency;
+  struct vdifcap *cap;
+  bool ifrun, live;
+  float freq,s_stat,fmean[2][2],flush_sec;
   double mjd[2];
-  long int idx[2],seed, chunksize,Nfm,ctframe[2],nfm_p[2];
-  unsigned char *buffer[2], *obuffer[2], *chunk[2];
+  long int idx[2],seed, chunksize;
+  const unsigned char *fr[2];
+  struct vdifmap *vm[2];
   time_t t;
-  double mean[4],sq,rms[j],spf;
-  fftwf_complex *out_p0,*out_p1;
-  fftwf_plan pl0,pl1;
-  int64_t offset_pre[2],offset[2];
+  double spf;
+  off_t pos_ahead[2];
+  struct detpipe *dp;
+  struct detjob *job;
+  struct pico_asm pasm;
+  struct psrwriter *pw;
+  struct ewstat *qes;
+  int64_t offset_pre[2],offset[2],offset_st,nf_left;
+  off_t pos0[2];
+  pid_t pid;
   uint32_t fps,inval;
 
   // Set default values
   freq=0.0;
-  s_stat=0.0;
+  s_stat=1.0;
   tsf=1;
   bs=1;
   strcpy(srcname,"J0835-4510");
   dstat='C';
   npol=4;
   nchan=1;
-  chunksize=1000000000;
+  chunksize=256000000;
   nthd=1;
+  nwork=1;
+  nnoise=0;
+  flush_sec=10.0;
+  nbits=32;
+  dsf[0]=1;
+  dsf[1]=1;
+  ifrun=false;
+  live=false;
+  tids[0]=0;
+  tids[1]=1;
+  rcvbuf=256;
+  idle=5.0;
+  latency=50.0;
+  cap=NULL;
   inval=0;
+  ishard=0;
+  nshard=1;
   ifverbose = false;
   ifout = false;
   for(i=0;i<2;i++)
     ifpol[i] = false;
 
   //Read arguments
-  while ((arg=getopt(argc,argv,"hf:i:j:b:s:t:O:S:D:n:r:c:d:v")) != -1)
+  while ((arg=getopt(argc,argv,"hf:i:j:b:s:t:O:S:D:n:r:c:d:w:ez:P:F:B:Rm:g:vU:T:M:W:L:")) != -1)
     {
       switch(arg)
 	{
@@ -167,6 +337,68 @@ int main(int argc, char *argv[])
 	case 'd':
 	  nthd=atoi(optarg);
 	  break;
+
+	case 'w':
+	  nwork=atoi(optarg);
+	  break;
+
+	case 'e':
+	  fftwisdom_patient(1);
+	  break;
+
+	case 'z':
+	  nnoise=atoi(optarg);
+	  break;
+
+	case 'F':
+	  flush_sec=atof(optarg);
+	  break;
+
+	case 'B':
+	  nbits=atoi(optarg);
+	  break;
+
+	case 'R':
+	  ifrun=true;
+	  break;
+
+	case 'm':
+	  dsf[0]=atoi(optarg);
+	  break;
+
+	case 'g':
+	  dsf[1]=atoi(optarg);
+	  break;
+
+	case 'U':
+	  naddr=sscanf(optarg,"%63[^,],%63s",caddr[0],caddr[1]);
+	  live=true;
+	  break;
+
+	case 'T':
+	  sscanf(optarg,"%d,%d",&tids[0],&tids[1]);
+	  break;
+
+	case 'M':
+	  rcvbuf=atoi(optarg);
+	  break;
+
+	case 'W':
+	  idle=atof(optarg);
+	  break;
+
+	case 'L':
+	  latency=atof(optarg);
+	  break;
+
+	case 'P':
+	  if(sscanf(optarg,"%d/%d",&ishard,&nshard)!=2)
+	    {
+	      // Only the number of parts given, run them all
+	      nshard=atoi(optarg);
+	      ishard=-1;
+	    }
+	  break;
 		  
 	case 'h':
 	  usage(argv[0]);
@@ -185,13 +417,13 @@ int main(int argc, char *argv[])
 	  exit(0);
 	}
   
-  if(ifpol[0] == false)
+  if(ifpol[0] == false && !live)
 	{
 	  fprintf(stderr,"No input file provided for pol0.\n");
 	  exit(0);
 	}
   
-  if(ifpol[1] == false)
+  if(ifpol[1] == false && !live)
 	{
 	  fprintf(stderr,"No input file provided for pol1.\n");
 	  exit(0);
@@ -209,16 +441,81 @@ int main(int argc, char *argv[])
 	  exit(0);
 	}
 
-  float det[nchan][4],sdet[nchan][4];
+  if(nbits!=32 && nbits!=8 && nbits!=4)
+	{
+	  fprintf(stderr,"Invalid number of bits per output sample.\n");
+	  exit(0);
+	}
+
+  if(nshard<1 || ishard>=nshard)
+	{
+	  fprintf(stderr,"Invalid part of the scan to convert.\n");
+	  exit(0);
+	}
+
+  if(live && (naddr<1 || nshard>1 || rcvbuf<1 || idle<=0.0 || latency<=0.0))
+	{
+	  fprintf(stderr,"Invalid capture settings, a live capture is not split in parts.\n");
+	  exit(0);
+	}
+
+  // Convert all parts, one process each
+  if(ishard<0)
+    {
+      for(i=0;i<nshard;i++)
+	{
+	  pid=fork();
+	  if(pid<0)
+	    {
+	      perror("fork");
+	      exit(1);
+	    }
+	  if(pid==0)
+	    break;
+	}
+
+      // Parent waits for the parts
+      if(i==nshard)
+	{
+	  st=0;
+	  for(i=0;i<nshard;i++)
+	    {
+	      wait(&j);
+	      if(!WIFEXITED(j) || WEXITSTATUS(j)!=0)
+		st=1;
+	    }
+	  if(st)
+	    fprintf(stderr,"Conversion of some parts of the scan failed.\n");
+	  return st;
+	}
+      ishard=i;
+    }
+
+  float sdet[nchan][4];
   
   //Get seed for random generator
   srand((unsigned)time(&t));
-  seed=0-t;
+  seed=0-t-ishard;
 
-  //Read the first header of vdif pol0
-  vdif[0]=fopen(vname[0],"rb");
-  fread(vfhdr[0],1,VDIF_HEADER_BYTES,vdif[0]);
-  fclose(vdif[0]);
+  if(live)
+    {
+      // Frames of 8-bit bytes of VDIF_BIT-bit samples at twice the bandwidth, per pol
+      udpring_catch_sigint();
+      cap=vdifcap_open(caddr,naddr,tids,(int64_t)1000000*VDIF_BIT/8*2*VDIF_BW,rcvbuf*1048576,idle,latency/1000.0);
+      printf("Waiting for VDIF frames, stop with Ctrl-C...\n");
+      if(vdifcap_first(cap,vfhdr[0])<0)
+	{
+	  fprintf(stderr,"No VDIF frame received.\n");
+	  exit(0);
+	}
+    }
+  else
+    {
+      //Read the first header of vdif pol0
+      vdif[0]=fopen(vname[0],"rb");
+      fread(vfhdr[0],1,VDIF_HEADER_BYTES,vdif[0]);
+      fclose(vdif[0]);
+    }
   
   //Get header info
   /*-----------------------*/
@@ -232,31 +529,12 @@ int main(int argc, char *argv[])
   //Frame per second
   fps=1000000*VDIF_BIT/8*2*VDIF_BW/fbytes;
 
-  //Calculate how many frames to get statistics
+  //Calculate how many frames the running statistics average over
   nf_stat=s_stat*1.0e6/spf;
 
-  //Calculate number of frames in one read chunk
-  Nfm=chunksize/(fbytes+VDIF_HEADER_BYTES);
-  printf("Number of frame per reading chunk: %ld\n",Nfm);
-
-  // Calculate how many frames to skip from the beginning
-  nf_skip=s_skip*1.0e6/spf;
-  printf("Number of frames to skip from the beginning: %i.\n",nf_skip);
-
-  //Allocate memo for frames
-  for(j=0;j<2;j++)
-	{
-	  buffer[j]=malloc(sizeof(unsigned char)*fbytes);
-	  obuffer[j]=malloc(sizeof(unsigned char)*fbytes*4);
-	}
-
-  // Prepare FFT
+  // Prepare FFT, one set of plans per detection worker
   Nts = fbytes*4;
-  in_p0 = (float *) malloc(sizeof(float)*Nts);
-  in_p1 = (float *) malloc(sizeof(float)*Nts);
-  out_p0 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(Nts/2+1));
-  out_p1 = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*(Nts/2+1));
-  printf("Determining FFT plan...length %d...",Nts);
+  printf("Determining FFT plan...length %d, %d worker(s)...",Nts,nwork);
   if(nthd > 1) {
     i=fftwf_init_threads();
     if(!i) {
@@ -265,124 +543,168 @@ int main(int argc, char *argv[])
     }
     fftwf_plan_with_nthreads(nthd);
   }
-  pl0 = fftwf_plan_dft_r2c_1d(Nts, in_p0, out_p0, FFTW_MEASURE);
-  pl1 = fftwf_plan_dft_r2c_1d(Nts, in_p1, out_p1, FFTW_MEASURE);
-  if (pl0 != NULL && pl1 != NULL) 
-    printf("Done.\n");
-  else
+  pasm.pf=&pf;
+  pasm.nchan=nchan;
+  pasm.npol=npol;
+  pasm.tsf=tsf;
+  pasm.sdet=sdet;
+  pasm.es=ewstat_create(nchan*4,nf_stat);
+  pasm.noise=nnoise;
+  pasm.seed=seed;
+  fftwisdom_load("vdif1chan",Nts,nthd);
+  dp=detpipe_create(nwork,4*nwork,fbytes,VDIF_NCHAN,nchan,dstat,pico_seed_assemble,&pasm);
+  fftwisdom_save("vdif1chan",Nts,nthd);
+  printf("Done.\n");
+
+  //Set psrfits main header
+  printf("Setting up PSRFITS output...\n");
+  pf.filenum = 0;           // This is the crucial one to set to initialize things
+  pf.rows_per_file = 200;  // Need to set this based on PSRFITS_MAXFILELEN
+  pf.hdr.nsblk = 12500;
+
+  if(live)
     {
-      fprintf(stderr,"Error in creating FFT plan.\n");
-      exit(0);
+      // Seed the running statistics with the first frames, the output starts after them
+      nahead=0;
+      for(i=0;i<EWSTAT_LOOKAHEAD*16 && nahead<EWSTAT_LOOKAHEAD;i++)
+	{
+	  job=detpipe_slot(dp);
+	  got=vdifcap_get(cap,job->buf);
+	  if(got<0)
+	    break;
+	  if(got==3)
+	    {
+	      detpipe_submit(dp,DETJOB_DETECT);
+	      nahead++;
+	    }
+	}
+      detpipe_drain(dp);
+      if(nahead==0)
+	fprintf(stderr,"No valid frame ahead to seed the statistics, early invalid frames are filled with zero.\n");
+
+      // Start of the output, counted in frames from the first frame received
+      memcpy(vfhdrst,vfhdr[0],VDIF_HEADER_BYTES);
+      offset_st=cap->ring->base;
+      offset[0]=offset_st;
+      file0=0;
+      file1=0;
+      mjd[0]=getVDIFFrameDMJD((const vdif_header *)vfhdrst, fps)+(double)offset_st/fps/86400.0;
+      mjd2date(mjd[0],ut);
+      printf("Capture started. Start UT of output: %s\n",ut);
     }
-
-  // Scan the beginning specified length of data, choose valid frames to get mean of total value in each frame
-  fprintf(stderr,"Scan %.2f s data to get statistics...\n",s_stat); 
-  for(j=0;j<2;j++)
+  else
     {
-      mean[j]=0.0;
-      sq=0.0;
-      rms[j]=0.0;
-      ct=0;
-
-      // Open file
-      vdif[j]=fopen(vname[j],"rb");
+      // Open VDIF files for data reading
+      for(j=0;j<2;j++)
+	vdif[j]=fopen(vname[j],"rb");
 
-      fseek(vdif[j],(VDIF_HEADER_BYTES+fbytes)*nf_skip,SEEK_CUR);
+      // Calibrate the difference in starting time between the two pols
+      printf("Calibrating potential difference in starting time between two pols...\n");
 
-      for(i=0;i<nf_stat;i++)
-		{
-		  //Read header
-		  fread(vfhdr[j],1,VDIF_HEADER_BYTES,vdif[j]);
-		  
-		  //Valid frame
-		  if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[j],VDIF_HEADER_BYTES+fbytes))
-			{
-			  //Read data in frame
-			  fread(buffer[j],1,fbytes,vdif[j]);
-
-			  //Expand from 2-bit to 8-bit
-			  convert2to8(obuffer[j], buffer[j],fbytes);
-
-			  //Accumulate values
-			  for(k=0;k<fbytes*4;k++)
-				{
-				  dati=(int)obuffer[j][k];
-				  mean[j]+=(double)dati;
-				  sq+=pow((double)dati,2.0);
-				}
-
-			  //Add counter
-			  ct++;
-			}
-		  //Invalid frame
-		  else
-			{
-			  //Skip the data
-			  fseek(vdif[j],fbytes,SEEK_CUR);
-			}
-		}
-	  fclose(vdif[j]);
-	  mean[j]=mean[j]/ct/fbytes/4;
-	  rms[j]=sqrt(sq/ct/fbytes/4-pow(mean[j],2.0));
-	  printf("Pol%i: mean %lf, rms %lf.\n",j,mean[j],rms[j]);
+      // Move to the first valid frame for both pols
+      for(j=0;j<2;j++)
+	{
+	  // Move to the first valid frame and get header info
+	  do {
+	    // Get header
+	    fread(vfhdr[j],1,VDIF_HEADER_BYTES,vdif[j]);
+
+	    // Valid frame
+	    if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[j],VDIF_HEADER_BYTES+fbytes))
+	      {
+		mjd[j]=getVDIFFrameDMJD((const vdif_header *)vfhdr[j], fps);
+		break;
+	      }
+	      // Invalid frame
+	    else
+	      fseek(vdif[j],fbytes,SEEK_CUR);
+	  }while(feof(vdif[j])!=1);
 	}
 
-  // Open VDIF files for data reading
-  for(j=0;j<2;j++)
-    vdif[j]=fopen(vname[j],"rb");
-
-  // Calibrate the difference in starting time between the two pols
-  printf("Calibrating potential difference in starting time between two pols...\n");
+      // Synchronize starting time
+      while(mjd[0]!=mjd[1] || getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[0],VDIF_HEADER_BYTES+fbytes) || getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[1],VDIF_HEADER_BYTES+fbytes))
+	{
+	  if(mjd[0]<mjd[1])
+	    j=0;
+	  else
+	    j=1;
 
-  // Move to the first valid frame for both pols
-  for(j=0;j<2;j++)
-    {
-      // Move to the first valid frame and get header info
-      do {
-	// Get header
-	fread(vfhdr[j],1,VDIF_HEADER_BYTES,vdif[j]);
-
-	// Valid frame
-	if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[j],VDIF_HEADER_BYTES+fbytes))
-	  {
-	    mjd[j]=getVDIFFrameDMJD((const vdif_header *)vfhdr[j], fps);
-	    break;
-	  }
-	  // Invalid frame
-	else
 	  fseek(vdif[j],fbytes,SEEK_CUR);
-      }while(feof(vdif[j])!=1);
-    }
+	  fread(vfhdr[j],1,VDIF_HEADER_BYTES,vdif[j]);
+	  mjd[j]=getVDIFFrameDMJD((const vdif_header *)vfhdr[j], fps);
+	}
 
-  // Synchronize starting time
-  while(mjd[0]!=mjd[1] || getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[0],VDIF_HEADER_BYTES+fbytes) || getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[1],VDIF_HEADER_BYTES+fbytes))
-    {
-      if(mjd[0]<mjd[1])
-	j=0;
-      else
-	j=1;
+      //Get starting MJD and UT
+      memcpy(vfhdrst,vfhdr[0],VDIF_HEADER_BYTES);
+      mjd2date(mjd[0],ut);
+      printf("Starting time synchronized. Start UT of VDIF: %s\n",ut);
 
-      fseek(vdif[j],fbytes,SEEK_CUR);
-      fread(vfhdr[j],1,VDIF_HEADER_BYTES,vdif[j]);
-      mjd[j]=getVDIFFrameDMJD((const vdif_header *)vfhdr[j], fps);
-    }
+      // Set starting position for reading, data are read in place from mapped files
+      for(j=0;j<2;j++)
+	{
+	  fseek(vdif[j],-VDIF_HEADER_BYTES,SEEK_CUR);
+	  pos0[j]=ftell(vdif[j]);
+	  vm[j]=vdifmap_open(vname[j],chunksize);
+	  vdifmap_seek(vm[j],pos0[j]);
+	  fclose(vdif[j]);
+	}
 
-  //Get starting MJD and UT
-  memcpy(vfhdrst,vfhdr[0],VDIF_HEADER_BYTES);
-  mjd2date(mjd[0],ut);
-  printf("Starting time synchronized. Start UT of VDIF: %s\n",ut);
+      // Files of the part to convert. The scan is split in whole files, counted as if no frame were missing.
+      nf_left=(vm[0]->fsize-pos0[0])/(fbytes+VDIF_HEADER_BYTES);
+      if((vm[1]->fsize-pos0[1])/(fbytes+VDIF_HEADER_BYTES) < nf_left)
+	nf_left=(vm[1]->fsize-pos0[1])/(fbytes+VDIF_HEADER_BYTES);
+      nfile=(nf_left/tsf+(int64_t)pf.hdr.nsblk*pf.rows_per_file-1)/((int64_t)pf.hdr.nsblk*pf.rows_per_file);
+      file0=(int64_t)nfile*ishard/nshard;
+      file1=(int64_t)nfile*(ishard+1)/nshard;
+      if(nshard>1)
+	printf("Part %d of %d: files %d to %d of %d.\n",ishard,nshard,file0+1,file1,nfile);
+      if(ishard!=nshard-1 && file0==file1)
+	{
+	  printf("No file to write in part %d.\n",ishard);
+	  return 0;
+	}
 
-  // Set starting position for reading
-  for(j=0;j<2;j++)
-    {
-      fseek(vdif[j],-VDIF_HEADER_BYTES,SEEK_CUR);
-      offset_pre[j]=-1;
+      // Move to the first frame of the part, frames missing there are filled by the main loop
+      offset_st=(int64_t)file0*pf.rows_per_file*pf.hdr.nsblk*tsf;
+      for(j=0;j<2;j++)
+	{
+	  if(offset_st>0 && seekVDIFFrameOffset(vm[j],pos0[j],(const vdif_header *)vfhdrst,offset_st,fbytes,fps)<0)
+	    {
+	      fprintf(stderr,"Pol%i: No data for part %d of the scan.\n",j,ishard);
+	      exit(1);
+	    }
+	  offset_pre[j]=offset_st-1;
+	}
+
+      // Seed the running statistics with valid frames read ahead, so that early gaps can be filled
+      for(j=0;j<2;j++)
+	pos_ahead[j]=vdifmap_tell(vm[j]);
+      nahead=0;
+      for(i=0;i<EWSTAT_LOOKAHEAD*16 && nahead<EWSTAT_LOOKAHEAD;i++)
+	{
+	  fr[0]=vdifmap_get(vm[0],fbytes+VDIF_HEADER_BYTES);
+	  fr[1]=vdifmap_get(vm[1],fbytes+VDIF_HEADER_BYTES);
+	  if(fr[0]==NULL || fr[1]==NULL)
+	    break;
+	  if(!getVDIFFrameInvalid_robust((const vdif_header *)fr[0],VDIF_HEADER_BYTES+fbytes) && !getVDIFFrameInvalid_robust((const vdif_header *)fr[1],VDIF_HEADER_BYTES+fbytes))
+	    {
+	      job=detpipe_slot(dp);
+	      job->src[0]=fr[0]+VDIF_HEADER_BYTES;
+	      job->src[1]=fr[1]+VDIF_HEADER_BYTES;
+	      detpipe_submit(dp,DETJOB_DETECT);
+	      nahead++;
+	    }
+	  vdifmap_skip(vm[0],fbytes+VDIF_HEADER_BYTES);
+	  vdifmap_skip(vm[1],fbytes+VDIF_HEADER_BYTES);
+	}
+      detpipe_drain(dp);
+      if(nahead==0)
+	fprintf(stderr,"No valid frame ahead to seed the statistics, early invalid frames are filled with zero.\n");
+      for(j=0;j<2;j++)
+	vdifmap_seek(vm[j],pos_ahead[j]);
     }
 
-  //Set psrfits main header
-  printf("Setting up PSRFITS output...\n");
-  pf.filenum = 0;           // This is the crucial one to set to initialize things
-  pf.rows_per_file = 200;  // Need to set this based on PSRFITS_MAXFILELEN
+  detpipe_set_assembler(dp,pico_assemble,&pasm);
 
   //Set values for our hdrinfo structure
   pf.hdr.scanlen = 86400; // in sec
@@ -427,23 +749,28 @@ int main(int argc, char *argv[])
   pf.hdr.offset_subint = 0;
   pf.hdr.orig_nchan = pf.hdr.nchan;
   pf.hdr.orig_df = pf.hdr.df = pf.hdr.BW / pf.hdr.nchan;
-  pf.hdr.nbits = 32;
+  pf.hdr.nbits = nbits;
   pf.hdr.npol = npol;
   pf.hdr.chan_dm = 0.0;
   pf.hdr.fd_hand = 1;
   pf.hdr.fd_sang = 0;
   pf.hdr.fd_xyph = 0;
   pf.hdr.be_phase = 1;
-  pf.hdr.nsblk = 12500;
-  pf.hdr.ds_time_fact = 1;
-  pf.hdr.ds_freq_fact = 1;
+  pf.hdr.ds_time_fact = dsf[0];
+  pf.hdr.ds_freq_fact = dsf[1];
   sprintf(pf.basefilename, "%s/%s",oroute,ut);
 
-  psrfits_create(&pf);
+  if(pf.hdr.ds_time_fact<1 || pf.hdr.ds_freq_fact<1 || pf.hdr.nsblk%pf.hdr.ds_time_fact!=0 || pf.hdr.nchan%pf.hdr.ds_freq_fact!=0)
+    {
+      fprintf(stderr,"Error: Downsampling factors must divide %d samples per subint and %d channels.\n",pf.hdr.nsblk,pf.hdr.nchan);
+      exit(0);
+    }
+
+  // Continue the file numbering and subint offsets of the parts before
+  psrfits_create_shard(&pf,file0,file0*pf.rows_per_file);
 
   //Set values for our subint structure
   pf.sub.tsubint = pf.hdr.nsblk * pf.hdr.dt;
-  pf.tot_rows = 0;
   pf.sub.offs = (pf.tot_rows + 0.5) * pf.sub.tsubint;
   pf.sub.lst = pf.hdr.start_lst;
   pf.sub.ra = pf.hdr.ra2000;
@@ -472,183 +799,178 @@ int main(int argc, char *argv[])
 	  pf.sub.dat_scales[i] = 1.0;
 	}
 
-  pf.sub.rawdata = (unsigned char *)malloc(pf.sub.bytes_per_subint);
+  // Channel frequencies and arrays of the downsampled output
+  guppi_update_ds_params(&pf);
 
-  printf("Header prepared. Start to write data...\n");
+  pf.sub.rawdata = (unsigned char *)malloc(psrwriter_bytes(&pf));
 
-  // First read of data chunk
-  for(i=0;i<2;i++)
+  // Downsampled or 8 or 4-bit output, detections are reworked from floats
+  pf.sub.fdata = NULL;
+  qes = NULL;
+  if(nbits!=32 || pf.hdr.ds_time_fact>1 || pf.hdr.ds_freq_fact>1)
     {
-      chunk[i] = (unsigned char *)malloc(Nfm * (fbytes+VDIF_HEADER_BYTES));
-      nread[i] = fread(chunk[i],1,Nfm * (fbytes+VDIF_HEADER_BYTES),vdif[i]);
-      ctframe[i] = 0;
-      nfm_p[i] = Nfm;
+      pf.sub.fdata = (float *)malloc(sizeof(float) * pf.hdr.nchan * pf.hdr.npol * pf.hdr.nsblk);
+      if(ifrun)
+	qes=ewstat_create(pf.hdr.nchan / pf.hdr.ds_freq_fact * pf.hdr.npol, s_stat / pf.sub.tsubint);
     }
 
-  // Main loop to write subints
+  // Subints are written by their own thread, triple buffered; a part other
+  // than the last must not create the first file of the next part
+  pw=psrwriter_start(&pf,3,0,flush_sec,(ishard==nshard-1) ? 0 : file1);
+
+  printf("Header prepared. Start to write data...\n");
+
+  // Main loop to write subints, until the end of data of either pol
+  pend=false;
   do
     {
-      memset(pf.sub.rawdata,0,sizeof(unsigned char)*pf.sub.bytes_per_subint);
+      if(pf.sub.fdata==NULL)
+	memset(pf.sub.rawdata,0,sizeof(unsigned char)*pf.sub.bytes_per_subint);
+      else
+	memset(pf.sub.fdata,0,sizeof(float)*pf.hdr.nchan*pf.hdr.npol*pf.hdr.nsblk);
 
       // Fill time samples in each subint: pf.sub.rawdata
       for(i=0;i<pf.hdr.nsblk;i++)
 	{
-	  // Initialize sample block
-	  for(k=0;k<nchan;k++)
-	    {
-	      sdet[k][0]=0.0;
-	      sdet[k][1]=0.0;
-	      sdet[k][2]=0.0;
-	      sdet[k][3]=0.0;
-	    }
-			  
 	  // Loop over frames
 	  for(k=0;k<tsf;k++)
 	    {
+	      // Get a free slot of the detection pipeline
+	      job=detpipe_slot(dp);
+
+	      // Live frames come in time order from the capture, missing ones already told
+	      if(live)
+		{
+		  got=vdifcap_get(cap,job->buf);
+		  if(got<0)
+		    {
+		      pend=true;
+		      break;
+		    }
+		  kind=DETJOB_DETECT;
+		  if(got!=3)
+		    {
+		      if(ifverbose)
+			fprintf(stderr,"Frame missing in file %d subint %d (%f sec). Fake detection from running statistics.\n", pf.filenum, pf.tot_rows, pf.T);
+		      kind=DETJOB_SKIP;
+		      inval++;
+		    }
+		  offset[0]=cap->ring->base;
+		  detpipe_submit(dp,kind);
+		  continue;
+		}
+
 	      // Consecutive check on both pols
 	      for(j=0;j<2;j++)
 		{
-		  // Read frame header
-		  memcpy(vfhdr[j],chunk[j]+ctframe[j]*(fbytes+VDIF_HEADER_BYTES),VDIF_HEADER_BYTES);
+		  // Frame in place
+		  fr[j]=vdifmap_get(vm[j],fbytes+VDIF_HEADER_BYTES);
+		  // Not enough data left to fill in frame
+		  if(fr[j]==NULL)
+		    {
+		      pend=true;
+		      break;
+		    }
 		  pval[j] = true;
 
 		  // Get frame offset
-		  offset[j]=getVDIFFrameOffset((const vdif_header *)vfhdrst, (const vdif_header *)vfhdr[j], fps);
+		  offset[j]=getVDIFFrameOffset((const vdif_header *)vfhdrst, (const vdif_header *)fr[j], fps);
 
 		  // Gap from the last frames
-		  if( !getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[j],VDIF_HEADER_BYTES+fbytes) && offset[j] > offset_pre[j]+1)
+		  if( !getVDIFFrameInvalid_robust((const vdif_header *)fr[j],VDIF_HEADER_BYTES+fbytes) && offset[j] > offset_pre[j]+1)
 		    {
 		      if(ifverbose)
 			fprintf(stderr,"Pol%i: Current frame (%Ld) not consecutive from previous (%Ld).\n",j,offset[j],offset_pre[j]);
 		      pval[j] = false;
-		      fseek(vdif[j],-VDIF_HEADER_BYTES,SEEK_CUR);
 		      offset_pre[j]++;
 		    }
 		  // Consecutive
 		  else
 		    {
-		      memcpy(buffer[j],chunk[j]+ctframe[j]*(fbytes+VDIF_HEADER_BYTES)+VDIF_HEADER_BYTES,fbytes);
+		      job->src[j]=fr[j]+VDIF_HEADER_BYTES;
 		      offset_pre[j]++;
-		      ctframe[j]++;
-
-		      // If end of buffer 
-		      if(ctframe[j] == nfm_p[j])
-			{
-			  // Last read was complete, try to read more
-			  if(nfm_p[j] == Nfm)
-			    {
-			      nread[j]=fread(chunk[j],1,Nfm * (fbytes+VDIF_HEADER_BYTES),vdif[j]);
-			      ctframe[j]=0;
-			      
-			      // Running into the last chunk of data, update frame number
-			      if(nread[j] != sizeof(unsigned char) * Nfm * (fbytes+VDIF_HEADER_BYTES))
-				nfm_p[j] = nread[j] / (fbytes+VDIF_HEADER_BYTES);
-			    }
-			}
+		      vdifmap_skip(vm[j],fbytes+VDIF_HEADER_BYTES);
 		    }
 		}
 
+	      if(pend)
+		break;
+
 	      // Both pol consecutive
 	      if(pval[0] == true && pval[1] == true) 
 		{
 		  // Valid frame
-		  if(!getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[0],VDIF_HEADER_BYTES+fbytes) && !getVDIFFrameInvalid_robust((const vdif_header *)vfhdr[1],VDIF_HEADER_BYTES+fbytes))
-		    getVDIFFrameDetection_1chan(buffer[0],buffer[1],fbytes,det,nchan,dstat,in_p0,in_p1,out_p0,out_p1,pl0,pl1);
+		  if(!getVDIFFrameInvalid_robust((const vdif_header *)fr[0],VDIF_HEADER_BYTES+fbytes) && !getVDIFFrameInvalid_robust((const vdif_header *)fr[1],VDIF_HEADER_BYTES+fbytes))
+		    kind=DETJOB_DETECT;
 		  // Invalid frame
 		  else
 		    {
-		      // Create fake detection with measured mean
+		      // Create fake detection from running statistics
 		      if(ifverbose)
-			fprintf(stderr,"Invalid frame detected in file %d subint %d (%f sec). Fake detection with measured mean.\n", pf.filenum, pf.tot_rows, pf.T);
-		      getVDIFFrameFakeDetection_1chan(mean,rms,nchan,det,seed,fbytes,dstat);
+			fprintf(stderr,"Invalid frame detected in file %d subint %d (%f sec). Fake detection from running statistics.\n", pf.filenum, pf.tot_rows, pf.T);
+		      kind=DETJOB_SKIP;
 		      inval++;
 		    }
 		}
 	      // One pol not consecutive
 	      else 
 		{
-		  // Create fake detection with measured mean
+		  // Create fake detection from running statistics
 		  if(ifverbose)
-		    fprintf(stderr,"Gap in frame count detected in file %d subint %d (%f sec). Fake detection with measured mean.\n", pf.filenum, pf.tot_rows, pf.T);
-		  getVDIFFrameFakeDetection_1chan(mean,rms,nchan,det,seed,fbytes,dstat);
+		    fprintf(stderr,"Gap in frame count detected in file %d subint %d (%f sec). Fake detection from running statistics.\n", pf.filenum, pf.tot_rows, pf.T);
+		  kind=DETJOB_SKIP;
 		  inval++;
 		}
-	  
-	      // Accumulate detection
-	      for(j=0;j<nchan;j++)
-		{
-		  sdet[j][0]+=det[j][0];
-		  sdet[j][1]+=det[j][1];
-		  sdet[j][2]+=det[j][2];
-		  sdet[j][3]+=det[j][3];
-		}
 
-	      // Break out if the end of data reached for either pol
-	      for(j=0;j<2;j++)
-		if(ctframe[j] == nfm_p[j] && nfm_p[j] < Nfm)
-		  {
-		    k++;
-		    break;
-		  }
+	      // Hand over to the detection workers, detections are accumulated in frame order by pico_assemble
+	      detpipe_submit(dp,kind);
 	    }
 
 	  // Break when not enough frames were read to get a sample
-	  if(k!=tsf) break;
-
-	  // Write detections in pf.sub.rawdata, in 32-bit float and FPT order (freq, pol, time)
-	  for(j=0;j<nchan;j++)
-	    {
-	      if (npol == 4)
-		{
-		  memcpy(pf.sub.rawdata+i*sizeof(float)*4*nchan+sizeof(float)*j,&sdet[j][0],sizeof(float));
-		  memcpy(pf.sub.rawdata+i*sizeof(float)*4*nchan+sizeof(float)*nchan*1+sizeof(float)*j,&sdet[j][1],sizeof(float));
-		  memcpy(pf.sub.rawdata+i*sizeof(float)*4*nchan+sizeof(float)*nchan*2+sizeof(float)*j,&sdet[j][2],sizeof(float));
-		  memcpy(pf.sub.rawdata+i*sizeof(float)*4*nchan+sizeof(float)*nchan*3+sizeof(float)*j,&sdet[j][3],sizeof(float));
-		}
-	      else if (npol == 2)
-		{
-		  memcpy(pf.sub.rawdata+i*sizeof(float)*2*nchan+sizeof(float)*j,&sdet[j][0],sizeof(float));
-		  memcpy(pf.sub.rawdata+i*sizeof(float)*2*nchan+sizeof(float)*nchan*1+sizeof(float)*j,&sdet[j][1],sizeof(float));
-		}
-	      else if (npol == 1)
-		{
-		  memcpy(pf.sub.rawdata+i*sizeof(float)*1*nchan+sizeof(float)*j,&sdet[j][0],sizeof(float));
-		}
-	    }
+	  if(pend) break;
 	}
 
+      // Wait for all detections of the subint
+      detpipe_drain(dp);
+
       // Update offset from Start of subint
       pf.sub.offs = (pf.tot_rows + 0.5) * pf.sub.tsubint;
 
-      // Write subint
-      psrfits_write_subint(&pf);
+      // Downsample or requantise, and write subint
+      if(pf.sub.fdata!=NULL)
+	pf_fdata_to_rawdata(&pf,qes);
+      psrwriter_put(pw);
       printf("Subint %i written.\n",pf.sub.tsubint);
 
       // Break when subint is not complete
-      if(k!=tsf || i!=pf.hdr.nsblk) break;
+      if(pend) break;
 	  
-    }while(!feof (vdif[0]) && !feof (vdif[1]) && !pf.status && pf.T < pf.hdr.scanlen);
+    }while((live || (vdifmap_left(vm[0]) && vdifmap_left(vm[1]))) && !pf.status && pf.T < pf.hdr.scanlen && (ishard==nshard-1 || pf.tot_rows<file1*pf.rows_per_file));
 	
   // Close the last file and cleanup
-  fits_close_file(pf.fptr, &(pf.status));
+  psrwriter_finish(pw);
   free(pf.sub.dat_freqs);
   free(pf.sub.dat_weights);
   free(pf.sub.dat_offsets);
   free(pf.sub.dat_scales);
   free(pf.sub.rawdata);
-  free(buffer[0]);
-  free(buffer[1]);
-  fclose(vdif[0]);
-  fclose(vdif[1]);
-  fftwf_free(out_p0);
-  fftwf_free(out_p1);
-  fftwf_destroy_plan(pl0);
-  fftwf_destroy_plan(pl1);
+  free(pf.sub.fdata);
+  if(qes!=NULL)
+    ewstat_destroy(qes);
+  if(live)
+    vdifcap_close(cap);
+  else
+    {
+      vdifmap_close(vm[0]);
+      vdifmap_close(vm[1]);
+    }
+  detpipe_destroy(dp);
+  ewstat_destroy(pasm.es);
   if(nthd>1)
     fftwf_cleanup_threads();
 
-  printf("Wrote %d subints (%f sec) in %d files.\n",pf.tot_rows, pf.T, pf.filenum);
-  printf("Percentage of valid data: %.2f%%\n",(1.0-(float)inval/offset[0])*100.0);
+  printf("Wrote %d subints (%f sec) in %d files.\n",pf.tot_rows-file0*pf.rows_per_file, pf.T, pf.filenum-file0);
+  printf("Percentage of valid data: %.2f%%\n",(1.0-(float)inval/(offset[0]-offset_st))*100.0);
 
   return;
 }
@@ -0,0 +1,135 @@
+/* vdifcap.c */
+// Live capture of VDIF frames of two pols from UDP, on a udpring of a
+// stream per pol keyed by the frame offset from the first valid frame.
+// Waits for a missing frame are bounded by latency as well as by the ring
+// depth, so that the output never falls far behind.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vdifdet.h"
+#include "vdifcap.h"
+
+static int vdifcap_key(struct udpring *r, int sock, const unsigned char *fr, size_t len,
+                       int *stream, int64_t *key)
+{
+    struct vdifcap *c = (struct vdifcap *)r->arg;
+    const vdif_header *h = (const vdif_header *)fr;
+    int pol;
+
+    if (len < VDIF_HEADER_BYTES || len != getVDIFFrameBytes(h) || (c->fsize > 0 && len != c->fsize))
+        return -1;
+    if (c->nfd == 2)
+        pol = sock;
+    else if (getVDIFThreadID(h) == c->tid[0])
+        pol = 0;
+    else if (getVDIFThreadID(h) == c->tid[1])
+        pol = 1;
+    else
+        return -1;
+    if (getVDIFFrameInvalid_robust(h, len)) {
+        c->ninval[pol]++;
+        return 1;
+    }
+    // Frame layout and rings from the first valid frame
+    if (c->fsize == 0) {
+        c->fsize = len;
+        c->fbytes = len - VDIF_HEADER_BYTES;
+        c->fps = c->rate / c->fbytes;
+        memcpy(c->hdrst, fr, VDIF_HEADER_BYTES);
+        udpring_setup(r, VDIF_HEADER_BYTES, c->fbytes);
+    }
+
+    *stream = pol;
+    *key = getVDIFFrameOffset((const vdif_header *)c->hdrst, h, c->fps);
+
+    return 0;
+}
+
+struct vdifcap *vdifcap_open(char addr[][64], int naddr, const int *tid, int64_t rate, int rcvbuf,
+                             double idle, double latency)
+{
+    struct vdifcap *c;
+    int fd[2], j;
+
+    if (naddr < 1 || naddr > 2 || (naddr == 1 && tid[0] == tid[1])) {
+        fprintf(stderr, "Error: Pols need a port each or a thread ID each.\n");
+        exit(1);
+    }
+    c = (struct vdifcap *)calloc(1, sizeof(struct vdifcap));
+    c->nfd = naddr;
+    c->tid[0] = tid[0];
+    c->tid[1] = tid[1];
+    c->rate = rate;
+    c->latency = latency;
+    c->ring = udpring_create(2, VDIFCAP_NSLOT, VDIFCAP_DEPTH, vdifcap_key, c);
+    for (j = 0 ; j < 2 ; j++)
+        snprintf(c->ring->name[j], sizeof(c->ring->name[j]), "Pol%d", j);
+    for (j = 0 ; j < naddr ; j++)
+        fd[j] = udpring_bind(addr[j], rcvbuf);
+    udpring_start(c->ring, fd, naddr, MAX_VDIF_FRAME_BYTES, idle);
+
+    return c;
+}
+
+int vdifcap_first(struct vdifcap *c, char *hdr)
+{
+    if (udpring_first(c->ring) < 0)
+        return -1;
+    // Set under the lock before the first frame was kept
+    memcpy(hdr, c->hdrst, VDIF_HEADER_BYTES);
+
+    return c->fbytes;
+}
+
+int vdifcap_get(struct vdifcap *c, unsigned char *dst[2])
+{
+    struct udpring *r = c->ring;
+    double until = 0.0;
+    int st[2], waited = 0, mask = 0, j;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        if (!r->started || udpring_end(r)) {
+            pthread_mutex_unlock(&r->lock);
+            return -1;
+        }
+        for (j = 0 ; j < 2 ; j++)
+            st[j] = udpring_state(r, j, waited);
+        if (st[0] != 0 && st[1] != 0)
+            break;
+
+        // One deadline for all wakeups, which frames of the other pol bring too
+        if (until == 0.0)
+            until = udpring_now() + c->latency;
+        if (udpring_wait(r, until)) {
+            waited = 1;
+            until = 0.0;
+        }
+    }
+    // Frames of pols given up now are late if they still come
+    r->busy = 1;
+    pthread_mutex_unlock(&r->lock);
+
+    for (j = 0 ; j < 2 ; j++)
+        if (st[j] > 0) {
+            memcpy(dst[j], udpring_slot(r, j), c->fbytes);
+            mask |= 1 << j;
+        }
+
+    pthread_mutex_lock(&r->lock);
+    udpring_next(r);
+    pthread_mutex_unlock(&r->lock);
+
+    return mask;
+}
+
+void vdifcap_close(struct vdifcap *c)
+{
+    int j;
+
+    udpring_close(c->ring);
+    for (j = 0 ; j < 2 ; j++)
+        if (c->ninval[j] > 0)
+            printf("Pol%d: %ld frames flagged invalid.\n", j, c->ninval[j]);
+    free(c);
+}
@@ -0,0 +1,49 @@
+/* vdifcap.h */
+#ifndef _VDIFCAP_H
+#define _VDIFCAP_H
+#include <stdint.h>
+#include "vdifio.h"
+#include "udpring.h"
+
+// Frames of each pol in the ring, a power of 2
+#define VDIFCAP_NSLOT 8192
+// A missing frame is given up once a frame so many later of either pol has come
+#define VDIFCAP_DEPTH 512
+
+// Live capture of the VDIF frames of two pols, sent over UDP either to
+// one port each or to one port with a thread ID each. The frames are kept
+// in a udpring of a stream per pol, keyed by their time stamp counted in
+// frames from the first valid frame. The caller takes frames of both pols
+// back in time order, the missing ones given up after at most latency
+// seconds.
+struct vdifcap {
+    struct udpring *ring;           // base is the offset of the next frames to hand out
+    int nfd;                        // 2 for a port per pol, 1 for pols by thread ID
+    int tid[2];                     // Thread ID of each pol, with nfd 1
+    int64_t rate;                   // Bytes of samples per second per pol
+    double latency;                 // Longest wait for a missing frame
+    // Set from the first valid frame
+    int fsize;                      // Frame bytes, header included
+    int fbytes;                     // Bytes of payload
+    uint32_t fps;                   // Frames per second per pol
+    char hdrst[VDIF_HEADER_BYTES];  // Frame of offset 0
+    long ninval[2];                 // Frames flagged invalid per pol
+};
+
+// In vdifcap.c
+// addr holds naddr [address:]port: one per pol, or one for both pols told
+// apart by thread IDs tid. rate is in bytes per second per pol, rcvbuf
+// the socket receive buffer in bytes. Exits if a socket cannot be bound.
+struct vdifcap *vdifcap_open(char addr[][64], int naddr, const int *tid, int64_t rate, int rcvbuf,
+                             double idle, double latency);
+// Wait for the first valid frame and copy its header to hdr. Returns the
+// payload bytes per frame, -1 if the capture ended before.
+int vdifcap_first(struct vdifcap *c, char *hdr);
+// Payloads of the next frame of both pols into dst[0] and dst[1]. Returns
+// a mask of the pols received (bit j for pol j), -1 once the capture has
+// ended.
+int vdifcap_get(struct vdifcap *c, unsigned char *dst[2]);
+// Print the frame counts, stop the thread and close the sockets
+void vdifcap_close(struct vdifcap *c);
+
+#endif
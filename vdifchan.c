@@ -0,0 +1,242 @@
+/* vdifchan.c */
+// Extraction of frequency channels from multi-channel VDIF frames, and
+// interleaving of pols, a whole frame or block at a time straight into
+// the DADA output buffers instead of a library call per output byte.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "vdifchan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VDIFCHAN_X86
+#include <immintrin.h>
+#endif
+
+const unsigned char vdifchan_levels[4] = {0, 1, 2, 3};
+
+int vdifchan_pos32(int chan)
+{
+    return (chan < 16) ? 15 - chan : 47 - chan;
+}
+
+static void vdifchan_gather2_scalar(char *dst, const unsigned char *srca, int posa,
+                                    const unsigned char *srcb, int posb,
+                                    int ngroup, int groupbytes, const unsigned char *levels)
+{
+    char luta[256], lutb[256];
+    int ii;
+
+    // Output sample of each byte value, so one lookup per sample
+    for (ii = 0 ; ii < 256 ; ii++) {
+        luta[ii] = (char)(levels[(ii >> (2 * (posa & 3))) & 0x3] - 128);
+        lutb[ii] = (char)(levels[(ii >> (2 * (posb & 3))) & 0x3] - 128);
+    }
+    srca += posa >> 2;
+    srcb += posb >> 2;
+    for (ii = 0 ; ii < ngroup ; ii++, srca += groupbytes, srcb += groupbytes) {
+        dst[2 * ii] = luta[*srca];
+        dst[2 * ii + 1] = lutb[*srcb];
+    }
+}
+
+#ifdef VDIFCHAN_X86
+static void vdifchan_masks(signed char m[][16], int pos, int groupbytes)
+// Shuffles of the groupbytes loads of 16 groups: load jj has groups
+// jj*per to jj*per+per-1, their byte with sample pos goes to lanes
+// jj*per onwards
+{
+    const int per = 16 / groupbytes;
+    int jj, tt;
+
+    for (jj = 0 ; jj < groupbytes ; jj++) {
+        memset(m[jj], -1, 16);
+        for (tt = 0 ; tt < per ; tt++)
+            m[jj][jj * per + tt] = (signed char)((pos >> 2) + tt * groupbytes);
+    }
+}
+
+__attribute__((target("ssse3")))
+static __m128i vdifchan_pick16(const unsigned char *src, signed char m[][16],
+                               int groupbytes, __m128i shift, __m128i lev)
+// Samples of 16 groups, as level - 128
+{
+    __m128i v = _mm_setzero_si128();
+    int jj;
+
+    for (jj = 0 ; jj < groupbytes ; jj++)
+        v = _mm_or_si128(v, _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(src + jj * 16)),
+                _mm_loadu_si128((const __m128i *)m[jj])));
+    v = _mm_and_si128(_mm_srl_epi16(v, shift), _mm_set1_epi8(0x3));
+    return _mm_shuffle_epi8(lev, v);
+}
+
+__attribute__((target("ssse3")))
+static void vdifchan_gather2_ssse3(char *dst, const unsigned char *srca, int posa,
+                                   const unsigned char *srcb, int posb,
+                                   int ngroup, int groupbytes, const unsigned char *levels)
+// 16 groups per iteration, both pols picked with byte shuffles
+{
+    signed char ma[16][16], mb[16][16];
+    const __m128i shifta = _mm_cvtsi32_si128(2 * (posa & 3));
+    const __m128i shiftb = _mm_cvtsi32_si128(2 * (posb & 3));
+    // Output of each level, looked up with a byte shuffle too
+    const __m128i lev = _mm_setr_epi8(levels[0] - 128, levels[1] - 128, levels[2] - 128,
+                                      levels[3] - 128, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i a, b;
+    int ii;
+
+    vdifchan_masks(ma, posa, groupbytes);
+    vdifchan_masks(mb, posb, groupbytes);
+    for (ii = 0 ; ii + 16 <= ngroup ; ii += 16) {
+        a = vdifchan_pick16(srca + ii * groupbytes, ma, groupbytes, shifta, lev);
+        b = vdifchan_pick16(srcb + ii * groupbytes, mb, groupbytes, shiftb, lev);
+        _mm_storeu_si128((__m128i *)(dst + 2 * ii), _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *)(dst + 2 * ii + 16), _mm_unpackhi_epi8(a, b));
+    }
+    vdifchan_gather2_scalar(dst + 2 * ii, srca + ii * groupbytes, posa,
+                            srcb + ii * groupbytes, posb, ngroup - ii, groupbytes, levels);
+}
+#endif
+
+void vdifchan_gather2(char *dst, const unsigned char *srca, int posa,
+                      const unsigned char *srcb, int posb,
+                      int ngroup, int groupbytes, const unsigned char levels[4])
+{
+#ifdef VDIFCHAN_X86
+    static int ssse3 = -1;
+
+    if (ssse3 < 0) {
+        __builtin_cpu_init();
+        ssse3 = __builtin_cpu_supports("ssse3");
+    }
+    if (ssse3 && groupbytes <= 16 && 16 % groupbytes == 0) {
+        vdifchan_gather2_ssse3(dst, srca, posa, srcb, posb, ngroup, groupbytes, levels);
+        return;
+    }
+#endif
+    vdifchan_gather2_scalar(dst, srca, posa, srcb, posb, ngroup, groupbytes, levels);
+}
+
+void vdifchan_gather8(char *dst, const unsigned char *src,
+                      int ngroup, int groupbytes, int off, int n)
+{
+    int ii;
+    uint16_t u16;
+
+    src += off;
+    if (n == 2) {
+        // Both pols of a real-sampled channel
+        for (ii = 0 ; ii < ngroup ; ii++, src += groupbytes, dst += 2) {
+            memcpy(&u16, src, 2);
+            memcpy(dst, &u16, 2);
+        }
+    } else {
+        for (ii = 0 ; ii < ngroup ; ii++, src += groupbytes, dst += n)
+            memcpy(dst, src, n);
+    }
+}
+
+static void vdifchan_interleave_scalar(char *dst, const char *a, const char *b, size_t n)
+{
+    size_t ii;
+
+    for (ii = 0 ; ii < n ; ii++) {
+        dst[2 * ii] = a[ii];
+        dst[2 * ii + 1] = b[ii];
+    }
+}
+
+#ifdef VDIFCHAN_X86
+__attribute__((target("sse2")))
+static void vdifchan_interleave_sse2(char *dst, const char *a, const char *b, size_t n)
+// 16 samples of each pol per iteration
+{
+    __m128i va, vb;
+    size_t ii;
+
+    for (ii = 0 ; ii + 16 <= n ; ii += 16) {
+        va = _mm_loadu_si128((const __m128i *)(a + ii));
+        vb = _mm_loadu_si128((const __m128i *)(b + ii));
+        _mm_storeu_si128((__m128i *)(dst + 2 * ii), _mm_unpacklo_epi8(va, vb));
+        _mm_storeu_si128((__m128i *)(dst + 2 * ii + 16), _mm_unpackhi_epi8(va, vb));
+    }
+    vdifchan_interleave_scalar(dst + 2 * ii, a + ii, b + ii, n - ii);
+}
+
+__attribute__((target("avx2")))
+static void vdifchan_interleave_avx2(char *dst, const char *a, const char *b, size_t n)
+// 32 samples of each pol per iteration. The unpacks work within 128-bit
+// lanes, so the halves are put back in order afterwards.
+{
+    __m256i va, vb, lo, hi;
+    size_t ii;
+
+    for (ii = 0 ; ii + 32 <= n ; ii += 32) {
+        va = _mm256_loadu_si256((const __m256i *)(a + ii));
+        vb = _mm256_loadu_si256((const __m256i *)(b + ii));
+        lo = _mm256_unpacklo_epi8(va, vb);
+        hi = _mm256_unpackhi_epi8(va, vb);
+        _mm256_storeu_si256((__m256i *)(dst + 2 * ii), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * ii + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    vdifchan_interleave_sse2(dst + 2 * ii, a + ii, b + ii, n - ii);
+}
+#endif
+
+void vdifchan_interleave(char *dst, const char *a, const char *b, size_t n)
+{
+#ifdef VDIFCHAN_X86
+    static int simd = -1;
+
+    if (simd < 0) {
+        __builtin_cpu_init();
+        simd = __builtin_cpu_supports("avx2") ? 2 : (__builtin_cpu_supports("sse2") ? 1 : 0);
+    }
+    if (simd == 2) {
+        vdifchan_interleave_avx2(dst, a, b, n);
+        return;
+    }
+    if (simd == 1) {
+        vdifchan_interleave_sse2(dst, a, b, n);
+        return;
+    }
+#endif
+    vdifchan_interleave_scalar(dst, a, b, n);
+}
+
+int vdifchan_parse_list(const char *list, int *chan, int maxchan)
+{
+    const char *p = list;
+    char *end;
+    long lo, hi, ii;
+    int n = 0;
+
+    for (;;) {
+        lo = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+        hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1)
+                return -1;
+            p = end;
+        }
+        if (lo < 0 || hi >= maxchan || hi < lo)
+            return -1;
+        for (ii = lo ; ii <= hi ; ii++) {
+            if (n == VDIFCHAN_MAXCHAN)
+                return -1;
+            chan[n++] = ii;
+        }
+        if (*p == '\0')
+            break;
+        if (*p++ != ',')
+            return -1;
+    }
+
+    return n;
+}
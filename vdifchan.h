@@ -0,0 +1,33 @@
+/* vdifchan.h */
+#ifndef _VDIFCHAN_H
+#define _VDIFCHAN_H
+#include <stddef.h>
+
+// Channels extracted in one pass at most
+#define VDIFCHAN_MAXCHAN 64
+
+// In vdifchan.c
+// Levels of convert2to8() in cvrt2to8.c
+extern const unsigned char vdifchan_levels[4];
+// Position of channel chan in a 32-sample ALMA word, as chanPos32() in
+// getVDIFFrameDetection.c: ch15 ... ch00 ch31 ... ch16
+int vdifchan_pos32(int chan);
+// Sample posa of each of ngroup groups of groupbytes bytes of 2-bit
+// samples (4 per byte, first in the 2 LSBs) in srca, and sample posb of
+// those in srcb, interleaved to dst as levels[sample] - 128, the signed
+// 8-bit DADA samples. srca and srcb are the two pols, in two buffers or
+// in the same one.
+void vdifchan_gather2(char *dst, const unsigned char *srca, int posa,
+                      const unsigned char *srcb, int posb,
+                      int ngroup, int groupbytes, const unsigned char levels[4]);
+// Bytes off to off+n-1 of each of ngroup groups of groupbytes bytes of
+// 8-bit samples to dst, one after other
+void vdifchan_gather8(char *dst, const unsigned char *src,
+                      int ngroup, int groupbytes, int off, int n);
+// n samples of pol a and n of pol b interleaved to the 2n bytes of dst
+void vdifchan_interleave(char *dst, const char *a, const char *b, size_t n);
+// Channels in a list like 3 or 0-31 or 1,5,8-11 into chan, each from 0
+// to maxchan-1. Returns the number of channels, -1 if the list is bad.
+int vdifchan_parse_list(const char *list, int *chan, int maxchan);
+
+#endif
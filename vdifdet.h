@@ -0,0 +1,74 @@
+/* vdifdet.h */
+#ifndef _VDIFDET_H
+#define _VDIFDET_H
+#include <fftw3.h>
+#include "vdifio.h"
+
+// Unpacker of 2-bit samples to centred floats, see unpack2bit.c
+typedef void (*unpack2bit_fn)(float *dest, const unsigned char *src, int bytes);
+
+// Detection kernels of one output data status, see detkern.c
+typedef void (*detsum_fn)(const fftwf_complex *out_p0, const fftwf_complex *out_p1, int n, float *det);
+typedef void (*detspec_fn)(const fftwf_complex *out_p0, const fftwf_complex *out_p1, int n, float det[][4]);
+
+// Detection context of one stream of 2-bit VDIF frame pairs.
+// Everything the detection needs per frame is set up once here,
+// so that the per-frame calls do no allocation nor FFT planning.
+struct vdifdet {
+    int fbytes;                     // Bytes of payload per frame
+    int vdif_nchan;                 // Channels in the VDIF frame (1 or 32)
+    int nchan;                      // Output channels of the detection
+    char dstat;                     // Output data status
+    int npol;                       // Number of pols in the output for dstat
+    int Nts;                        // FFT length, per channel
+    int chw;                        // FFT bins per output channel (1chan)
+    int *binlo;                     // First FFT bin of each output channel, nchan+1 (1chan)
+    detsum_fn detsum;               // Detection kernel for dstat
+    unpack2bit_fn unpack;           // Fastest unpacker for the CPU
+    float *in_p0, *in_p1;           // FFT input, one per pol, channels interleaved
+    fftwf_complex *out_p0, *out_p1; // FFT output, one per pol, one channel after another
+    fftwf_plan pl;                  // Batched FFT of all channels of both pols
+};
+
+// Detection context of one stream of 8-bit UDP blocks of two pols
+struct udpdet {
+    int bbytes;                     // Samples per pol in a block, i.e. FFT length
+    char dstat;                     // Output data status
+    detspec_fn detspec;             // Detection kernel for dstat
+    float *in_p0, *in_p1;           // FFT input, one per pol
+    fftwf_complex *out_p0, *out_p1; // FFT output, one per pol
+    fftwf_plan pl;                  // FFT of both pols
+};
+
+// In getVDIFFrameDetection.c
+// vdifdet_create() plans FFTs and so must not be called concurrently
+struct vdifdet *vdifdet_create(int fbytes, int vdif_nchan, int nchan, char dstat);
+void vdifdet_destroy(struct vdifdet *ctx);
+void getVDIFFrameDetection(struct vdifdet *ctx, const unsigned char *src_p0, const unsigned char *src_p1, float det[][4]);
+void getVDIFFrameDetection_1chan(struct vdifdet *ctx, const unsigned char *src_p0, const unsigned char *src_p1, float det[][4]);
+void getVDIFFrameDetection_32chan(struct vdifdet *ctx, const unsigned char *src_p0, const unsigned char *src_p1, float det[][4]);
+int getVDIFFrameInvalid_robust(const vdif_header *header, int framebytes);
+int64_t getVDIFFrameOffset(const vdif_header *headerst, const vdif_header *header, uint32_t fps);
+
+// In getUDPDetection.c
+// udpdet_create() plans FFTs and so must not be called concurrently
+struct udpdet *udpdet_create(int bbytes, char dstat);
+void udpdet_destroy(struct udpdet *ctx);
+void getUDPDetection(struct udpdet *ctx, const char *src_p0, const char *src_p1, float det[][4]);
+
+// In detkern.c
+int detnpol(char dstat);
+detsum_fn detsum_select(char dstat);
+detspec_fn detspec_select(char dstat);
+
+// In fftwisdom.c
+void fftwisdom_patient(int on);
+unsigned fftwisdom_flags(void);
+int fftwisdom_load(const char *kind, int nfft, int nthreads);
+void fftwisdom_save(const char *kind, int nfft, int nthreads);
+
+// In unpack2bit.c
+void unpack2bit_scalar(float *dest, const unsigned char *src, int bytes);
+unpack2bit_fn unpack2bit_select(void);
+
+#endif
@@ -0,0 +1,258 @@
+/* vdifidx.c */
+// Build and read binary VDIF frame indices, see vdifidx.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vdifio.h"
+#include "vdifmap.h"
+#include "vdifidx.h"
+
+#define VDIFIDX_MAXTHREAD 1024
+
+static inline uint64_t vdifidx_key(int epoch, int second, int frame)
+// Time order of frames: 6 bits of epoch, 24 of seconds, 20 of frame
+{
+    return ((uint64_t)epoch << 44) | ((uint64_t)second << 20) | (uint64_t)frame;
+}
+
+void vdifidx_name(char *idxname, int len, const char *vdifname)
+// Default index file of a VDIF file
+{
+    snprintf(idxname, len, "%s%s", vdifname, VDIFIDX_SUFFIX);
+}
+
+static int64_t vdifidx_mjdsec(int epoch, int second)
+// Seconds since MJD 0, as epochs are 6-month periods of unequal length
+{
+    return (int64_t)ymd2mjd(2000 + epoch / 2, (epoch % 2) * 6 + 1, 1) * 86400 + second;
+}
+
+static void vdifidx_gaps(FILE *fp, struct vdifidx_hdr *hdr, const struct vdifidx_entry *entry)
+// Append the gaps in frame count of each thread to the index
+{
+    int64_t last[VDIFIDX_MAXTHREAD], t, d;
+    struct vdifidx_gap gap;
+    uint64_t i;
+
+    for (i = 0 ; i < VDIFIDX_MAXTHREAD ; i++)
+        last[i] = -1;
+    hdr->ngap = 0;
+    for (i = 0 ; i < hdr->nentry ; i++) {
+        t = vdifidx_mjdsec(entry[i].epoch, entry[i].second) * hdr->fps + entry[i].frame;
+        if (last[entry[i].thread] >= 0) {
+            d = t - last[entry[i].thread] - 1;
+            if (d > 0) {
+                gap.entry = i;
+                gap.nmissing = d;
+                fwrite(&gap, sizeof(gap), 1, fp);
+                hdr->ngap++;
+            }
+        }
+        if (t > last[entry[i].thread])
+            last[entry[i].thread] = t;
+    }
+}
+
+static void vdifidx_check(const char *vdifname, int framebytes)
+// A frame size that cannot be walked by, exits
+{
+    if (framebytes < VDIF_HEADER_BYTES + 8 || framebytes > MAX_VDIF_FRAME_BYTES) {
+        fprintf(stderr, "Error: Wrong VDIF frame size %d for %s.\n", framebytes, vdifname);
+        exit(1);
+    }
+}
+
+int64_t vdifidx_build(const char *vdifname, const char *idxname, int framebytes, int fps)
+// Scan a VDIF file once and write its index. With framebytes 0 the size
+// of the first frame is used; with fps 0 it is taken as the largest frame
+// number seen plus one. Returns the number of frames indexed. The index
+// is written under a temporary name and renamed once complete, so an
+// interrupted build leaves no index behind.
+{
+    struct vdifmap *vm;
+    struct vdifidx_hdr hdr;
+    struct vdifidx_entry e;
+    const unsigned char *fr;
+    const vdif_header *vh;
+    char tmpname[2048];
+    FILE *fp;
+    void *map;
+    uint32_t maxframe = 0;
+    int skipped = 0;
+
+    vm = vdifmap_open(vdifname, 256000000);
+    if (framebytes <= 0) {
+        fr = vdifmap_get(vm, VDIF_HEADER_BYTES);
+        if (fr == NULL) {
+            fprintf(stderr, "Error: No VDIF frame in %s.\n", vdifname);
+            exit(1);
+        }
+        framebytes = getVDIFFrameBytes((const vdif_header *)fr);
+    }
+    vdifidx_check(vdifname, framebytes);
+
+    snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", idxname, (int)getpid());
+    fp = fopen(tmpname, "wb+");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Cannot create %s.\n", tmpname);
+        exit(1);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VDIFIDX_MAGIC, 8);
+    hdr.framebytes = framebytes;
+    hdr.fsize = vdifmap_left(vm);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    // Walk the frames, skipping bytes where the frame size does not match
+    memset(&e, 0, sizeof(e));
+    while ((fr = vdifmap_get(vm, VDIF_HEADER_BYTES)) != NULL) {
+        if (getVDIFFrameBytes((const vdif_header *)fr) != framebytes) {
+            vdifmap_skip(vm, 1);
+            skipped = 1;
+            continue;
+        }
+        // Not a whole frame left
+        fr = vdifmap_get(vm, framebytes);
+        if (fr == NULL)
+            break;
+        vh = (const vdif_header *)fr;
+        e.offset = vdifmap_tell(vm);
+        e.second = getVDIFFrameEpochSecOffset(vh);
+        e.frame = getVDIFFrameNumber(vh);
+        e.thread = getVDIFThreadID(vh);
+        e.epoch = getVDIFEpoch(vh);
+        e.flags = (getVDIFFrameInvalid(vh) ? 0 : VDIFIDX_VALID) | (skipped ? VDIFIDX_RESYNC : 0);
+        fwrite(&e, sizeof(e), 1, fp);
+        hdr.nentry++;
+        if (e.frame > maxframe)
+            maxframe = e.frame;
+        skipped = 0;
+        vdifmap_skip(vm, framebytes);
+    }
+    vdifmap_close(vm);
+    hdr.fps = (fps > 0) ? fps : maxframe + 1;
+
+    // Gaps, from the entries just written
+    fflush(fp);
+    if (hdr.nentry > 0) {
+        map = mmap(NULL, sizeof(hdr) + hdr.nentry * sizeof(e), PROT_READ, MAP_SHARED, fileno(fp), 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        fseek(fp, 0, SEEK_END);
+        vdifidx_gaps(fp, &hdr, (const struct vdifidx_entry *)((char *)map + sizeof(hdr)));
+        munmap(map, sizeof(hdr) + hdr.nentry * sizeof(e));
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    if (ferror(fp) || fclose(fp) != 0 || rename(tmpname, idxname) != 0) {
+        fprintf(stderr, "Error: Cannot write %s.\n", idxname);
+        unlink(tmpname);
+        exit(1);
+    }
+
+    return hdr.nentry;
+}
+
+struct vdifidx *vdifidx_open(const char *idxname)
+// Map an index, NULL if there is none
+{
+    struct vdifidx *ix;
+    struct stat st;
+
+    ix = (struct vdifidx *)calloc(1, sizeof(struct vdifidx));
+    ix->fd = open(idxname, O_RDONLY);
+    if (ix->fd < 0 || fstat(ix->fd, &st) != 0 || st.st_size < (off_t)sizeof(struct vdifidx_hdr)) {
+        if (ix->fd >= 0)
+            close(ix->fd);
+        free(ix);
+        return NULL;
+    }
+    ix->len = st.st_size;
+    ix->map = mmap(NULL, ix->len, PROT_READ, MAP_SHARED, ix->fd, 0);
+    if (ix->map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    ix->hdr = (const struct vdifidx_hdr *)ix->map;
+    if (memcmp(ix->hdr->magic, VDIFIDX_MAGIC, 8) != 0 ||
+        ix->len < sizeof(struct vdifidx_hdr) + ix->hdr->nentry * sizeof(struct vdifidx_entry)
+                  + ix->hdr->ngap * sizeof(struct vdifidx_gap)) {
+        fprintf(stderr, "Error: %s is not a complete VDIF frame index.\n", idxname);
+        exit(1);
+    }
+    ix->entry = (const struct vdifidx_entry *)(ix->hdr + 1);
+    ix->gap = (const struct vdifidx_gap *)(ix->entry + ix->hdr->nentry);
+    madvise(ix->map, ix->len, MADV_SEQUENTIAL);
+
+    return ix;
+}
+
+struct vdifidx *vdifidx_open_for(const char *vdifname, int framebytes)
+// Map the default index of a VDIF file, building it first if missing or
+// if it was built from a file of another size or frame size
+{
+    char idxname[2048];
+    struct vdifidx *ix;
+    struct stat st;
+
+    if (framebytes > 0)
+        vdifidx_check(vdifname, framebytes);
+    vdifidx_name(idxname, sizeof(idxname), vdifname);
+    ix = vdifidx_open(idxname);
+    if (ix != NULL && (stat(vdifname, &st) != 0 || ix->hdr->fsize != (uint64_t)st.st_size ||
+                       (framebytes > 0 && ix->hdr->framebytes != (uint32_t)framebytes))) {
+        printf("Frame index %s does not match %s.\n", idxname, vdifname);
+        vdifidx_close(ix);
+        ix = NULL;
+    }
+    if (ix == NULL) {
+        printf("Building frame index %s...\n", idxname);
+        vdifidx_build(vdifname, idxname, framebytes, 0);
+        ix = vdifidx_open(idxname);
+    }
+
+    return ix;
+}
+
+int64_t vdifidx_find(const struct vdifidx *ix, int epoch, int second, int frame, int thread)
+// Entry of the frame of a thread at the given time, -1 if not in the file.
+// Thread -1 matches any thread. Frames are assumed in time order.
+{
+    uint64_t key = vdifidx_key(epoch, second, frame), k;
+    int64_t lo = 0, hi = ix->hdr->nentry, mid;
+    const struct vdifidx_entry *e;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        e = &ix->entry[mid];
+        if (vdifidx_key(e->epoch, e->second, e->frame) < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for ( ; lo < (int64_t)ix->hdr->nentry ; lo++) {
+        e = &ix->entry[lo];
+        k = vdifidx_key(e->epoch, e->second, e->frame);
+        if (k != key)
+            break;
+        if (thread < 0 || e->thread == thread)
+            return lo;
+    }
+
+    return -1;
+}
+
+void vdifidx_close(struct vdifidx *ix)
+{
+    munmap(ix->map, ix->len);
+    close(ix->fd);
+    free(ix);
+}
@@ -0,0 +1,60 @@
+/* vdifidx.h */
+#ifndef _VDIFIDX_H
+#define _VDIFIDX_H
+#include <stdint.h>
+#include <stddef.h>
+
+// Binary index of the frames of a VDIF file, written next to it as
+// <file>.vidx by mkvdifidx and read back memory mapped. The file is a
+// vdifidx_hdr, then nentry vdifidx_entry in file order, then ngap
+// vdifidx_gap.
+
+#define VDIFIDX_MAGIC "VDIFIDX1"
+#define VDIFIDX_SUFFIX ".vidx"
+
+// Entry flags
+#define VDIFIDX_VALID  0x01     // Frame not flagged invalid
+#define VDIFIDX_RESYNC 0x02     // Bytes were skipped before this frame
+
+struct vdifidx_hdr {
+    char magic[8];              // VDIFIDX_MAGIC
+    uint32_t framebytes;        // Frame size, including header
+    uint32_t fps;               // Frames per second per thread
+    uint64_t fsize;             // Size of the indexed VDIF file
+    uint64_t nentry;            // Number of frames
+    uint64_t ngap;              // Number of gaps
+};
+
+struct vdifidx_entry {
+    uint64_t offset;            // Byte offset of the frame in the VDIF file
+    uint32_t second;            // Seconds from reference epoch
+    uint32_t frame;             // Frame number within the second
+    uint16_t thread;            // Thread ID
+    uint8_t epoch;              // Reference epoch, 6-month periods since 2000
+    uint8_t flags;              // VDIFIDX_*
+    uint32_t pad;
+};
+
+struct vdifidx_gap {
+    uint64_t entry;             // First frame after the gap
+    uint64_t nmissing;          // Frames missing in the thread of that frame
+};
+
+struct vdifidx {
+    int fd;
+    void *map;
+    size_t len;
+    const struct vdifidx_hdr *hdr;
+    const struct vdifidx_entry *entry;
+    const struct vdifidx_gap *gap;
+};
+
+// In vdifidx.c
+void vdifidx_name(char *idxname, int len, const char *vdifname);
+int64_t vdifidx_build(const char *vdifname, const char *idxname, int framebytes, int fps);
+struct vdifidx *vdifidx_open(const char *idxname);
+struct vdifidx *vdifidx_open_for(const char *vdifname, int framebytes);
+int64_t vdifidx_find(const struct vdifidx *ix, int epoch, int second, int frame, int thread);
+void vdifidx_close(struct vdifidx *ix);
+
+#endif
@@ -0,0 +1,110 @@
+/* vdifmap.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vdifmap.h"
+
+struct vdifmap *vdifmap_open(const char *name, size_t window)
+// Open a VDIF file for reading through windows of at least window bytes
+{
+    struct vdifmap *vm;
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+
+    vm = (struct vdifmap *)calloc(1, sizeof(struct vdifmap));
+    vm->fd = open(name, O_RDONLY);
+    if (vm->fd < 0 || fstat(vm->fd, &st) != 0) {
+        fprintf(stderr, "Error: Cannot open %s.\n", name);
+        exit(1);
+    }
+    vm->fsize = st.st_size;
+    vm->window = (window + page - 1) / page * page;
+    if (vm->window < (size_t)page)
+        vm->window = page;
+    posix_fadvise(vm->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    return vm;
+}
+
+static int vdifmap_remap(struct vdifmap *vm, size_t n)
+// Map a window holding [pos, pos+n). Returns 0 if past the end of file.
+{
+    long page = sysconf(_SC_PAGESIZE);
+    off_t off;
+    size_t len;
+    void *p;
+
+    if (vm->pos + (off_t)n > vm->fsize)
+        return 0;
+    off = vm->pos / page * page;
+    len = vm->window;
+    if ((off_t)len < vm->pos - off + (off_t)n)
+        len = vm->pos - off + n;
+    if (off + (off_t)len > vm->fsize)
+        len = vm->fsize - off;
+
+    p = mmap(NULL, len, PROT_READ, MAP_SHARED, vm->fd, off);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    madvise(p, len, MADV_SEQUENTIAL);
+    madvise(p, len, MADV_WILLNEED);
+
+    // Keep the current window for pointers still in use, drop the one before
+    if (vm->oldmap != NULL)
+        munmap(vm->oldmap, vm->oldlen);
+    vm->oldmap = vm->map;
+    vm->oldlen = vm->maplen;
+    vm->map = (unsigned char *)p;
+    vm->mapoff = off;
+    vm->maplen = len;
+
+    return 1;
+}
+
+const unsigned char *vdifmap_get(struct vdifmap *vm, size_t n)
+// Pointer to the n bytes at the current position, NULL if the file ends before
+{
+    if (vm->map == NULL || vm->pos < vm->mapoff ||
+        vm->pos + (off_t)n > vm->mapoff + (off_t)vm->maplen) {
+        if (!vdifmap_remap(vm, n))
+            return NULL;
+    }
+
+    return vm->map + (vm->pos - vm->mapoff);
+}
+
+void vdifmap_skip(struct vdifmap *vm, off_t n)
+{
+    vm->pos += n;
+}
+
+void vdifmap_seek(struct vdifmap *vm, off_t pos)
+{
+    vm->pos = pos;
+}
+
+off_t vdifmap_tell(const struct vdifmap *vm)
+{
+    return vm->pos;
+}
+
+off_t vdifmap_left(const struct vdifmap *vm)
+// Bytes left from the current position to the end of file
+{
+    return (vm->pos < vm->fsize) ? vm->fsize - vm->pos : 0;
+}
+
+void vdifmap_close(struct vdifmap *vm)
+{
+    if (vm->oldmap != NULL)
+        munmap(vm->oldmap, vm->oldlen);
+    if (vm->map != NULL)
+        munmap(vm->map, vm->maplen);
+    close(vm->fd);
+    free(vm);
+}
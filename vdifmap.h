@@ -0,0 +1,32 @@
+/* vdifmap.h */
+#ifndef _VDIFMAP_H
+#define _VDIFMAP_H
+#include <sys/types.h>
+
+// Memory mapped, sequential reader of a VDIF file. Data are handed out
+// in place through a sliding window of the file, so memory use stays
+// bounded whatever the file size. A pointer returned by vdifmap_get()
+// stays valid until the reader has moved one whole window further on,
+// since the previous window is only unmapped when the next one is mapped.
+struct vdifmap {
+    int fd;
+    off_t fsize;                // File size
+    off_t pos;                  // Current reading position in the file
+    size_t window;              // Size of the mapped windows
+    unsigned char *map;         // Current window
+    off_t mapoff;               // File offset of the current window
+    size_t maplen;              // Length of the current window
+    unsigned char *oldmap;      // Previous window, still mapped
+    size_t oldlen;
+};
+
+// In vdifmap.c
+struct vdifmap *vdifmap_open(const char *name, size_t window);
+const unsigned char *vdifmap_get(struct vdifmap *vm, size_t n);
+void vdifmap_skip(struct vdifmap *vm, off_t n);
+void vdifmap_seek(struct vdifmap *vm, off_t pos);
+off_t vdifmap_tell(const struct vdifmap *vm);
+off_t vdifmap_left(const struct vdifmap *vm);
+void vdifmap_close(struct vdifmap *vm);
+
+#endif
@@ -0,0 +1,109 @@
+/* vdifstat.c */
+// Running statistics for filling invalid and missing frames. Sampler level
+// moments come straight from packed 2-bit bytes: the bytes are counted by
+// value and a per-byte table of the levels of its 4 samples turns the
+// counts into sums.
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "vdifstat.h"
+
+void vdifstat_moments(const unsigned char *src, int bytes, double *m1, double *m2)
+// Mean and mean square of the levels of the 2-bit samples in bytes of src
+{
+    uint64_t hist[256], sum, sumsq;
+    int ii, ss, l;
+
+    memset(hist, 0, sizeof(hist));
+    for (ii = 0 ; ii < bytes ; ii++)
+        hist[src[ii]]++;
+
+    sum = sumsq = 0;
+    for (ii = 0 ; ii < 256 ; ii++) {
+        if (hist[ii] == 0)
+            continue;
+        for (ss = 0 ; ss < 4 ; ss++) {
+            l = (ii >> (2 * ss)) & 0x3;
+            sum += hist[ii] * l;
+            sumsq += hist[ii] * l * l;
+        }
+    }
+    *m1 = (double)sum / (4.0 * bytes);
+    *m2 = (double)sumsq / (4.0 * bytes);
+}
+
+struct ewstat *ewstat_create(int n, double len)
+{
+    struct ewstat *es;
+
+    es = (struct ewstat *)calloc(1, sizeof(struct ewstat));
+    es->n = n;
+    es->len = (len < 1.0) ? 1.0 : len;
+    es->m1 = (double *)calloc(n, sizeof(double));
+    es->m2 = (double *)calloc(n, sizeof(double));
+
+    return es;
+}
+
+void ewstat_destroy(struct ewstat *es)
+{
+    free(es->m1);
+    free(es->m2);
+    free(es);
+}
+
+static double ewstat_weight(const struct ewstat *es)
+// Weight of the next update
+{
+    if ((double)es->nupd + 1.0 < es->len)
+        return 1.0 / ((double)es->nupd + 1.0);
+    return 1.0 / es->len;
+}
+
+void ewstat_update(struct ewstat *es, const float *x)
+// Update with one value of each of the n
+{
+    double w, v, lim;
+    int ii;
+
+    w = ewstat_weight(es);
+    for (ii = 0 ; ii < es->n ; ii++) {
+        v = x[ii];
+        if ((double)es->nupd >= es->len) {
+            lim = EWSTAT_CLIP * ewstat_rms(es, ii);
+            if (v > es->m1[ii] + lim)
+                v = es->m1[ii] + lim;
+            else if (v < es->m1[ii] - lim)
+                v = es->m1[ii] - lim;
+        }
+        es->m1[ii] += w * (v - es->m1[ii]);
+        es->m2[ii] += w * (v * v - es->m2[ii]);
+    }
+    es->nupd++;
+}
+
+void ewstat_update_moments(struct ewstat *es, const double *m1, const double *m2)
+// Update with the moments of a block of values of each of the n
+{
+    double w;
+    int ii;
+
+    w = ewstat_weight(es);
+    for (ii = 0 ; ii < es->n ; ii++) {
+        es->m1[ii] += w * (m1[ii] - es->m1[ii]);
+        es->m2[ii] += w * (m2[ii] - es->m2[ii]);
+    }
+    es->nupd++;
+}
+
+double ewstat_mean(const struct ewstat *es, int i)
+{
+    return es->m1[i];
+}
+
+double ewstat_rms(const struct ewstat *es, int i)
+{
+    double v = es->m2[i] - es->m1[i] * es->m1[i];
+
+    return (v > 0.0) ? sqrt(v) : 0.0;
+}
@@ -0,0 +1,31 @@
+/* vdifstat.h */
+#ifndef _VDIFSTAT_H
+#define _VDIFSTAT_H
+#include <stdint.h>
+
+// Exponentially weighted running mean and rms of n values, for filling
+// invalid frames from the data converted so far. Until len updates have
+// been seen all updates weigh the same, later ones weigh 1/len. Once
+// warmed up, values beyond EWSTAT_CLIP rms from the mean are clipped.
+struct ewstat {
+    int n;                              // Number of values tracked
+    double len;                         // Averaging length, in updates
+    int64_t nupd;                       // Updates so far
+    double *m1, *m2;                    // Running first and second moments
+};
+
+#define EWSTAT_CLIP 5.0
+// Valid frames read ahead to seed the running statistics
+#define EWSTAT_LOOKAHEAD 256
+
+// In vdifstat.c
+// Levels are 0 to 3, as the samples come out of convert2to8()
+void vdifstat_moments(const unsigned char *src, int bytes, double *m1, double *m2);
+struct ewstat *ewstat_create(int n, double len);
+void ewstat_destroy(struct ewstat *es);
+void ewstat_update(struct ewstat *es, const float *x);
+void ewstat_update_moments(struct ewstat *es, const double *m1, const double *m2);
+double ewstat_mean(const struct ewstat *es, int i);
+double ewstat_rms(const struct ewstat *es, int i);
+
+#endif
@@ -33,6 +33,44 @@ int psrfits_obs_mode(const char *obs_mode) {
     return(search);
 }
 
+static void psrfits_init_write(struct psrfits *pf) {
+    // Initialize the key variables before writing the first file
+    pf->status = 0;
+    pf->tot_rows = 0;
+    pf->N = 0L;
+    pf->T = 0.0;
+    pf->hdr.offset_subint = 0;
+    pf->mode = 'w';
+
+    // Create the output directory if needed
+    char datadir[1024];
+    strncpy(datadir, pf->basefilename, 1023);
+    char *last_slash = strrchr(datadir, '/');
+    if (last_slash!=NULL && last_slash!=datadir) {
+        *last_slash = '\0';
+        printf("Using directory '%s' for output.\n", datadir);
+        char cmd[1024];
+        sprintf(cmd, "mkdir -m 1777 -p %s", datadir);
+        system(cmd);
+    }
+}
+
+int psrfits_create_shard(struct psrfits *pf, int filenum, int tot_rows) {
+    // Start writing a part of a scan that is written by several processes.
+    // The first file of the part is number filenum+1 and tot_rows subints
+    // come before it, so that NSUBOFFS, OFFS_SUB and the file numbering
+    // go on as if the whole scan was written by one process.
+    struct hdrinfo *hdr = &(pf->hdr);
+
+    psrfits_init_write(pf);
+    pf->filenum = filenum;
+    pf->tot_rows = tot_rows;
+    pf->N = (long long)tot_rows * (hdr->nsblk / hdr->ds_time_fact);
+    pf->T = tot_rows * hdr->nsblk * hdr->dt;
+
+    return psrfits_create(pf);
+}
+
 int psrfits_create(struct psrfits *pf) {
     int itmp, *status;
     long long lltmp;
@@ -59,26 +97,8 @@ int psrfits_create(struct psrfits *pf) {
     }
 
     // Initialize the key variables if needed
-    if (pf->filenum == 0) {  // first time writing to the file
-        pf->status = 0;
-        pf->tot_rows = 0;
-        pf->N = 0L;
-        pf->T = 0.0;
-        hdr->offset_subint = 0;
-        pf->mode = 'w';
-
-        // Create the output directory if needed
-        char datadir[1024];
-        strncpy(datadir, pf->basefilename, 1023);
-        char *last_slash = strrchr(datadir, '/');
-        if (last_slash!=NULL && last_slash!=datadir) {
-            *last_slash = '\0';
-            printf("Using directory '%s' for output.\n", datadir);
-            char cmd[1024];
-            sprintf(cmd, "mkdir -m 1777 -p %s", datadir);
-            system(cmd);
-        }
-    }
+    if (pf->filenum == 0)  // first time writing to the file
+        psrfits_init_write(pf);
     pf->filenum++;
     pf->rownum = 1;
     hdr->offset_subint = pf->tot_rows;
@@ -306,7 +326,22 @@ int psrfits_create(struct psrfits *pf) {
 }
 
 
+int psrfits_next_file(struct psrfits *pf) {
+    // Close the current file and create the next one of the scan
+    if (pf->filenum) {
+        printf("Closing file '%s'\n", pf->filename);
+        fits_close_file(pf->fptr, &(pf->status));
+    }
+    return psrfits_create(pf);
+}
+
 int psrfits_write_subint(struct psrfits *pf) {
+    return psrfits_write_row(pf, 1);
+}
+
+int psrfits_write_row(struct psrfits *pf, int flush) {
+    // Write the subint in pf->sub as the next row, flushing the file
+    // buffers to disk only if flush is set
     int row, *status, nchan, nivals, mode, out_nbytes;
     float ftmp;
     struct hdrinfo *hdr;
@@ -334,11 +369,7 @@ int psrfits_write_subint(struct psrfits *pf) {
     if (pf->filenum==0 || 
             ( (mode==search || pf->multifile==1) 
               && pf->rownum > pf->rows_per_file)) {
-        if (pf->filenum) {
-            printf("Closing file '%s'\n", pf->filename);
-            fits_close_file(pf->fptr, status);
-        }
-        psrfits_create(pf);
+        psrfits_next_file(pf);
     }
 
     row = pf->rownum;
@@ -385,7 +416,8 @@ int psrfits_write_subint(struct psrfits *pf) {
     //        correcting NAXIS2 and using fits_flush_buffer()
     //        caused occasional hangs (and extrememly large
     //        files due to some infinite loop).
-    fits_flush_file(pf->fptr, status);
+    if (flush)
+        fits_flush_file(pf->fptr, status);
 
     // Print status if bad
     if (*status) {